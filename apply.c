@@ -4,6 +4,7 @@
 
 #include "apply.h"
 #include "eek_internal.h"
+#include "mem.h"
 #include "util.h"
 
 static int
@@ -308,6 +309,17 @@ containsnl(const char *s, long n)
 	return 0;
 }
 
+/*
+ * iofree releases :apply input/output buffers and their Memapply charge.
+ */
+static void
+iofree(char *in, long inn, char *out, long outn)
+{
+	memcount(Memapply, -(long long)(inn + outn));
+	free(in);
+	free(out);
+}
+
 static const Apply *
 applylookup(const char *name)
 {
@@ -389,7 +401,7 @@ applyexec(Eek *e, const char *argline)
 			return -1;
 		}
 		for (y = y0; y <= y1; y++) {
-			l = bufgetline(&e->b, y);
+			l = bufeditline(&e->b, y);
 			if (l == nil)
 				continue;
 			ln = lsz(l->n);
@@ -426,28 +438,29 @@ applyexec(Eek *e, const char *argline)
 				return -1;
 			}
 			free(seg);
+			memcount(Memapply, outn);
 			if (containsnl(outbuf, outn)) {
-				free(outbuf);
+				iofree(nil, 0, outbuf, outn);
 				setmsg(e, "apply: block output may not contain newlines");
 				argvfree(av, ac);
 				return -1;
 			}
 
 			if (linedelrange(l, cx0, (size_t)(cx1 - cx0)) < 0) {
-				free(outbuf);
+				iofree(nil, 0, outbuf, outn);
 				setmsg(e, "Out of memory");
 				argvfree(av, ac);
 				return -1;
 			}
 			if (outn > 0) {
 				if (lineinsert(l, cx0, outbuf, (size_t)outn) < 0) {
-					free(outbuf);
+					iofree(nil, 0, outbuf, outn);
 					setmsg(e, "Out of memory");
 					argvfree(av, ac);
 					return -1;
 				}
 			}
-			free(outbuf);
+			iofree(nil, 0, outbuf, outn);
 			e->dirty = 1;
 		}
 		e->cy = y0;
@@ -478,26 +491,26 @@ applyexec(Eek *e, const char *argline)
 		argvfree(av, ac);
 		return -1;
 	}
+	memcount(Memapply, inn);
 	if (ap->fn(in ? in : "", inn, ac, av, &outbuf, &outn) < 0) {
 		setmsg(e, "apply failed: %s", av[0]);
-		free(in);
+		iofree(in, inn, nil, 0);
 		free(outbuf);
 		argvfree(av, ac);
 		return -1;
 	}
+	memcount(Memapply, outn);
 
 	if (outn == inn && (outn <= 0 || (outbuf && in && memcmp(outbuf, in, (size_t)outn) == 0))) {
 		setmsg(e, "apply: no change");
-		free(in);
-		free(outbuf);
+		iofree(in, inn, outbuf, outn);
 		argvfree(av, ac);
 		return 0;
 	}
 
 	if (undopush(e) < 0) {
 		setmsg(e, "Out of memory");
-		free(in);
-		free(outbuf);
+		iofree(in, inn, outbuf, outn);
 		argvfree(av, ac);
 		return -1;
 	}
@@ -505,15 +518,13 @@ applyexec(Eek *e, const char *argline)
 	startx = sx;
 	if (delrange(e, sy, sx, ey, ex, 0) < 0) {
 		setmsg(e, "Out of memory");
-		free(in);
-		free(outbuf);
+		iofree(in, inn, outbuf, outn);
 		argvfree(av, ac);
 		return -1;
 	}
 	if (inserttext(e, outbuf, outn) < 0) {
 		setmsg(e, "Out of memory");
-		free(in);
-		free(outbuf);
+		iofree(in, inn, outbuf, outn);
 		argvfree(av, ac);
 		return -1;
 	}
@@ -522,8 +533,7 @@ applyexec(Eek *e, const char *argline)
 	e->cx = startx;
 	normalfixcursor(e);
 	setmsg(e, "applied %s", av[0]);
-	free(in);
-	free(outbuf);
+	iofree(in, inn, outbuf, outn);
 	argvfree(av, ac);
 	return 0;
 }
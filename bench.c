@@ -0,0 +1,348 @@
+/*
+ * eekbench: microbenchmarks for the buffer layer (buf.c).
+ *
+ * Usage: eekbench [-s scale]
+ *
+ * Every benchmark uses a fixed seed so runs are comparable. Results are
+ * printed one per line as tab-separated fields:
+ *
+ *	name	param	ops	ns/op	MB/s
+ *
+ * MB/s is 0 where no byte volume applies. -s divides all sizes and
+ * iteration counts by scale for a quick smoke run.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "util.h"
+
+static long scale = 1;
+static unsigned long long rngstate;
+
+/*
+ * rng returns the next xorshift64* value.
+ */
+static unsigned long long
+rng(void)
+{
+	rngstate ^= rngstate >> 12;
+	rngstate ^= rngstate << 25;
+	rngstate ^= rngstate >> 27;
+	return rngstate * 2685821657736338717ULL;
+}
+
+/*
+ * seed resets the generator so each benchmark sees the same sequence.
+ */
+static void
+seed(unsigned long long s)
+{
+	rngstate = s ? s : 1;
+}
+
+/*
+ * nowns returns the monotonic clock in nanoseconds.
+ */
+static double
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * report prints one result line.
+ */
+static void
+report(const char *name, const char *param, long ops, double ns, double bytes)
+{
+	double mbs;
+
+	mbs = ns > 0 && bytes > 0 ? bytes / (1024.0 * 1024.0) / (ns / 1e9) : 0;
+	printf("%s\t%s\t%ld\t%.1f\t%.1f\n", name, param, ops, ops > 0 ? ns / (double)ops : 0, mbs);
+	fflush(stdout);
+}
+
+/*
+ * randline fills s with a printable line of 0..maxn-1 bytes.
+ *
+ * Returns:
+ *  - the line length.
+ */
+static size_t
+randline(char *s, size_t maxn)
+{
+	size_t n, i;
+
+	n = (size_t)(rng() % maxn);
+	for (i = 0; i < n; i++)
+		s[i] = (char)(' ' + rng() % 95);
+	return n;
+}
+
+/*
+ * mkfile writes a temp file of about size bytes of random lines.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure.
+ */
+static int
+mkfile(char *path, size_t size)
+{
+	char line[256];
+	FILE *fp;
+	size_t done, n;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "w");
+	if (fp == nil) {
+		close(fd);
+		return -1;
+	}
+	seed(1);
+	for (done = 0; done < size; done += n + 1) {
+		n = randline(line, 160);
+		line[n] = '\n';
+		fwrite(line, 1, n + 1, fp);
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+/*
+ * bufbytes returns the number of bytes b occupies on disk.
+ */
+static double
+bufbytes(Buf *b)
+{
+	double t;
+	long i;
+
+	t = 0;
+	for (i = 0; i < (long)b->nline; i++)
+		t += (double)bufgetline(b, i)->n + 1;
+	return t;
+}
+
+/*
+ * benchio times bufload, bufsave and bufcopy on a size byte file.
+ */
+static void
+benchio(size_t size)
+{
+	char path[PATH_MAX];
+	char out[PATH_MAX + 4];
+	char param[32];
+	const char *dir;
+	Buf b, c;
+	double t, bytes;
+
+	size /= (size_t)scale;
+	dir = getenv("TMPDIR");
+	if (dir == nil || *dir == 0)
+		dir = "/tmp";
+	snprintf(path, sizeof path, "%s/eekbenchXXXXXX", dir);
+	if (mkfile(path, size) < 0)
+		die("eekbench: temp file: %s", strerror(errno));
+	snprintf(out, sizeof out, "%s.out", path);
+	snprintf(param, sizeof param, "%zuB", size);
+
+	bufinit(&b);
+	t = nowns();
+	if (bufload(&b, path) < 0)
+		die("eekbench: bufload failed");
+	t = nowns() - t;
+	bytes = bufbytes(&b);
+	report("bufload", param, 1, t, bytes);
+
+	t = nowns();
+	if (bufsave(&b, out) < 0)
+		die("eekbench: bufsave failed");
+	t = nowns() - t;
+	report("bufsave", param, 1, t, bytes);
+
+	bufinit(&c);
+	t = nowns();
+	if (bufcopy(&c, &b) < 0)
+		die("eekbench: bufcopy failed");
+	t = nowns() - t;
+	report("bufcopy", param, 1, t, bytes);
+
+	buffree(&c);
+	buffree(&b);
+	unlink(out);
+	unlink(path);
+}
+
+/*
+ * benchlines times bufinsertline/bufdelline at sequential and random
+ * positions in a buffer of nline lines.
+ */
+static void
+benchlines(long nline, long seqops, long rndops)
+{
+	char line[256];
+	char param[32];
+	Buf b;
+	size_t n;
+	double t;
+	long i, at, ops;
+	int rnd;
+
+	nline /= scale;
+	snprintf(param, sizeof param, "%ldlines", nline);
+	for (rnd = 0; rnd < 2; rnd++) {
+		/* Random positions move the gap ~nline/3 lines per op; run fewer. */
+		ops = (rnd ? rndops : seqops) / scale;
+		seed(2);
+		bufinit(&b);
+		for (i = 0; i < nline; i++) {
+			n = randline(line, 80);
+			if (bufinsertline(&b, i, line, n) < 0)
+				die("Out of memory");
+		}
+		n = randline(line, 80);
+		t = nowns();
+		for (i = 0; i < ops; i++) {
+			at = rnd ? (long)(rng() % b.nline) : (nline / 2 + i) % (long)b.nline;
+			if (bufinsertline(&b, at, line, n) < 0)
+				die("Out of memory");
+		}
+		t = nowns() - t;
+		report(rnd ? "bufinsertline.random" : "bufinsertline.seq", param, ops, t, 0);
+
+		t = nowns();
+		for (i = 0; i < ops; i++) {
+			at = rnd ? (long)(rng() % b.nline) : nline / 2;
+			bufdelline(&b, at);
+		}
+		t = nowns() - t;
+		report(rnd ? "bufdelline.random" : "bufdelline.seq", param, ops, t, 0);
+		buffree(&b);
+	}
+}
+
+/*
+ * benchgap times lineinsert/linedelrange on a len byte line where every
+ * edit lands dist bytes away from the previous one, so the gap has to
+ * travel dist bytes per operation.
+ */
+static void
+benchgap(size_t len, size_t dist, long ops)
+{
+	char param[48];
+	Line l;
+	char *s;
+	double t;
+	long i;
+	size_t at;
+
+	len /= (size_t)scale;
+	ops /= scale;
+	if (dist >= len)
+		dist = len / 2;
+	s = malloc(len);
+	if (s == nil)
+		die("Out of memory");
+	memset(s, 'x', len);
+	memset(&l, 0, sizeof l);
+	if (lineinsert(&l, 0, s, len) < 0)
+		die("Out of memory");
+	snprintf(param, sizeof param, "%zuB/d%zu", len, dist);
+
+	at = len / 2;
+	t = nowns();
+	for (i = 0; i < ops; i++) {
+		at = (i & 1) ? at - dist : at + dist;
+		lineinsert(&l, (long)at, "y", 1);
+	}
+	t = nowns() - t;
+	report("lineinsert", param, ops, t, 0);
+
+	t = nowns();
+	for (i = 0; i < ops; i++) {
+		at = (i & 1) ? at - dist : at + dist;
+		linedelrange(&l, (long)at, 1);
+	}
+	t = nowns() - t;
+	report("linedelrange", param, ops, t, 0);
+
+	free(l.s);
+	free(s);
+}
+
+/*
+ * benchbytes times linebytes on a len byte line whose gap sits in the
+ * middle, i.e. the cost of making an edited line contiguous again.
+ */
+static void
+benchbytes(size_t len, long ops)
+{
+	char param[32];
+	Line l;
+	char *s;
+	double t;
+	long i;
+
+	len /= (size_t)scale;
+	if (len < 2)
+		len = 2;
+	if (ops > 1 && ops / scale > 0)
+		ops /= scale;
+	s = malloc(len);
+	if (s == nil)
+		die("Out of memory");
+	memset(s, 'x', len);
+	memset(&l, 0, sizeof l);
+	if (lineinsert(&l, 0, s, len) < 0)
+		die("Out of memory");
+	snprintf(param, sizeof param, "%zuB", len);
+
+	t = 0;
+	for (i = 0; i < ops; i++) {
+		/* Park the gap in the middle; only linebytes itself is timed. */
+		lineinsert(&l, (long)len / 2, "y", 1);
+		linedelrange(&l, (long)len / 2, 1);
+		t -= nowns();
+		(void)linebytes(&l);
+		t += nowns();
+	}
+	report("linebytes", param, ops, t, (double)len / 2 * (double)ops);
+
+	free(l.s);
+	free(s);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "-s") == 0)
+		scale = atol(argv[2]);
+	else if (argc != 1)
+		die("usage: eekbench [-s scale]");
+	if (scale < 1)
+		scale = 1;
+
+	printf("name\tparam\tops\tns/op\tMB/s\n");
+	benchio(64UL << 20);
+	benchlines(1000000, 100000, 2000);
+	benchgap(1UL << 20, 0, 1000000);
+	benchgap(1UL << 20, 64, 1000000);
+	benchgap(1UL << 20, 4096, 100000);
+	benchgap(1UL << 20, 256UL << 10, 1000);
+	benchbytes(10, 1000000);
+	benchbytes(1UL << 10, 1000000);
+	benchbytes(1UL << 20, 1000);
+	benchbytes(100UL << 20, 5);
+	return 0;
+}
@@ -0,0 +1,551 @@
+#include <limits.h>
+#include <string.h>
+
+#include "buf.h"
+#include "brack.h"
+#include "mem.h"
+#include "util.h"
+
+enum {
+	Brblock = 256, /* Lines per block when blocks are (re)made. */
+	Brkinds = 4,   /* Delimiter pairs: () [] {} <>. */
+};
+
+/*
+ * Brsum is what a run of text leaves unbalanced, per pair: c closers that
+ * match openers before the run, then o openers that closers after it must
+ * match. Two runs combine by pairing the first's o with the second's c.
+ */
+typedef struct Brsum Brsum;
+struct Brsum {
+	long c[Brkinds];
+	long o[Brkinds];
+};
+
+typedef struct Brnode Brnode;
+struct Brnode {
+	long nline; /* Lines under the node. */
+	Brsum s;    /* Their unbalanced delimiters (stale while dirty). */
+	int dirty;  /* Leaves only: a line changed since s was counted. */
+};
+
+/*
+ * The index cuts the buffer into blocks of consecutive lines and keeps a
+ * sum tree over them: node[1] is the root, node[i] has the children
+ * node[2i] and node[2i + 1], and block j is the leaf node[size + j]. Edits
+ * only move line counts and mark blocks dirty; a query first rescans the
+ * dirty blocks.
+ */
+struct Brindex {
+	Brnode *node;  /* 2 * size nodes (node[0] is unused). */
+	long size;     /* Leaves: a power of two, at least nblock. */
+	long nblock;   /* Blocks in use. */
+	long *dirty;   /* Dirty blocks, each listed once. */
+	long ndirty;   /* Entries in dirty. */
+	long capdirty; /* Capacity of dirty. */
+	int reshape;   /* A block emptied or outgrew 2 * Brblock lines. */
+};
+
+/* brkind is k + 1 for the opener of pair k, -(k + 1) for its closer. */
+static const signed char brkind[256] = {
+	['('] = 1, [')'] = -1,
+	['['] = 2, [']'] = -2,
+	['{'] = 3, ['}'] = -3,
+	['<'] = 4, ['>'] = -4,
+};
+
+/*
+ * blocksum counts the unbalanced delimiters of lines y..y+n-1 into s.
+ */
+static void
+blocksum(Buf *b, long y, long n, Brsum *s)
+{
+	const unsigned char *p;
+	Line *l;
+	size_t i;
+	int k;
+
+	memset(s, 0, sizeof *s);
+	for (; n > 0; y++, n--) {
+		l = bufgetline(b, y);
+		if (l == nil)
+			continue;
+		p = (const unsigned char *)linebytes(l);
+		for (i = 0; i < l->n; i++) {
+			k = brkind[p[i]];
+			if (k > 0)
+				s->o[k - 1]++;
+			else if (k < 0 && s->o[-k - 1] > 0)
+				s->o[-k - 1]--;
+			else if (k < 0)
+				s->c[-k - 1]++;
+		}
+	}
+}
+
+/*
+ * pull recomputes the inner node i from its children.
+ */
+static void
+pull(Brnode *node, long i)
+{
+	Brnode *d, *l, *r;
+	long m;
+	int t;
+
+	d = &node[i];
+	l = &node[2 * i];
+	r = &node[2 * i + 1];
+	d->nline = l->nline + r->nline;
+	for (t = 0; t < Brkinds; t++) {
+		m = l->s.o[t] < r->s.c[t] ? l->s.o[t] : r->s.c[t];
+		d->s.c[t] = l->s.c[t] + r->s.c[t] - m;
+		d->s.o[t] = l->s.o[t] + r->s.o[t] - m;
+	}
+}
+
+/*
+ * locate returns the block holding line y (< the lines indexed) and
+ * stores the index of its first line in *start (if not nil).
+ */
+static long
+locate(Brindex *x, long y, long *start)
+{
+	long i, s;
+
+	s = 0;
+	for (i = 1; i < x->size;) {
+		if (y - s < x->node[2 * i].nline) {
+			i = 2 * i;
+		} else {
+			s += x->node[2 * i].nline;
+			i = 2 * i + 1;
+		}
+	}
+	if (start != nil)
+		*start = s;
+	return i - x->size;
+}
+
+/*
+ * blockstart returns the index of the first line of block j.
+ */
+static long
+blockstart(Brindex *x, long j)
+{
+	long i, s;
+
+	s = 0;
+	for (i = x->size + j; i > 1; i /= 2)
+		if (i % 2 == 1)
+			s += x->node[i - 1].nline;
+	return s;
+}
+
+/*
+ * addlines adds n (may be negative) to the line count of block j.
+ */
+static void
+addlines(Brindex *x, long j, long n)
+{
+	long i;
+
+	for (i = x->size + j; i >= 1; i /= 2)
+		x->node[i].nline += n;
+}
+
+/*
+ * markdirty queues block j for a rescan.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+static int
+markdirty(Brindex *x, long j)
+{
+	long *p;
+	long ncap;
+
+	if (x->node[x->size + j].dirty)
+		return 0;
+	if (x->ndirty == x->capdirty) {
+		ncap = x->capdirty > 0 ? x->capdirty * 2 : 16;
+		p = memrealloc(Membrack, x->dirty, (size_t)x->capdirty * sizeof p[0],
+			(size_t)ncap * sizeof p[0]);
+		if (p == nil)
+			return -1;
+		x->dirty = p;
+		x->capdirty = ncap;
+	}
+	x->dirty[x->ndirty++] = j;
+	x->node[x->size + j].dirty = 1;
+	return 0;
+}
+
+/*
+ * plant replaces x's tree with one over the n blocks leaf[0..n-1].
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure (x is unchanged).
+ */
+static int
+plant(Brindex *x, const Brnode *leaf, long n)
+{
+	Brnode *node;
+	long *p;
+	long size, i, nd;
+
+	for (size = 1; size < n; size *= 2)
+		;
+	for (nd = 0, i = 0; i < n; i++)
+		nd += leaf[i].dirty;
+	if (nd > x->capdirty) {
+		p = memrealloc(Membrack, x->dirty, (size_t)x->capdirty * sizeof p[0],
+			(size_t)nd * sizeof p[0]);
+		if (p == nil)
+			return -1;
+		x->dirty = p;
+		x->capdirty = nd;
+	}
+	node = memalloc(Membrack, 2 * (size_t)size * sizeof node[0]);
+	if (node == nil)
+		return -1;
+	memset(node, 0, 2 * (size_t)size * sizeof node[0]);
+	memcpy(node + size, leaf, (size_t)n * sizeof leaf[0]);
+	for (i = size - 1; i >= 1; i--)
+		pull(node, i);
+	x->ndirty = 0;
+	for (i = 0; i < n; i++)
+		if (leaf[i].dirty)
+			x->dirty[x->ndirty++] = i;
+	memfree(Membrack, x->node, 2 * (size_t)x->size * sizeof x->node[0]);
+	x->node = node;
+	x->size = size;
+	x->nblock = n;
+	x->reshape = 0;
+	return 0;
+}
+
+/*
+ * build indexes all of b.
+ *
+ * Returns:
+ *  - the index, or nil on allocation failure.
+ */
+static Brindex *
+build(Buf *b)
+{
+	Brindex *x;
+	Brnode *leaf;
+	long n, j, y, k;
+
+	n = ((long)b->nline + Brblock - 1) / Brblock;
+	x = memalloc(Membrack, sizeof *x);
+	leaf = memalloc(Membrack, (size_t)n * sizeof leaf[0]);
+	if (x == nil || leaf == nil) {
+		memfree(Membrack, x, sizeof *x);
+		memfree(Membrack, leaf, (size_t)n * sizeof leaf[0]);
+		return nil;
+	}
+	memset(x, 0, sizeof *x);
+	memset(leaf, 0, (size_t)n * sizeof leaf[0]);
+	for (j = 0, y = 0; j < n; j++, y += k) {
+		k = (long)b->nline - y < Brblock ? (long)b->nline - y : Brblock;
+		leaf[j].nline = k;
+		blocksum(b, y, k, &leaf[j].s);
+	}
+	if (plant(x, leaf, n) < 0) {
+		memfree(Membrack, x->dirty, (size_t)x->capdirty * sizeof x->dirty[0]);
+		memfree(Membrack, x, sizeof *x);
+		x = nil;
+	}
+	memfree(Membrack, leaf, (size_t)n * sizeof leaf[0]);
+	return x;
+}
+
+/*
+ * reshape drops empty blocks and splits those grown past 2 * Brblock
+ * lines (the pieces are dirty: only the total of the block was known).
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+static int
+reshape(Brindex *x)
+{
+	Brnode *leaf, *o;
+	long n, j, m, k;
+	int rc;
+
+	for (n = 0, j = 0; j < x->nblock; j++) {
+		m = x->node[x->size + j].nline;
+		n += m > 2 * Brblock ? (m + Brblock - 1) / Brblock : m > 0;
+	}
+	leaf = memalloc(Membrack, (size_t)n * sizeof leaf[0]);
+	if (leaf == nil)
+		return -1;
+	for (n = 0, j = 0; j < x->nblock; j++) {
+		o = &x->node[x->size + j];
+		if (o->nline <= 2 * Brblock) {
+			if (o->nline > 0)
+				leaf[n++] = *o;
+			continue;
+		}
+		for (m = o->nline; m > 0; m -= k) {
+			k = m < Brblock ? m : Brblock;
+			memset(&leaf[n], 0, sizeof leaf[n]);
+			leaf[n].nline = k;
+			leaf[n].dirty = 1;
+			n++;
+		}
+	}
+	rc = plant(x, leaf, n);
+	memfree(Membrack, leaf, (size_t)n * sizeof leaf[0]);
+	return rc;
+}
+
+/*
+ * refresh brings x up to date with b: it reshapes the blocks if needed
+ * and rescans the dirty ones.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+static int
+refresh(Brindex *x, Buf *b)
+{
+	Brnode *l;
+	long i, j;
+
+	if (x->reshape && reshape(x) < 0)
+		return -1;
+	for (i = 0; i < x->ndirty; i++) {
+		j = x->dirty[i];
+		l = &x->node[x->size + j];
+		blocksum(b, blockstart(x, j), l->nline, &l->s);
+		l->dirty = 0;
+		for (j = (x->size + j) / 2; j >= 1; j /= 2)
+			pull(x->node, j);
+	}
+	x->ndirty = 0;
+	return 0;
+}
+
+/*
+ * scanfwd looks through lines y..y1-1, from byte x of line y on, for the
+ * closer of pair t that brings *k (openers still to close) to 0.
+ *
+ * Returns:
+ *  - 0 with its position in *my, *mx, or -1 if not there.
+ */
+static int
+scanfwd(Buf *b, int t, long y, long x, long y1, long *k, long *my, long *mx)
+{
+	const unsigned char *p;
+	Line *l;
+	long n;
+	int c;
+
+	for (; y < y1; y++, x = 0) {
+		l = bufgetline(b, y);
+		if (l == nil)
+			continue;
+		p = (const unsigned char *)linebytes(l);
+		n = (long)l->n;
+		for (; x < n; x++) {
+			c = brkind[p[x]];
+			if (c == t + 1) {
+				(*k)++;
+			} else if (c == -(t + 1) && --*k == 0) {
+				*my = y;
+				*mx = x;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+ * scanback looks through lines y down to y1, from byte x of line y
+ * (clamped to the line) back, for the opener of pair t that brings *k
+ * (closers still to open) to 0.
+ *
+ * Returns:
+ *  - 0 with its position in *my, *mx, or -1 if not there.
+ */
+static int
+scanback(Buf *b, int t, long y, long x, long y1, long *k, long *my, long *mx)
+{
+	const unsigned char *p;
+	Line *l;
+	int c;
+
+	for (; y >= y1; y--, x = LONG_MAX) {
+		l = bufgetline(b, y);
+		if (l == nil)
+			continue;
+		p = (const unsigned char *)linebytes(l);
+		if (x >= (long)l->n)
+			x = (long)l->n - 1;
+		for (; x >= 0; x--) {
+			c = brkind[p[x]];
+			if (c == -(t + 1)) {
+				(*k)++;
+			} else if (c == t + 1 && --*k == 0) {
+				*my = y;
+				*mx = x;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+int
+bufmatch(Buf *b, int dir, int open, long y, long x, long *my, long *mx)
+{
+	Brindex *ix;
+	Brnode *node;
+	long i, j, s, k;
+	int t;
+
+	t = brkind[(unsigned char)open] - 1;
+	if (b == nil || t < 0 || y < 0 || (size_t)y >= b->nline)
+		return -1;
+	ix = b->br;
+	if (ix != nil && (ix->node[1].nline != (long)b->nline || refresh(ix, b) < 0))
+		brfree(b);
+	if (b->br == nil)
+		b->br = build(b);
+	ix = b->br;
+	k = 1;
+	if (ix == nil) {
+		/* No memory for an index: scan as far as it takes. */
+		if (dir > 0)
+			return scanfwd(b, t, y, x, (long)b->nline, &k, my, mx);
+		return scanback(b, t, y, x, 0, &k, my, mx);
+	}
+
+	/* The rest of y's block is scanned; whole blocks are skipped by their sums. */
+	node = ix->node;
+	j = locate(ix, y, &s);
+	if (dir > 0) {
+		if (scanfwd(b, t, y, x, s + node[ix->size + j].nline, &k, my, mx) == 0)
+			return 0;
+		for (i = ix->size + j; i > 1; i /= 2) {
+			if (i % 2 == 1)
+				continue;
+			if (node[i + 1].s.c[t] >= k)
+				break;
+			k += node[i + 1].s.o[t] - node[i + 1].s.c[t];
+		}
+		if (i <= 1)
+			return -1;
+		for (i++; i < ix->size;) {
+			if (node[2 * i].s.c[t] >= k) {
+				i = 2 * i;
+			} else {
+				k += node[2 * i].s.o[t] - node[2 * i].s.c[t];
+				i = 2 * i + 1;
+			}
+		}
+		s = blockstart(ix, i - ix->size);
+		return scanfwd(b, t, s, 0, s + node[i].nline, &k, my, mx);
+	}
+	if (scanback(b, t, y, x, s, &k, my, mx) == 0)
+		return 0;
+	for (i = ix->size + j; i > 1; i /= 2) {
+		if (i % 2 == 0)
+			continue;
+		if (node[i - 1].s.o[t] >= k)
+			break;
+		k += node[i - 1].s.c[t] - node[i - 1].s.o[t];
+	}
+	if (i <= 1)
+		return -1;
+	for (i--; i < ix->size;) {
+		if (node[2 * i + 1].s.o[t] >= k) {
+			i = 2 * i + 1;
+		} else {
+			k += node[2 * i + 1].s.c[t] - node[2 * i + 1].s.o[t];
+			i = 2 * i;
+		}
+	}
+	s = blockstart(ix, i - ix->size);
+	return scanback(b, t, s + node[i].nline - 1, LONG_MAX, s, &k, my, mx);
+}
+
+void
+brfree(Buf *b)
+{
+	Brindex *x;
+
+	x = b->br;
+	if (x == nil)
+		return;
+	memfree(Membrack, x->node, 2 * (size_t)x->size * sizeof x->node[0]);
+	memfree(Membrack, x->dirty, (size_t)x->capdirty * sizeof x->dirty[0]);
+	memfree(Membrack, x, sizeof *x);
+	b->br = nil;
+}
+
+void
+bredit(Buf *b, long y)
+{
+	Brindex *x;
+
+	x = b->br;
+	if (x == nil || y < 0 || y >= x->node[1].nline)
+		return;
+	if (markdirty(x, locate(x, y, nil)) < 0)
+		brfree(b);
+}
+
+void
+brinsert(Buf *b, long at, long n)
+{
+	Brindex *x;
+	long j;
+
+	x = b->br;
+	if (x == nil || n <= 0)
+		return;
+	/* New lines join the block they land in, or the last one at the end. */
+	if (at < 0)
+		at = 0;
+	if (at >= x->node[1].nline)
+		j = x->nblock - 1;
+	else
+		j = locate(x, at, nil);
+	addlines(x, j, n);
+	if (x->node[x->size + j].nline > 2 * Brblock)
+		x->reshape = 1;
+	if (markdirty(x, j) < 0)
+		brfree(b);
+}
+
+void
+brdelete(Buf *b, long at, long n)
+{
+	Brindex *x;
+	long j, s, k;
+
+	x = b->br;
+	if (x == nil || at < 0)
+		return;
+	while (n > 0 && at < x->node[1].nline) {
+		j = locate(x, at, &s);
+		k = s + x->node[x->size + j].nline - at;
+		if (k > n)
+			k = n;
+		addlines(x, j, -k);
+		n -= k;
+		if (x->node[x->size + j].nline == 0)
+			x->reshape = 1;
+		if (markdirty(x, j) < 0) {
+			brfree(b);
+			return;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef BRACK_H
+#define BRACK_H
+
+/*
+ * Bracket index hooks
+ *
+ * buf.c tells the index of a buffer (see bufmatch) about every change to
+ * its lines, so that only the blocks of lines touched are rescanned. All
+ * of them return at once while b has no index.
+ */
+
+/*
+ * brfree releases b's index.
+ */
+void brfree(Buf *b);
+
+/*
+ * bredit records that the bytes of line y are about to change.
+ */
+void bredit(Buf *b, long y);
+
+/*
+ * brinsert records that n lines were inserted at index at.
+ */
+void brinsert(Buf *b, long at, long n);
+
+/*
+ * brdelete records that n lines were deleted from index at.
+ */
+void brdelete(Buf *b, long at, long n);
+
+#endif /* BRACK_H */
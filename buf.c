@@ -1,14 +1,68 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "buf.h"
+#include "brack.h"
 #include "config.h"
+#include "mem.h"
 #include "util.h"
 
+enum {
+	Saveiov = 1024,        /* iovecs per writev(2) (IOV_MAX on Linux and the BSDs). */
+	Savestage = 64 * 1024, /* Staging bytes per batch for short pieces. */
+	Savesmall = 256,       /* Pieces up to this size are staged, not referenced. */
+};
+
+enum {
+	Loadchunkmin = 1 << 20, /* Smallest byte range handed to a load thread. */
+	Loadmaxthr = 64,        /* Most load threads. */
+};
+
+/* A newline-aligned byte range of a file being loaded in parallel. */
+typedef struct Loadchunk Loadchunk;
+struct Loadchunk {
+	const char *p;     /* First byte. */
+	size_t n;          /* Bytes (the range ends after a newline or at EOF). */
+	unsigned long gen; /* Generation for the new lines (see lineinit). */
+	int tag;           /* mem.h tag for the new lines. */
+	Line *line;        /* Where its lines go (a slice of the buffer's array). */
+	size_t nline;      /* Lines in the range (counted first, then built). */
+	size_t bytes;      /* Line storage allocated. */
+	size_t clean;      /* Leading lines stored as "text\n". */
+	size_t cleanoff;   /* Their bytes. */
+	int err;           /* Non-zero if an allocation failed. */
+	pthread_t thr;     /* Worker (unused for the first chunk). */
+};
+
+/* A line storage block retired while a snapshot may still read it. */
+typedef struct Retired Retired;
+struct Retired {
+	char *s;    /* Storage. */
+	size_t cap; /* Its size in bytes. */
+	int tag;    /* mem.h tag it is charged to. */
+};
+
+/*
+ * Snapshot state (see bufsnap). Line storage whose gen is below snapgen
+ * is shared with the snapshot while snapbusy is set: it must not be
+ * written or freed. Editing such a line copies it first (lineown).
+ */
+static unsigned long snapgen;
+static int snapbusy;
+static Retired *retired;
+static size_t nretired;
+static size_t capretired;
+
 static size_t bufgaplen(const Buf *b);
 static void bufmovegap(Buf *b, size_t at);
 static int bufensuregap(Buf *b, size_t need);
@@ -47,6 +101,22 @@ bufswap(Buf *a, Buf *b)
 	*b = t;
 }
 
+/*
+ * linetag and arrtag return the mem.h tags b's lines and line array are
+ * charged to.
+ */
+static int
+linetag(const Buf *b)
+{
+	return b->tag == Memundo ? Memundo : Memline;
+}
+
+static int
+arrtag(const Buf *b)
+{
+	return b->tag == Memundo ? Memundo : Memlinearr;
+}
+
 static size_t
 bufgaplen(const Buf *b)
 {
@@ -122,7 +192,7 @@ bufensuregap(Buf *b, size_t need)
 	if (mulsz(ncap, sizeof *nl, &nbytes) < 0)
 		return -1;
 
-	nl = malloc(nbytes);
+	nl = memalloc(arrtag(b), nbytes);
 	if (nl == nil)
 		return -1;
 
@@ -136,7 +206,7 @@ bufensuregap(Buf *b, size_t need)
 	if (rightlen > 0)
 		memcpy(nl + newend, b->line + b->end, rightlen * sizeof nl[0]);
 
-	free(b->line);
+	memfree(arrtag(b), b->line, b->cap * sizeof b->line[0]);
 	b->line = nl;
 	b->cap = ncap;
 	b->end = newend;
@@ -150,18 +220,84 @@ bufensuregap(Buf *b, size_t need)
  *
  * Parameters:
  *  - l: line to initialize.
+ *  - tag: mem.h tag of the buffer it belongs to.
  *
  * Returns:
  *  - void.
  */
 static void
-lineinit(Line *l)
+lineinit(Line *l, int tag)
 {
 	l->s = nil;
 	l->n = 0;
 	l->cap = 0;
 	l->start = 0;
 	l->end = 0;
+	l->gen = (unsigned int)snapgen;
+	l->tag = tag;
+}
+
+/*
+ * lineshared reports whether l's storage is still read by a snapshot.
+ * Line.gen keeps only the low bits of snapgen; once snapgen outgrows
+ * them every line looks older than the snapshot, which only costs
+ * copies.
+ */
+static int
+lineshared(const Line *l)
+{
+	return snapbusy && l->s != nil && l->gen < snapgen;
+}
+
+/*
+ * linerelease frees l's storage, or parks it until the snapshot is done.
+ */
+static void
+linerelease(Line *l)
+{
+	Retired *p;
+	size_t cap;
+
+	if (l->s == nil)
+		return;
+	if (!lineshared(l)) {
+		memfree(l->tag, l->s, l->cap);
+		return;
+	}
+	if (nretired == capretired) {
+		cap = capretired > 0 ? capretired * 2 : 64;
+		p = realloc(retired, cap * sizeof retired[0]);
+		if (p == nil)
+			die("Out of memory");
+		retired = p;
+		capretired = cap;
+	}
+	retired[nretired].s = l->s;
+	retired[nretired].cap = l->cap;
+	retired[nretired].tag = l->tag;
+	nretired++;
+}
+
+/*
+ * lineown gives l private storage before its bytes are changed.
+ */
+static void
+lineown(Line *l)
+{
+	char *ns;
+	size_t rlen;
+
+	if (!lineshared(l))
+		return;
+	ns = memalloc(l->tag, l->cap);
+	if (ns == nil)
+		die("Out of memory");
+	memcpy(ns, l->s, l->start);
+	rlen = l->n - l->start;
+	memcpy(ns + l->end, l->s + l->end, rlen);
+	linerelease(l);
+	l->s = ns;
+	l->gen = (unsigned int)snapgen;
 }
 
 /*
@@ -176,8 +312,8 @@ lineinit(Line *l)
 static void
 linefree(Line *l)
 {
-	free(l->s);
-	lineinit(l);
+	linerelease(l);
+	lineinit(l, l->tag);
 }
 
 static size_t
@@ -208,6 +344,8 @@ linemovegap(Line *l, size_t at)
 		l->end = 0;
 		return;
 	}
+	if (at != l->start)
+		lineown(l);
 	if (at < l->start) {
 		d = l->start - at;
 		memmove(l->s + (l->end - d), l->s + at, (size_t)d);
@@ -252,7 +390,7 @@ lineensuregap(Line *l, size_t need)
 	}
 	nbytes = ncap;
 
-	ns = malloc(nbytes);
+	ns = memalloc(l->tag, nbytes);
 	if (ns == nil)
 		return -1;
 	/* Copy left side. */
@@ -264,8 +402,9 @@ lineensuregap(Line *l, size_t need)
 	if (rlen > 0)
 		memcpy(ns + newend, l->s + l->end, (size_t)rlen);
 
-	free(l->s);
+	linerelease(l);
 	l->s = ns;
+	l->gen = (unsigned int)snapgen;
 	l->cap = ncap;
 	l->end = newend;
 	if (l->end < l->start)
@@ -279,19 +418,20 @@ lineensuregap(Line *l, size_t need)
  * Parameters:
  *  - dst: destination line (initialized by this function).
  *  - src: source line.
+ *  - tag: mem.h tag to charge the copy to.
  *
  * Returns:
  *  - 0 on success.
  *  - -1 on allocation failure.
  */
 static int
-linecopy(Line *dst, Line *src)
+linecopy(Line *dst, Line *src, int tag)
 {
 	size_t llen;
 	size_t rlen;
 	size_t cap;
 
-	lineinit(dst);
+	lineinit(dst, tag);
 	if (src == nil)
 		return 0;
 	if (src->n == 0)
@@ -306,9 +446,9 @@ linecopy(Line *dst, Line *src)
 	cap = src->n;
 	if (cap < (size_t)LINE_MIN_CAP)
 		cap = (size_t)LINE_MIN_CAP;
-	dst->s = malloc((size_t)cap);
+	dst->s = memalloc(tag, (size_t)cap);
 	if (dst->s == nil) {
-		lineinit(dst);
+		lineinit(dst, tag);
 		return -1;
 	}
 	if (llen > 0)
@@ -339,6 +479,9 @@ bufinit(Buf *b)
 	b->cap = 0;
 	b->start = 0;
 	b->end = 0;
+	b->tag = Memline;
+	b->br = nil;
+	bufmarkclean(b, nil);
 
 	(void)bufinsertline(b, 0, "", 0);
 }
@@ -366,12 +509,14 @@ buffree(Buf *b)
 		pi = (i < b->start) ? i : (i + gl);
 		linefree(&b->line[pi]);
 	}
-	free(b->line);
+	memfree(arrtag(b), b->line, b->cap * sizeof b->line[0]);
+	brfree(b);
 	b->line = nil;
 	b->nline = 0;
 	b->cap = 0;
 	b->start = 0;
 	b->end = 0;
+	bufmarkclean(b, nil);
 }
 
 /*
@@ -398,6 +543,7 @@ bufcopy(Buf *dst, Buf *src)
 
 	if (dst == nil || src == nil)
 		goto invalid_params;
+	tmp.tag = dst->tag;
 
 	/* Prepare capacity up-front; don't mutate dst unless we succeed. */
 	if (bufensuregap(&tmp, src->nline) < 0)
@@ -413,7 +559,7 @@ bufcopy(Buf *dst, Buf *src)
 			goto out;
 		}
 		bufmovegap(&tmp, tmp.nline);
-		if (linecopy(&tmp.line[tmp.start], sl) < 0) {
+		if (linecopy(&tmp.line[tmp.start], sl, linetag(&tmp)) < 0) {
 			goto out;
 		}
 		tmp.start++;
@@ -431,6 +577,57 @@ bufcopy(Buf *dst, Buf *src)
 	return -1;
 }
 
+/*
+ * bufsplit returns the bytes held by b's lines and by its line array.
+ */
+static void
+bufsplit(Buf *b, size_t *lines, size_t *arr)
+{
+	size_t i;
+	size_t gl;
+	size_t pi;
+
+	*lines = 0;
+	*arr = b->cap * sizeof b->line[0];
+	gl = bufgaplen(b);
+	for (i = 0; i < b->nline; i++) {
+		pi = (i < b->start) ? i : (i + gl);
+		if (b->line[pi].s != nil)
+			*lines += b->line[pi].cap;
+	}
+}
+
+void
+bufsettag(Buf *b, int tag)
+{
+	size_t lines, arr, i, gl;
+	Buf nb;
+
+	if (b == nil || b->tag == tag)
+		return;
+	bufsplit(b, &lines, &arr);
+	nb.tag = tag;
+	memcount(linetag(b), -(long long)lines);
+	memcount(arrtag(b), -(long long)arr);
+	memcount(linetag(&nb), (long long)lines);
+	memcount(arrtag(&nb), (long long)arr);
+	b->tag = tag;
+	gl = bufgaplen(b);
+	for (i = 0; i < b->nline; i++)
+		b->line[i < b->start ? i : i + gl].tag = linetag(b);
+}
+
+size_t
+bufmem(Buf *b)
+{
+	size_t lines, arr;
+
+	if (b == nil)
+		return 0;
+	bufsplit(b, &lines, &arr);
+	return lines + arr;
+}
+
 /*
  * bufgetline returns a pointer to the i-th line in the buffer.
  *
@@ -461,6 +658,63 @@ bufgetline(Buf *b, long i)
 	return &b->line[pi];
 }
 
+/*
+ * bufdirty drops line at and everything after it from the clean prefix.
+ */
+static void
+bufdirty(Buf *b, size_t at)
+{
+	size_t i, gl;
+
+	if (at >= b->clean)
+		return;
+	gl = bufgaplen(b);
+	for (i = at; i < b->clean; i++)
+		b->cleanoff -= b->line[i < b->start ? i : i + gl].n + 1;
+	b->clean = at;
+}
+
+Line *
+bufeditline(Buf *b, long i)
+{
+	if (b == nil || i < 0 || (size_t)i >= b->nline)
+		return nil;
+	bufdirty(b, (size_t)i);
+	bredit(b, i);
+	return bufgetline(b, i);
+}
+
+void
+bufmarkclean(Buf *b, const BufStamp *st)
+{
+	size_t i, gl;
+
+	memset(&b->disk, 0, sizeof b->disk);
+	b->clean = 0;
+	b->cleanoff = 0;
+	if (st == nil)
+		return;
+	gl = bufgaplen(b);
+	for (i = 0; i < b->nline; i++)
+		b->cleanoff += b->line[i < b->start ? i : i + gl].n + 1;
+	b->clean = b->nline;
+	b->disk = *st;
+}
+
+int
+bufstamp(int fd, BufStamp *st)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0)
+		return -1;
+	st->dev = (unsigned long long)sb.st_dev;
+	st->ino = (unsigned long long)sb.st_ino;
+	st->size = (unsigned long long)sb.st_size;
+	st->mtime = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+	return 0;
+}
+
 void
 buftrackgap(Buf *b, long at)
 {
@@ -510,12 +764,12 @@ bufinsertline(Buf *b, long at, const char *s, size_t n)
 		return -1;
 
 	/* Prepare new element first so failures don't mutate b. */
-	lineinit(&tmp);
+	lineinit(&tmp, linetag(b));
 	if (n > 0) {
 		cap = n;
 		if (cap < (size_t)LINE_MIN_CAP)
 			cap = (size_t)LINE_MIN_CAP;
-		tmp.s = malloc(cap);
+		tmp.s = memalloc(linetag(b), cap);
 		if (tmp.s == nil)
 			return -1;
 		memcpy(tmp.s, s, (size_t)n);
@@ -527,16 +781,113 @@ bufinsertline(Buf *b, long at, const char *s, size_t n)
 
 	/* Allocate first; do not mutate b on allocation failure. */
 	if (bufensuregap(b, 1) < 0) {
-		free(tmp.s);
+		memfree(linetag(b), tmp.s, tmp.cap);
 		return -1;
 	}
+	bufdirty(b, uat);
 	bufmovegap(b, uat);
 	b->line[b->start] = tmp;
 	b->start++;
 	b->nline++;
+	brinsert(b, (long)uat, 1);
 	return 0;
 }
 
+int
+bufadopt(Buf *b, Line *l, size_t n)
+{
+	size_t i, bytes;
+
+	if (bufensuregap(b, n) < 0)
+		return -1;
+	bufmovegap(b, b->nline);
+	memcpy(&b->line[b->start], l, n * sizeof l[0]);
+	for (bytes = 0, i = 0; i < n; i++) {
+		b->line[b->start + i].tag = linetag(b);
+		bytes += l[i].cap;
+	}
+	b->start += n;
+	b->nline += n;
+	brinsert(b, (long)(b->nline - n), (long)n);
+	memcount(linetag(b), (long long)bytes);
+	return 0;
+}
+
+long
+bufappendbytes(Buf *b, const char *s, size_t n, int *part)
+{
+	const char *p, *q, *end, *t;
+	Line *arr, *l;
+	size_t cnt, i, len, cap, clean, cleanoff;
+
+	p = s;
+	end = s + n;
+	if (*part && p < end) {
+		/* The bytes up to the first newline finish the open last line. */
+		q = memchr(p, '\n', n);
+		len = (size_t)((q != nil ? q : end) - p);
+		l = bufeditline(b, (long)b->nline - 1);
+		if (l == nil || lineinsert(l, (long)l->n, p, len) < 0)
+			return -1;
+		if (q != nil) {
+			t = linebytes(l);
+			for (len = l->n; len > 0 && t[len - 1] == '\r'; len--)
+				;
+			(void)linedelrange(l, (long)len, l->n - len);
+		}
+		*part = q == nil;
+		p = q != nil ? q + 1 : end;
+	}
+	if (p == end)
+		return 0;
+
+	for (cnt = 0, q = p; (q = memchr(q, '\n', (size_t)(end - q))) != nil; q++)
+		cnt++;
+	if (end[-1] != '\n')
+		cnt++;
+	arr = calloc(cnt, sizeof arr[0]);
+	if (arr == nil)
+		return -1;
+	/* New "text\n" lines extend a clean prefix that covers everything. */
+	clean = b->clean;
+	cleanoff = b->cleanoff;
+	for (i = 0; i < cnt; i++, p = q + 1) {
+		q = memchr(p, '\n', (size_t)(end - p));
+		if (q == nil)
+			q = end;
+		for (len = (size_t)(q - p); len > 0 && p[len - 1] == '\r'; len--)
+			;
+		if (clean == b->nline + i && q < end && len == (size_t)(q - p)) {
+			clean++;
+			cleanoff += len + 1;
+		}
+		if (len == 0)
+			continue;
+		cap = len < (size_t)LINE_MIN_CAP ? (size_t)LINE_MIN_CAP : len;
+		arr[i].s = malloc(cap);
+		if (arr[i].s == nil)
+			goto fail;
+		memcpy(arr[i].s, p, len);
+		arr[i].n = len;
+		arr[i].cap = cap;
+		arr[i].start = len;
+		arr[i].end = cap;
+	}
+	if (bufadopt(b, arr, cnt) < 0)
+		goto fail;
+	free(arr);
+	b->clean = clean;
+	b->cleanoff = cleanoff;
+	*part = end[-1] != '\n';
+	return (long)cnt;
+
+	fail:
+	for (i = 0; i < cnt; i++)
+		free(arr[i].s);
+	free(arr);
+	return -1;
+}
+
 /*
  * bufdelline deletes the line at index at.
  *
@@ -560,6 +911,7 @@ bufdelline(Buf *b, long at)
 	uat = (size_t)at;
 	if (uat >= b->nline)
 		return -1;
+	bufdirty(b, uat);
 	bufmovegap(b, uat);
 	/* Deleting logical line at uat means expanding the gap by one element. */
 	if (b->end >= b->cap)
@@ -567,6 +919,50 @@ bufdelline(Buf *b, long at)
 	linefree(&b->line[b->end]);
 	b->end++;
 	b->nline--;
+	brdelete(b, (long)uat, 1);
+	if (b->nline == 0)
+		(void)bufinsertline(b, 0, "", 0);
+	return 0;
+}
+
+/*
+ * bufdellines deletes n lines starting at index at (fewer if the buffer
+ * ends first) with one gap move.
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - at: index of the first line.
+ *  - n: number of lines.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if out of range.
+ */
+int
+bufdellines(Buf *b, long at, long n)
+{
+	size_t uat, un, i;
+
+	if (b == nil)
+		return -1;
+	if (at < 0 || n < 0)
+		return -1;
+	uat = (size_t)at;
+	if (uat >= b->nline)
+		return -1;
+	un = (size_t)n;
+	if (un > b->nline - uat)
+		un = b->nline - uat;
+	if (un == 0)
+		return 0;
+	bufdirty(b, uat);
+	bufmovegap(b, uat);
+	/* The lines now follow the gap: widen it over all of them at once. */
+	for (i = 0; i < un; i++)
+		linefree(&b->line[b->end + i]);
+	b->end += un;
+	b->nline -= un;
+	brdelete(b, (long)uat, (long)un);
 	if (b->nline == 0)
 		(void)bufinsertline(b, 0, "", 0);
 	return 0;
@@ -612,6 +1008,7 @@ lineinsert(Line *l, long at, const char *s, size_t n)
 	if (uat > l->n)
 		uat = l->n;
 
+	lineown(l);
 	linemovegap(l, uat);
 	if (lineensuregap(l, n) < 0)
 		return -1;
@@ -649,6 +1046,7 @@ linedelrange(Line *l, long at, size_t n)
 		return -1;
 	if (n > l->n - uat)
 		n = l->n - uat;
+	lineown(l);
 	linemovegap(l, uat);
 	l->end += n;
 	l->n -= n;
@@ -673,8 +1071,11 @@ linetake(Line *l, char *s, size_t n)
 		return -1;
 	if (n > 0 && s == nil)
 		return -1;
-	free(l->s);
+	linerelease(l);
+	if (s != nil)
+		memcount(l->tag, (long long)n);
 	l->s = s;
+	l->gen = (unsigned int)snapgen;
 	l->n = n;
 	l->cap = n;
 	l->start = n;
@@ -682,6 +1083,287 @@ linetake(Line *l, char *s, size_t n)
 	return 0;
 }
 
+/*
+ * loadcount counts the lines of a chunk (a thread function).
+ */
+static void *
+loadcount(void *arg)
+{
+	Loadchunk *c;
+	const char *p, *end, *q;
+
+	c = arg;
+	c->nline = 0;
+	for (p = c->p, end = c->p + c->n; p < end; p = q + 1) {
+		q = memchr(p, '\n', (size_t)(end - p));
+		c->nline++;
+		if (q == nil)
+			break;
+	}
+	return nil;
+}
+
+/*
+ * loadbuild fills c->line with the lines of a chunk (a thread function).
+ * Lines are shaped as bufinsertline would make them; on allocation
+ * failure c->err is set and c->nline cut to the lines built.
+ */
+static void *
+loadbuild(void *arg)
+{
+	Loadchunk *c;
+	const char *p, *end, *q;
+	size_t i, n, cap;
+	Line *l;
+	int clean;
+
+	c = arg;
+	clean = 1;
+	c->bytes = 0;
+	c->clean = 0;
+	c->cleanoff = 0;
+	p = c->p;
+	end = c->p + c->n;
+	for (i = 0; i < c->nline; i++) {
+		q = memchr(p, '\n', (size_t)(end - p));
+		if (q == nil)
+			q = end;
+		for (n = (size_t)(q - p); n > 0 && p[n - 1] == '\r'; n--)
+			;
+		if (clean && q < end && n == (size_t)(q - p)) {
+			c->clean++;
+			c->cleanoff += n + 1;
+		} else {
+			clean = 0;
+		}
+		l = &c->line[i];
+		memset(l, 0, sizeof *l);
+		l->gen = (unsigned int)c->gen;
+		l->tag = c->tag;
+		if (n > 0) {
+			cap = n < (size_t)LINE_MIN_CAP ? (size_t)LINE_MIN_CAP : n;
+			l->s = malloc(cap);
+			if (l->s == nil) {
+				c->err = 1;
+				c->nline = i;
+				return nil;
+			}
+			memcpy(l->s, p, n);
+			l->n = n;
+			l->cap = cap;
+			l->start = n;
+			l->end = cap;
+			c->bytes += cap;
+		}
+		p = q + 1;
+	}
+	return nil;
+}
+
+/*
+ * loadrun runs fn over all chunks, one thread each; the first chunk (and
+ * any whose thread cannot be started) runs on the calling thread.
+ */
+static void
+loadrun(Loadchunk *c, int n, void *(*fn)(void *))
+{
+	int started[Loadmaxthr];
+	int i;
+
+	for (i = 1; i < n; i++)
+		started[i] = pthread_create(&c[i].thr, nil, fn, &c[i]) == 0;
+	fn(&c[0]);
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join(c[i].thr, nil);
+		else
+			fn(&c[i]);
+	}
+}
+
+/*
+ * loadcut splits p[0..size-1] into newline-aligned chunks, one per load
+ * thread, for lines of generation gen charged to tag.
+ *
+ * Returns:
+ *  - the number of chunks (at least 1).
+ */
+static int
+loadcut(Loadchunk *c, const char *p, size_t size, unsigned long gen, int tag)
+{
+	const char *q, *at, *cut, *end;
+	long ncpu;
+	int n, k;
+
+	ncpu = LOADTHREADS > 0 ? LOADTHREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if ((size_t)ncpu > size / Loadchunkmin)
+		ncpu = (long)(size / Loadchunkmin);
+	n = ncpu < 1 ? 1 : ncpu > Loadmaxthr ? Loadmaxthr : (int)ncpu;
+
+	/* Cut at about size*(k+1)/n, moved forward to just past a newline. */
+	memset(c, 0, (size_t)n * sizeof c[0]);
+	end = p + size;
+	at = p;
+	for (k = 0; k < n; k++) {
+		cut = p + size / (size_t)n * (size_t)(k + 1);
+		if (k + 1 == n || cut < at)
+			cut = k + 1 == n ? end : at;
+		if (cut < end) {
+			q = memchr(cut, '\n', (size_t)(end - cut));
+			cut = q != nil ? q + 1 : end;
+		}
+		c[k].p = at;
+		c[k].n = (size_t)(cut - at);
+		c[k].gen = gen;
+		c[k].tag = tag;
+		at = cut;
+	}
+	return n;
+}
+
+/*
+ * loadclean adds up the clean prefix of chunks c[0..n-1]: their leading
+ * lines stored as "text\n", up to the first chunk with any other line.
+ */
+static void
+loadclean(const Loadchunk *c, int n, size_t *clean, size_t *cleanoff)
+{
+	int k;
+
+	*clean = 0;
+	*cleanoff = 0;
+	for (k = 0; k < n; k++) {
+		*clean += c[k].clean;
+		*cleanoff += c[k].cleanoff;
+		if (c[k].clean < c[k].nline)
+			break;
+	}
+}
+
+int
+bufloadlines(const char *p, size_t size, Line **line, size_t *nline, size_t *clean, size_t *cleanoff)
+{
+	Loadchunk c[Loadmaxthr];
+	Line *arr;
+	size_t i, total;
+	int n, k, err;
+
+	*line = nil;
+	*nline = 0;
+	*clean = 0;
+	*cleanoff = 0;
+	/* Generation 0: nothing is shared with a snapshot yet. */
+	n = loadcut(c, p, size, 0, Memline);
+	loadrun(c, n, loadcount);
+	total = 0;
+	for (k = 0; k < n; k++)
+		total += c[k].nline;
+	if (total == 0)
+		return 0;
+	arr = malloc(total * sizeof arr[0]);
+	if (arr == nil)
+		return -1;
+	for (i = 0, k = 0; k < n; i += c[k].nline, k++)
+		c[k].line = arr + i;
+	loadrun(c, n, loadbuild);
+
+	err = 0;
+	for (k = 0; k < n; k++)
+		err |= c[k].err;
+	if (err) {
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < c[k].nline; i++)
+				free(c[k].line[i].s);
+		}
+		free(arr);
+		errno = ENOMEM;
+		return -1;
+	}
+	loadclean(c, n, clean, cleanoff);
+	*line = arr;
+	*nline = total;
+	return 0;
+}
+
+/*
+ * bufloadpar loads the size byte regular file open on fd into b: the
+ * file is mapped, split into newline-aligned ranges and each range is
+ * turned into lines by its own thread, straight into one line array.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 on failure (b is unchanged).
+ *  - 1 if the file cannot be mapped (use the plain path).
+ */
+static int
+bufloadpar(Buf *b, int fd, size_t size)
+{
+	Loadchunk c[Loadmaxthr];
+	BufStamp st;
+	const char *p;
+	size_t i, total, bytes, clean, cleanoff;
+	Line *arr;
+	int n, k, err, rc;
+
+	p = mmap(nil, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return 1;
+	(void)posix_madvise((void *)p, size, POSIX_MADV_WILLNEED);
+
+	n = loadcut(c, p, size, snapgen, linetag(b));
+	loadrun(c, n, loadcount);
+	total = 0;
+	for (k = 0; k < n; k++)
+		total += c[k].nline;
+	rc = -1;
+	arr = memalloc(arrtag(b), total * sizeof arr[0]);
+	if (arr == nil)
+		goto out;
+	for (i = 0, k = 0; k < n; i += c[k].nline, k++)
+		c[k].line = arr + i;
+	loadrun(c, n, loadbuild);
+
+	err = 0;
+	bytes = 0;
+	for (k = 0; k < n; k++) {
+		err |= c[k].err;
+		bytes += c[k].bytes;
+	}
+	if (err) {
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < c[k].nline; i++)
+				free(c[k].line[i].s);
+		}
+		memfree(arrtag(b), arr, total * sizeof arr[0]);
+		errno = ENOMEM;
+		goto out;
+	}
+
+	/* The workers allocated the storage; charge it here. */
+	buffree(b);
+	memcount(linetag(b), (long long)bytes);
+	b->line = arr;
+	b->nline = total;
+	b->cap = total;
+	b->start = total;
+	b->end = total;
+	loadclean(c, n, &clean, &cleanoff);
+	if (bufstamp(fd, &st) == 0) {
+		b->disk = st;
+		b->clean = clean;
+		b->cleanoff = cleanoff;
+	}
+	rc = 0;
+
+	out:
+	err = errno;
+	(void)munmap((void *)p, size);
+	errno = err;
+	return rc;
+}
+
 /*
  * bufload loads a file into b (replacing existing contents).
  * Newlines are split into separate lines and not stored in Line.s.
@@ -699,8 +1381,10 @@ bufload(Buf *b, const char *path)
 {
 	FILE *fp;
 	char *line;
-	size_t cap;
-	ssize_t n;
+	size_t cap, clean, cleanoff;
+	ssize_t n, raw;
+	BufStamp st;
+	struct stat sb;
 	int rc;
 
 	rc = -1;
@@ -711,6 +1395,13 @@ bufload(Buf *b, const char *path)
 	fp = fopen(path, "r");
 	if (fp == nil)
 		goto out;
+	if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_size >= (off_t)LOADPARALLEL && (unsigned long long)sb.st_size <= SIZE_MAX) {
+		rc = bufloadpar(b, fileno(fp), (size_t)sb.st_size);
+		if (rc <= 0)
+			goto out;
+		rc = -1;
+	}
 
 	buffree(b);
 	b->line = nil;
@@ -719,19 +1410,35 @@ bufload(Buf *b, const char *path)
 	b->start = 0;
 	b->end = 0;
 
-	while ((n = getline(&line, &cap, fp)) >= 0) {
-		for (; n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'); n--)
+	/* The clean prefix ends at the first line not stored as "text\n". */
+	clean = SIZE_MAX;
+	cleanoff = 0;
+	while ((raw = getline(&line, &cap, fp)) >= 0) {
+		for (n = raw; n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'); n--)
 			;
 		if (n < 0) {
 			goto out;
 		}
+		if (clean == SIZE_MAX) {
+			if (raw == n + 1 && line[n] == '\n')
+				cleanoff += (size_t)raw;
+			else
+				clean = b->nline;
+		}
 		if (bufinsertline(b, (long)b->nline, line, (size_t)n) < 0) {
 			goto out;
 		}
 	}
 
-	if (b->nline == 0)
+	if (b->nline == 0) {
+		clean = 0;
 		(void)bufinsertline(b, 0, "", 0);
+	}
+	if (bufstamp(fileno(fp), &st) == 0) {
+		b->disk = st;
+		b->clean = clean == SIZE_MAX ? b->nline : clean;
+		b->cleanoff = cleanoff;
+	}
 	rc = 0;
 
 	out:
@@ -742,7 +1449,160 @@ bufload(Buf *b, const char *path)
 }
 
 /*
- * bufsave writes the buffer to a file.
+ * writevall writes all of iov[0..n-1] to fd, resuming after short writes.
+ * iov is consumed in the process.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+static int
+writevall(int fd, struct iovec *iov, int n)
+{
+	ssize_t w;
+	size_t left;
+
+	while (n > 0) {
+		w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		left = (size_t)w;
+		for (; n > 0 && left >= iov->iov_len; iov++, n--)
+			left -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Save is a batch of iovecs being built by bufsave. Short pieces (and the
+ * newlines) are copied into a staging area so neighbours share one iovec;
+ * longer ones point straight into the line storage.
+ */
+typedef struct Save Save;
+struct Save {
+	int fd;                   /* Destination file. */
+	struct iovec iov[Saveiov]; /* Pending iovecs. */
+	int n;                    /* iovecs used. */
+	char stage[Savestage];    /* Copies of short pieces. */
+	size_t staged;            /* Bytes used in stage. */
+	int open;                 /* Non-zero if iov[n-1] ends at stage + staged. */
+	size_t pending;           /* Bytes queued in iov. */
+	size_t done;              /* Bytes written so far. */
+	BufProgress progress;     /* Called after each batch, or nil. */
+	void *arg;                /* Its argument. */
+};
+
+/*
+ * saveflush writes the pending batch.
+ */
+static int
+saveflush(Save *sv)
+{
+	int rc;
+
+	rc = writevall(sv->fd, sv->iov, sv->n);
+	sv->n = 0;
+	sv->staged = 0;
+	sv->open = 0;
+	sv->done += sv->pending;
+	sv->pending = 0;
+	if (rc == 0 && sv->progress != nil)
+		sv->progress(sv->done, sv->arg);
+	return rc;
+}
+
+/*
+ * saveadd queues len bytes at p.
+ */
+static int
+saveadd(Save *sv, const char *p, size_t len)
+{
+	if (len == 0)
+		return 0;
+	if (sv->n == Saveiov || (len <= Savesmall && sv->staged + len > Savestage)) {
+		if (saveflush(sv) < 0)
+			return -1;
+	}
+	sv->pending += len;
+	if (len > Savesmall) {
+		sv->iov[sv->n].iov_base = (char *)p;
+		sv->iov[sv->n++].iov_len = len;
+		sv->open = 0;
+		return 0;
+	}
+	memcpy(sv->stage + sv->staged, p, len);
+	if (sv->open) {
+		sv->iov[sv->n - 1].iov_len += len;
+	} else {
+		sv->iov[sv->n].iov_base = sv->stage + sv->staged;
+		sv->iov[sv->n++].iov_len = len;
+		sv->open = 1;
+	}
+	sv->staged += len;
+	return 0;
+}
+
+/*
+ * writelines writes lines from..nline-1 of b to fd (see bufwrite) and
+ * stores the number of bytes written in *done.
+ */
+static int
+writelines(Buf *b, size_t from, int fd, BufProgress progress, void *arg, size_t *done)
+{
+	Save *sv;
+	size_t i, gl;
+	Line *l;
+	int rc;
+
+	sv = malloc(sizeof *sv);
+	if (sv == nil)
+		return -1;
+	sv->fd = fd;
+	sv->n = 0;
+	sv->staged = 0;
+	sv->open = 0;
+	sv->pending = 0;
+	sv->done = 0;
+	sv->progress = progress;
+	sv->arg = arg;
+
+	rc = -1;
+	gl = bufgaplen(b);
+	for (i = from; i < b->nline; i++) {
+		l = &b->line[i < b->start ? i : i + gl];
+		if (l->n > 0) {
+			if (saveadd(sv, l->s, l->start) < 0)
+				goto out;
+			if (saveadd(sv, l->s + l->end, l->n - l->start) < 0)
+				goto out;
+		}
+		if (saveadd(sv, "\n", 1) < 0)
+			goto out;
+	}
+	rc = saveflush(sv);
+	*done = sv->done;
+
+	out:
+	free(sv);
+	return rc;
+}
+
+int
+bufwrite(Buf *b, int fd, BufProgress progress, void *arg)
+{
+	size_t done;
+
+	return writelines(b, 0, fd, progress, arg, &done);
+}
+
+/*
+ * bufsave writes the buffer to a file (truncating it in place).
  * Each stored line is written followed by a newline.
  *
  * Parameters:
@@ -756,41 +1616,118 @@ bufload(Buf *b, const char *path)
 int
 bufsave(Buf *b, const char *path)
 {
-	FILE *fp;
-	size_t i;
-	Line *l;
-	const char *p;
-	int rc;
+	BufStamp st;
+	int fd, err;
 
-	rc = -1;
-	fp = nil;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+	if (bufwrite(b, fd, nil, nil) < 0 || bufstamp(fd, &st) < 0) {
+		err = errno;
+		(void)close(fd);
+		errno = err;
+		return -1;
+	}
+	if (close(fd) < 0)
+		return -1;
+	bufmarkclean(b, &st);
+	return 0;
+}
 
-	fp = fopen(path, "w");
-	if (fp == nil)
-		goto out;
+int
+bufsavetail(Buf *b, const char *path, size_t maxtail)
+{
+	BufStamp st;
+	size_t i, gl, tail, done;
+	int fd, err;
 
-	for (i = 0; i < b->nline; i++) {
-		l = bufgetline(b, (long)i);
-		if (l == nil)
-			continue;
-		p = linebytes(l);
-		if (l->n > 0 && fwrite(p, 1, l->n, fp) != l->n) {
-			goto out;
-		}
-		if (fputc('\n', fp) == EOF) {
-			goto out;
-		}
+	if (b->clean == 0 || b->disk.ino == 0)
+		return -1;
+	/* Measure the tail first: bail out before touching the file. */
+	gl = bufgaplen(b);
+	tail = 0;
+	for (i = b->clean; i < b->nline; i++) {
+		tail += b->line[i < b->start ? i : i + gl].n + 1;
+		if (tail > maxtail)
+			return -1;
 	}
-
-	if (fclose(fp) != 0) {
-		fp = nil;
-		goto out;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (bufstamp(fd, &st) < 0)
+		goto fail;
+	if (st.dev != b->disk.dev || st.ino != b->disk.ino ||
+	    st.size != b->disk.size || st.mtime != b->disk.mtime) {
+		(void)close(fd);
+		return -1;
 	}
-	fp = nil;
-	rc = 0;
+	if (lseek(fd, (off_t)b->cleanoff, SEEK_SET) < 0)
+		goto fail;
+	if (writelines(b, b->clean, fd, nil, nil, &done) < 0)
+		goto fail;
+	if (ftruncate(fd, (off_t)(b->cleanoff + done)) < 0)
+		goto fail;
+	if (fsync(fd) < 0 || bufstamp(fd, &st) < 0)
+		goto fail;
+	if (close(fd) < 0) {
+		bufmarkclean(b, nil);
+		return -1;
+	}
+	b->clean = b->nline;
+	b->cleanoff += done;
+	b->disk = st;
+	return 0;
 
-	out:
-	if (fp != nil)
-		(void)fclose(fp);
-	return rc;
+	fail:
+	err = errno;
+	(void)close(fd);
+	bufmarkclean(b, nil);
+	errno = err;
+	return -1;
+}
+
+int
+bufsnap(Buf *b, Buf *snap)
+{
+	BufStamp st;
+	size_t gl, right;
+	Line *l;
+
+	if (snapbusy)
+		return -1;
+	l = memalloc(Memlinearr, b->nline * sizeof l[0]);
+	if (l == nil)
+		return -1;
+	gl = bufgaplen(b);
+	right = b->nline - b->start;
+	memcpy(l, b->line, b->start * sizeof l[0]);
+	memcpy(l + b->start, b->line + b->start + gl, right * sizeof l[0]);
+	memset(snap, 0, sizeof *snap);
+	snap->line = l;
+	snap->nline = b->nline;
+	snap->cap = b->nline;
+	snap->start = b->nline;
+	snap->end = b->nline;
+	/* b will match the file being written; its stamp comes later. */
+	memset(&st, 0, sizeof st);
+	bufmarkclean(b, &st);
+	snapgen++;
+	snapbusy = 1;
+	return 0;
+}
+
+void
+bufsnapdone(Buf *snap)
+{
+	size_t i;
+
+	memfree(Memlinearr, snap->line, snap->cap * sizeof snap->line[0]);
+	memset(snap, 0, sizeof *snap);
+	snapbusy = 0;
+	for (i = 0; i < nretired; i++)
+		memfree(retired[i].tag, retired[i].s, retired[i].cap);
+	free(retired);
+	retired = nil;
+	nretired = 0;
+	capretired = 0;
 }
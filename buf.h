@@ -2,6 +2,11 @@
 
 typedef struct Line Line;
 typedef struct Buf Buf;
+typedef struct BufStamp BufStamp;
+typedef struct Brindex Brindex;
+
+/* BufProgress is told how many bytes bufwrite has written so far. */
+typedef void (*BufProgress)(size_t done, void *arg);
 
 struct Line {
 	char *s;    /* Backing storage (raw bytes, typically UTF-8). */
@@ -9,6 +14,16 @@ struct Line {
 	size_t cap;   /* Allocated capacity of s in bytes. */
 	size_t start; /* Gap start index in s (bytes). */
 	size_t end;   /* Gap end index in s (bytes). */
+	unsigned int gen; /* Snapshot generation current when s was allocated (see bufsnap). */
+	int tag;          /* mem.h tag s is charged to: its buffer's (see bufsettag). */
+};
+
+/* BufStamp identifies a version of a file on disk (see bufsavetail). */
+struct BufStamp {
+	unsigned long long dev;  /* Device. */
+	unsigned long long ino;  /* Inode (0: no file). */
+	unsigned long long size; /* Size in bytes. */
+	long long mtime;         /* Modification time in ns. */
 };
 
 struct Buf {
@@ -17,6 +32,11 @@ struct Buf {
 	size_t cap;   /* Allocated capacity of line[] in elements (including the gap). */
 	size_t start; /* Gap start index in line[] (elements). */
 	size_t end;   /* Gap end index in line[] (elements). */
+	int tag;      /* Memline for live text, Memundo for snapshots (see bufsettag). */
+	size_t clean;    /* Leading lines known to match the file on disk. */
+	size_t cleanoff; /* Bytes of those lines, newlines included. */
+	BufStamp disk;   /* The file they match. */
+	Brindex *br;     /* Bracket index (see bufmatch), or nil until needed. */
 };
 
 /*
@@ -41,6 +61,25 @@ void bufinit(Buf *b);
  */
 void buffree(Buf *b);
 
+/*
+ * bufsettag changes which mem.h subsystem b's memory is charged to and
+ * moves the bytes already charged. Only Memline (the default for live
+ * text; the line array goes to Memlinearr) and Memundo are meaningful.
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - tag: Memline or Memundo.
+ *
+ * Returns:
+ *  - void.
+ */
+void bufsettag(Buf *b, int tag);
+
+/*
+ * bufmem returns the bytes allocated by b (line storage and line array).
+ */
+size_t bufmem(Buf *b);
+
 /*
  * bufcopy deep-copies src into dst.
  *
@@ -70,7 +109,8 @@ int bufload(Buf *b, const char *path);
 
 /*
  * bufsave writes the buffer to a file.
- * Each Line is written followed by a newline.
+ * Each Line is written followed by a newline. On success the whole
+ * buffer becomes its clean prefix (see bufsavetail).
  *
  * Parameters:
  *  - b: buffer to write.
@@ -82,6 +122,92 @@ int bufload(Buf *b, const char *path);
  */
 int bufsave(Buf *b, const char *path);
 
+/*
+ * bufwrite writes the buffer to fd, each line followed by a newline. The
+ * buffer is not modified, so it may run on another thread against a
+ * snapshot from bufsnap.
+ *
+ * Parameters:
+ *  - b: buffer to write.
+ *  - fd: destination (written from its current offset).
+ *  - progress: called with the bytes written after each batch (may be nil).
+ *  - arg: progress argument.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 on failure (errno is set).
+ */
+int bufwrite(Buf *b, int fd, BufProgress progress, void *arg);
+
+/*
+ * bufsavetail rewrites only the end of path: the file is kept up to the
+ * buffer's clean prefix (the leading lines unchanged since it was loaded
+ * or saved), the rest is written from there and the file is truncated.
+ * It is not atomic.
+ *
+ * Parameters:
+ *  - b: buffer to write.
+ *  - path: file path; must still be the file b was loaded from or saved to.
+ *  - maxtail: give up if more than this many bytes would be written.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if the prefix is empty, the file changed on disk, the tail is too
+ *    long, or on failure (the file may then be partly written).
+ */
+int bufsavetail(Buf *b, const char *path, size_t maxtail);
+
+/*
+ * bufmarkclean records that the whole of b now matches the file st (nil:
+ * that nothing is known to match any file).
+ */
+void bufmarkclean(Buf *b, const BufStamp *st);
+
+/*
+ * bufstamp fills st from the file open on fd.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+int bufstamp(int fd, BufStamp *st);
+
+/*
+ * bufsnap takes a copy-on-write snapshot of b for a background writer:
+ * only the line array is copied and the line storage is shared. Until
+ * bufsnapdone, edits to b copy a line before changing it, and freed
+ * storage is kept alive. Only one snapshot may exist at a time. The
+ * snapshot must only be read (bufwrite, bufgetline) and released with
+ * bufsnapdone, never with buffree. b is marked clean against the file
+ * being written, with an empty stamp: the writer fills in b->disk once
+ * the file is in place (see bufsavetail).
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - snap: receives the snapshot.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 on allocation failure or if a snapshot already exists.
+ */
+int bufsnap(Buf *b, Buf *snap);
+
+/*
+ * bufsnapdone releases a snapshot from bufsnap and the storage retired
+ * while it was alive. Call it only after the reader is finished.
+ */
+void bufsnapdone(Buf *snap);
+
+/*
+ * bufeditline returns line i for modification. Call it instead of
+ * bufgetline before changing a line's bytes: the line then no longer
+ * counts towards the clean prefix bufsavetail relies on.
+ *
+ * Returns:
+ *  - pointer to Line on success.
+ *  - nil if out of range.
+ */
+Line *bufeditline(Buf *b, long i);
+
 /*
  * bufgetline returns the address of the i-th line.
  *
@@ -119,6 +245,52 @@ void buftrackgap(Buf *b, long at);
  */
 int bufinsertline(Buf *b, long at, const char *s, size_t n);
 
+/*
+ * bufadopt appends n lines built elsewhere (for example by a loader
+ * thread) to b, taking ownership. Their storage must come from malloc and
+ * is charged to b's memory counters here.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 on allocation failure (the lines are not adopted).
+ */
+int bufadopt(Buf *b, Line *l, size_t n);
+
+/*
+ * bufloadlines turns p[0..size-1] into lines for bufadopt, cutting it into
+ * newline-aligned ranges built by several threads as bufload does for
+ * big files. A last line without a newline is included. The line array
+ * and storage come from malloc and are not charged anywhere yet.
+ *
+ * Parameters:
+ *  - line, nline: output lines (nil and 0 if there are none).
+ *  - clean, cleanoff: output count and bytes of the leading lines that
+ *    end in a plain newline (see Buf.clean).
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 on allocation failure (errno is set; nothing is returned).
+ */
+int bufloadlines(const char *p, size_t size, Line **line, size_t *nline, size_t *clean, size_t *cleanoff);
+
+/*
+ * bufappendbytes appends s[0..n-1], bytes added to the end of the file
+ * b was read from, split into lines as bufload splits them. The clean
+ * prefix grows with them while it covers the whole buffer.
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - s: the new bytes.
+ *  - n: their number.
+ *  - part: non-zero if the last line of b is still open (the file did not
+ *    end in a newline), so the bytes up to the first newline extend it;
+ *    updated for the bytes appended.
+ *
+ * Returns:
+ *  - number of lines added, or -1 on allocation failure.
+ */
+long bufappendbytes(Buf *b, const char *s, size_t n, int *part);
+
 /*
  * bufdelline deletes the line at index at.
  *
@@ -132,6 +304,43 @@ int bufinsertline(Buf *b, long at, const char *s, size_t n);
  */
 int bufdelline(Buf *b, long at);
 
+/*
+ * bufdellines deletes n lines starting at index at (fewer if the buffer
+ * ends first) with one gap move.
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - at: index of the first line.
+ *  - n: number of lines.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if at is out of range.
+ */
+int bufdellines(Buf *b, long at, long n);
+
+/*
+ * bufmatch finds a matching delimiter, respecting nesting of the same
+ * pair: forward from (y, x), the closer that balances an opener just
+ * before it; backward, the opener that balances a closer just after it.
+ * The first query builds an index of b in blocks of lines;
+ * edits only mark their blocks for a rescan, and whole blocks in between
+ * are skipped in O(log n) by their counts of unbalanced delimiters.
+ *
+ * Parameters:
+ *  - b: buffer.
+ *  - dir: 1 to search forward from (y, x), -1 backward (x is clamped to
+ *    the line; the search includes (y, x) either way).
+ *  - open: opening delimiter of the pair: ( [ { or <.
+ *  - y, x: starting position.
+ *  - my, mx: receive the position of the match.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if there is no match or open is not a delimiter.
+ */
+int bufmatch(Buf *b, int dir, int open, long y, long x, long *my, long *mx);
+
 /*
  * linebytes returns a contiguous view of the line's bytes.
  *
@@ -148,7 +357,8 @@ const char *linebytes(Line *l);
  *
  * Parameters:
  *  - l: line to replace.
- *  - s: heap-owned buffer (may be nil if n == 0).
+ *  - s: malloc'd buffer of exactly n bytes (may be nil if n == 0); it is
+ *    charged to Memline from here on.
  *  - n: number of bytes in s.
  *
  * Returns:
@@ -5,6 +5,32 @@ enum {
 	LINE_MIN_CAP = 32,
 };
 
+/* terminal output */
+enum {
+	SYNCOUTPUT = 1,      /* wrap frames in synchronized output (mode 2026) */
+	OUTCHUNK = 1 << 20,  /* stream frames larger than this many bytes */
+};
+
+/* file loading */
+enum {
+	LOADPARALLEL = 8 << 20,     /* files this big are loaded by several threads */
+	LOADTHREADS = 0,            /* most load threads; 0: one per online CPU */
+	LOADPROGRESSIVE = 64 << 20, /* files this big are shown while they load */
+};
+
+/* tail-follow (:follow, -f) */
+enum {
+	FOLLOWPOLL = 500, /* ms between checks where inotify is not available */
+};
+
+/* key mappings (:map) */
+enum {
+	MAPTIMEOUT = 1000, /* ms to wait for the rest of a multi-key LHS */
+};
+
+/* latency probes and :perf histograms; 0 compiles them out */
+#define PERF 0
+
 /* cursor shapes (DECSCUSR: ESC [ Ps SP q) */
 enum {
 	Cursorblinkingblock = 1,
@@ -0,0 +1,67 @@
+/* default configuration for eek; copy to config.h and edit */
+
+enum {
+	TABSTOP = 8,
+	LINE_MIN_CAP = 32,
+};
+
+/* terminal output */
+enum {
+	SYNCOUTPUT = 1,      /* wrap frames in synchronized output (mode 2026) */
+	OUTCHUNK = 1 << 20,  /* stream frames larger than this many bytes */
+};
+
+/* file loading */
+enum {
+	LOADPARALLEL = 8 << 20,     /* files this big are loaded by several threads */
+	LOADTHREADS = 0,            /* most load threads; 0: one per online CPU */
+	LOADPROGRESSIVE = 64 << 20, /* files this big are shown while they load */
+};
+
+/* tail-follow (:follow, -f) */
+enum {
+	FOLLOWPOLL = 500, /* ms between checks where inotify is not available */
+};
+
+/* key mappings (:map) */
+enum {
+	MAPTIMEOUT = 1000, /* ms to wait for the rest of a multi-key LHS */
+};
+
+/* latency probes and :perf histograms; 0 compiles them out */
+#define PERF 0
+
+/* cursor shapes (DECSCUSR: ESC [ Ps SP q) */
+enum {
+	Cursorblinkingblock = 1,
+	Cursorsteadyblock = 2,
+	Cursorblinkingunderline = 3,
+	Cursorsteadyunderline = 4,
+	Cursorblinkingbar = 5,
+	Cursorsteadybar = 6,
+};
+
+enum {
+	Cursornormal = Cursorsteadyblock,
+	Cursorinsert = Cursorsteadybar,
+	Cursorcmd = Cursorsteadyunderline,
+};
+
+/* key bytes (terminal escape decoding is done in key.c) */
+enum {
+	Kesc = 0x1b,
+	Kdel = 0x7f,
+};
+
+/* :apply registry types + executor */
+#include "apply.h"
+
+/* Optional example apply function (implemented in apply.c). */
+int apply_space_between(const char *in, long inlen, int argc, char **argv,
+			char **out, long *outlen);
+
+static const Apply applytab[] = {
+	{ "space-between", apply_space_between },
+	{ 0, 0 },
+};
+
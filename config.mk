@@ -6,5 +6,5 @@ MANPREFIX = ${PREFIX}/share/man
 CC = cc
 
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700
-CFLAGS = -std=c99 -Wall -Wextra -Wpedantic -Os
-LDFLAGS =
+CFLAGS = -std=c99 -Wall -Wextra -Wpedantic -Os -pthread
+LDFLAGS = -pthread
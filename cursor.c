@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "eek_internal.h"
+#include "mem.h"
+
+/*
+ * cmpcur orders cursors by position (qsort callback).
+ */
+static int
+cmpcur(const void *a, const void *b)
+{
+	const Cursor *p, *q;
+
+	p = a;
+	q = b;
+	if (p->y != q->y)
+		return p->y < q->y ? -1 : 1;
+	if (p->x != q->x)
+		return p->x < q->x ? -1 : 1;
+	return 0;
+}
+
+/*
+ * tidy drops cursors that ran into one another and moves the primary
+ * cursor to where its entry ended up; cx/cy follow it.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - sorted: non-zero if mc[] is still in buffer order.
+ */
+static void
+tidy(Eek *e, int sorted)
+{
+	Cursor prim;
+	long i, n;
+
+	prim = e->mc[e->mcprim];
+	if (!sorted)
+		qsort(e->mc, (size_t)e->nmc, sizeof e->mc[0], cmpcur);
+	for (n = 0, i = 0; i < e->nmc; i++) {
+		if (n > 0 && cmpcur(&e->mc[n - 1], &e->mc[i]) == 0)
+			continue;
+		e->mc[n++] = e->mc[i];
+	}
+	e->nmc = n;
+	for (i = 0; i < n && cmpcur(&e->mc[i], &prim) < 0; i++)
+		;
+	e->mcprim = i < n ? i : n - 1;
+	e->cy = e->mc[e->mcprim].y;
+	e->cx = e->mc[e->mcprim].x;
+}
+
+int
+cursoradd(Eek *e, long y, long x)
+{
+	Cursor *p;
+	long ncap;
+
+	if (e->nmc == e->capmc) {
+		ncap = e->capmc > 0 ? e->capmc * 2 : 16;
+		p = memrealloc(Memother, e->mc, (size_t)e->capmc * sizeof e->mc[0],
+			(size_t)ncap * sizeof e->mc[0]);
+		if (p == nil)
+			return -1;
+		e->mc = p;
+		e->capmc = ncap;
+	}
+	e->mc[e->nmc].y = y;
+	e->mc[e->nmc].x = x;
+	e->nmc++;
+	return 0;
+}
+
+int
+cursorbegin(Eek *e)
+{
+	Cursor here;
+	long i;
+
+	if (e->nmc == 0)
+		return -1;
+	qsort(e->mc, (size_t)e->nmc, sizeof e->mc[0], cmpcur);
+	/* The primary is the first cursor at or after the current position. */
+	here.y = e->cy;
+	here.x = e->cx;
+	for (i = 0; i < e->nmc && cmpcur(&e->mc[i], &here) < 0; i++)
+		;
+	e->mcprim = i < e->nmc ? i : 0;
+	tidy(e, 1);
+	if (undopush(e) < 0) {
+		cursorend(e);
+		return -1;
+	}
+	return 0;
+}
+
+void
+cursorend(Eek *e)
+{
+	memfree(Memother, e->mc, (size_t)e->capmc * sizeof e->mc[0]);
+	e->mc = nil;
+	e->nmc = 0;
+	e->capmc = 0;
+	e->mcprim = 0;
+}
+
+int
+cursoreach(Eek *e, int (*fn)(Eek *e, void *arg), void *arg)
+{
+	long i, y, x;
+	long dy, srcy, mapy, mapdx;
+	long y0;
+	int rc;
+
+	e->mc[e->mcprim].y = e->cy;
+	e->mc[e->mcprim].x = e->cx;
+	/*
+	 * mc[] holds positions from before the batch. An edit only moves text
+	 * after it: lines below shift by the lines it added or removed (dy),
+	 * and the rest of its own line moves with it to (mapy, x + mapdx).
+	 */
+	rc = 0;
+	dy = 0;
+	srcy = -1;
+	mapy = 0;
+	mapdx = 0;
+	for (i = 0; i < e->nmc; i++) {
+		y = e->mc[i].y;
+		x = e->mc[i].x;
+		if (y != srcy) {
+			srcy = y;
+			mapy = y + dy;
+			mapdx = 0;
+		}
+		e->cy = mapy;
+		e->cx = x + mapdx;
+		y0 = e->cy;
+		if (fn(e, arg) < 0)
+			rc = -1;
+		dy += e->cy - y0;
+		mapy = e->cy;
+		mapdx = e->cx - x;
+		e->mc[i].y = e->cy;
+		e->mc[i].x = e->cx;
+	}
+	tidy(e, 1);
+	return rc;
+}
+
+void
+cursormove(Eek *e, void (*move)(Eek *e))
+{
+	long i;
+
+	e->mc[e->mcprim].y = e->cy;
+	e->mc[e->mcprim].x = e->cx;
+	for (i = 0; i < e->nmc; i++) {
+		e->cy = e->mc[i].y;
+		e->cx = e->mc[i].x;
+		move(e);
+		e->mc[i].y = e->cy;
+		e->mc[i].x = e->cx;
+	}
+	/* Cursors held back at the top or bottom can pass others. */
+	tidy(e, 0);
+}
+
+long
+cursorline(Eek *e, long y)
+{
+	long lo, hi, mid;
+
+	lo = 0;
+	hi = e->nmc;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (e->mc[mid].y < y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
@@ -7,6 +7,9 @@
 #include <unistd.h>
 
 #include "eek_internal.h"
+#include "ev.h"
+#include "mem.h"
+#include "perf.h"
 
 static void argsinit(Args *a);
 static void argsfree(Args *a);
@@ -14,13 +17,19 @@ static int argspush(Args *a, long v);
 static long argsat(const Args *a, int i, long def);
 
 static int movematch(const Move *m, int mode, const Key *k);
-static int movedispatch(Eek *e, int mode, const Move *moves, long nmoves, const Key *k, Args *a);
+static int keymapbuild(Keymap *km, int mode, const Move *moves, long nmoves);
+static int movedispatch(Eek *e, const Keymap *km, const Key *k, Args *a);
+
+/* Key tables compiled per mode by keymapinit. */
+static Keymap nvmap[Nmode], insmap, cmdmap;
 
 static int cmdkey(Eek *e, const Key *k);
 static int inskey(Eek *e, const Key *k);
 static int nvkey(Eek *e, const Key *k);
 
 static long countval(long n);
+static void pendset(Eek *e, int state, long op, long find, long count);
+static void pendclear(Eek *e);
 void setmsg(Eek *e, const char *fmt, ...);
 static void yclear(Eek *e);
 static int yset(Eek *e, const char *s, long n, int linewise);
@@ -35,8 +44,8 @@ static void setmode(Eek *e, int mode);
 static int yankrange(Eek *e, long y0, long x0, long y1, long x1);
 static int yankblock(Eek *e, long y0, long y1, long rx0, long rx1);
 static int delimpair(long c, char *open, char *close);
-static int findopen(Eek *e, char open, char close, long *oy, long *ox);
-static int findclosefrom(Eek *e, long sy, long sx, char open, char close, long *cy, long *cx);
+static int findopen(Eek *e, char open, long *oy, long *ox);
+static int findclosefrom(Eek *e, long sy, long sx, char open, long *cy, long *cx);
 
 static void drawattrs(Eek *e, int inv);
 
@@ -76,20 +85,19 @@ void normalfixcursor(Eek *e);
 static long rxfromcx(Eek *e, long y, long cx);
 long cxfromrx(Eek *e, long y, long rx);
 void vselblockbounds(Eek *e, long *y0, long *y1, long *rx0, long *rx1);
-static int invselblock(Eek *e, long y, long rx);
+static void selinit(Eek *e, Sel *sel);
+static void selrow(const Sel *sel, long y, long *lo, long *hi);
+static int mcat(Eek *e, long *mi, long y, long x);
 static int delblock(Eek *e, long y0, long y1, long rx0, long rx1, int yank);
 
-static void blockclear(Eek *e);
-static int blockappend(Eek *e, const char *s, long n);
-static void blockpop(Eek *e);
-static void blockapplyinsert(Eek *e);
-
 static int feedpop(Eek *e, KeyEvent *ev);
 static int feedpushfront(Eek *e, const KeyEvent *ev);
+static int feedpushfrontn(Eek *e, const KeyEvent *ev, long n);
+static void feedfree(Eek *e);
 
-static int mapset(Eek *e, unsigned modes, long lhs, const char *rhs);
-static int mapdel(Eek *e, unsigned modes, long lhs);
-static int mapapply(Eek *e, int mode, long lhs);
+static int mapset(Eek *e, unsigned modes, const long *lhs, int nlhs, const char *rhs);
+static int mapdel(Eek *e, unsigned modes, const long *lhs, int nlhs);
+static int mapapply(Eek *e, int mode, const KeyEvent *ev);
 static void mapfreeall(Eek *e);
 
 static int dotstartkey(long r);
@@ -97,7 +105,11 @@ static void dotrecstart(Eek *e);
 static void dotrecsave(Eek *e);
 static void dotreccancel(Eek *e);
 static void dotrecadd(Eek *e, const KeyEvent *ev);
+static void macrorecadd(Eek *e, const KeyEvent *ev);
+static void macroabort(Eek *e);
+static void macrofree(Eek *e);
 static int dotrepeat(Eek *e, Args *a);
+static void dispatchkey(Eek *e, const Key *k);
 static int findagain(Eek *e, Args *a);
 static int findagainrev(Eek *e, Args *a);
 static void replchars(Eek *e, long r, long n);
@@ -117,35 +129,99 @@ argsinit(Args *a)
 static int
 feedpop(Eek *e, KeyEvent *ev)
 {
-	KeyEvent out;
-
 	if (e == nil || ev == nil)
 		return 0;
 	if (e->feedlen <= 0)
 		return 0;
-	out = e->feed[e->feedhead];
-	e->feedhead = (e->feedhead + 1) % (int)(sizeof e->feed / sizeof e->feed[0]);
+	*ev = e->feed[e->feedhead];
+	e->feedhead = (e->feedhead + 1) % e->feedcap;
 	e->feedlen--;
-	*ev = out;
 	return 1;
 }
 
+/*
+ * feedreserve makes room in the feed for n more events. A grown ring is
+ * laid out again from index 0.
+ *
+ * Returns:
+ *  0 on success, -1 on allocation failure (the feed is unchanged).
+ */
+static int
+feedreserve(Eek *e, long n)
+{
+	KeyEvent *nf;
+	long ncap, first;
+
+	if (n <= e->feedcap - e->feedlen)
+		return 0;
+	if (n > LONG_MAX / 2 - e->feedlen)
+		return -1;
+	for (ncap = e->feedcap > 0 ? e->feedcap : 64; ncap < e->feedlen + n; ncap *= 2)
+		;
+	nf = memalloc(Memother, (size_t)ncap * sizeof nf[0]);
+	if (nf == nil)
+		return -1;
+	first = e->feedcap - e->feedhead < e->feedlen ? e->feedcap - e->feedhead : e->feedlen;
+	if (e->feedlen > 0) {
+		memcpy(nf, &e->feed[e->feedhead], (size_t)first * sizeof nf[0]);
+		memcpy(nf + first, e->feed, (size_t)(e->feedlen - first) * sizeof nf[0]);
+	}
+	memfree(Memother, e->feed, (size_t)e->feedcap * sizeof e->feed[0]);
+	e->feed = nf;
+	e->feedcap = ncap;
+	e->feedhead = 0;
+	return 0;
+}
+
 static int
 feedpushfront(Eek *e, const KeyEvent *ev)
 {
-	int cap;
+	return feedpushfrontn(e, ev, 1);
+}
 
-	if (e == nil || ev == nil)
+/*
+ * feedpushfrontn puts ev[0..n-1] in front of the feed, so ev[0] is popped
+ * next. The feed grows as needed; the events are copied as (at most) two
+ * blocks.
+ *
+ * Returns:
+ *  0 on success, -1 on allocation failure (nothing is queued).
+ */
+static int
+feedpushfrontn(Eek *e, const KeyEvent *ev, long n)
+{
+	long head, first;
+
+	if (e == nil || ev == nil || n < 0)
 		return -1;
-	cap = (int)(sizeof e->feed / sizeof e->feed[0]);
-	if (e->feedlen >= cap)
+	if (n == 0)
+		return 0;
+	if (feedreserve(e, n) < 0)
 		return -1;
-	e->feedhead = (e->feedhead - 1 + cap) % cap;
-	e->feed[e->feedhead] = *ev;
-	e->feedlen++;
+	head = (e->feedhead - n % e->feedcap + e->feedcap) % e->feedcap;
+	first = e->feedcap - head < n ? e->feedcap - head : n;
+	memcpy(&e->feed[head], ev, (size_t)first * sizeof ev[0]);
+	memcpy(&e->feed[0], ev + first, (size_t)(n - first) * sizeof ev[0]);
+	e->feedhead = head;
+	e->feedlen += n;
 	return 0;
 }
 
+/*
+ * feedfree drops queued events and releases the feed and dot buffers.
+ */
+static void
+feedfree(Eek *e)
+{
+	memfree(Memother, e->feed, (size_t)e->feedcap * sizeof e->feed[0]);
+	memfree(Memother, e->dotbuf, (size_t)e->dotcap * sizeof e->dotbuf[0]);
+	memfree(Memother, e->dotrecbuf, (size_t)e->dotreccap * sizeof e->dotrecbuf[0]);
+	e->feed = e->dotbuf = e->dotrecbuf = nil;
+	e->feedcap = e->feedhead = e->feedlen = 0;
+	e->dotcap = e->dotlen = 0;
+	e->dotreccap = e->dotreclen = 0;
+}
+
 static int
 dotstartkey(long r)
 {
@@ -178,8 +254,9 @@ replchars(Eek *e, long r, long n)
 {
 	Line *l;
 	char s[8];
+	char *rep;
 	long nb;
-	long i;
+	long i, j;
 	long x1;
 	long len;
 
@@ -193,27 +270,31 @@ replchars(Eek *e, long r, long n)
 	nb = utf8enc(r, s);
 	if (nb <= 0)
 		return;
+	l = bufeditline(&e->b, e->cy);
+	if (l == nil)
+		return;
+	len = lsz(l->n);
+	if (e->cx < 0)
+		e->cx = 0;
+	if (e->cx >= len)
+		return;
 
-	for (i = 0; i < n; i++) {
-		l = bufgetline(&e->b, e->cy);
-		if (l == nil)
-			break;
-		len = l->n;
-		if (e->cx < 0)
-			e->cx = 0;
-		if (e->cx >= len)
-			break;
-		x1 = nextutf8(e, e->cy, e->cx);
-		if (x1 <= e->cx)
-			break;
-		if (linedelrange(l, e->cx, x1 - e->cx) < 0)
-			break;
-		if (lineinsert(l, e->cx, s, nb) < 0)
-			break;
+	/* Replace the (up to) n codepoints under the cursor as one range. */
+	x1 = e->cx;
+	for (i = 0; i < n && x1 < len; i++)
+		x1 = nextutf8(e, e->cy, x1);
+	rep = memalloc(Memother, (size_t)(i * nb));
+	if (rep == nil)
+		return;
+	for (j = 0; j < i; j++)
+		memcpy(rep + j * nb, s, (size_t)nb);
+	if (linedelrange(l, e->cx, (size_t)(x1 - e->cx)) == 0 &&
+	    lineinsert(l, e->cx, rep, (size_t)(i * nb)) == 0) {
 		e->dirty = 1;
-		if (i + 1 < n)
-			e->cx = nextutf8(e, e->cy, e->cx);
+		/* On the last one replaced, or past the end if the line ran out. */
+		e->cx += (i < n ? i : i - 1) * nb;
 	}
+	memfree(Memother, rep, (size_t)(i * nb));
 }
 
 static int
@@ -222,8 +303,7 @@ replbegin(Eek *e, Args *a)
 	(void)a;
 	if (e == nil)
 		return 0;
-	e->rpending = 1;
-	e->rcount = countval(e->count);
+	pendset(e, Pendrepl, 0, 0, countval(e->count));
 	e->count = 0;
 	e->opcount = 0;
 	e->lastnormalrune = 0;
@@ -271,7 +351,7 @@ delend(Eek *e, Args *a)
 	e->opcount = 0;
 	if (undopush(e) < 0)
 		return 0;
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l != nil) {
 		ls = linebytes(l);
 		len = l->n;
@@ -319,7 +399,7 @@ sublinecmd(Eek *e, Args *a)
 		return 0;
 	(void)yanklines(e, e->cy, n);
 
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil)
 		return 0;
 	if (l->n > 0)
@@ -351,7 +431,8 @@ dotrecstart(Eek *e)
 static void
 dotrecsave(Eek *e)
 {
-	int i;
+	KeyEvent *t;
+	long i, cap;
 
 	if (e == nil)
 		return;
@@ -360,9 +441,18 @@ dotrecsave(Eek *e)
 		e->dotreclen = 0;
 		return;
 	}
-	e->dotlen = 0;
-	for (i = 0; i < e->dotreclen && i < (int)(sizeof e->dotbuf / sizeof e->dotbuf[0]); i++)
-		e->dotbuf[e->dotlen++] = e->dotrecbuf[i];
+	/* The recording becomes the replay buffer; the old one records next. */
+	for (i = 0; i < e->dotreclen; i++) {
+		e->dotrecbuf[i].nomap = 1;
+		e->dotrecbuf[i].src = Keysrcdot;
+	}
+	t = e->dotbuf;
+	cap = e->dotcap;
+	e->dotbuf = e->dotrecbuf;
+	e->dotcap = e->dotreccap;
+	e->dotlen = e->dotreclen;
+	e->dotrecbuf = t;
+	e->dotreccap = cap;
 	e->dotrec = 0;
 	e->dotreclen = 0;
 }
@@ -379,166 +469,502 @@ dotreccancel(Eek *e)
 static void
 dotrecadd(Eek *e, const KeyEvent *ev)
 {
+	KeyEvent *np;
+	long ncap;
+
 	if (e == nil || ev == nil)
 		return;
 	if (!e->dotrec)
 		return;
-	if (e->dotreclen >= (int)(sizeof e->dotrecbuf / sizeof e->dotrecbuf[0])) {
-		dotreccancel(e);
-		setmsg(e, "dot buffer overflow");
-		return;
+	if (e->dotreclen == e->dotreccap) {
+		ncap = e->dotreccap > 0 ? e->dotreccap * 2 : 64;
+		np = memrealloc(Memother, e->dotrecbuf, (size_t)e->dotreccap * sizeof np[0],
+			(size_t)ncap * sizeof np[0]);
+		if (np == nil) {
+			dotreccancel(e);
+			setmsg(e, "Out of memory");
+			return;
+		}
+		e->dotrecbuf = np;
+		e->dotreccap = ncap;
 	}
 	e->dotrecbuf[e->dotreclen++] = *ev;
 }
 
-static int
-mapset(Eek *e, unsigned modes, long lhs, const char *rhs)
+/*
+ * macrorecadd appends ev, a key dispatched while q{reg} records, to the
+ * recording.
+ */
+static void
+macrorecadd(Eek *e, const KeyEvent *ev)
 {
-	long i;
-	char *p;
+	KeyEvent *np;
 	long ncap;
-	void *np;
 
-	if (e == nil || rhs == nil)
-		return -1;
-	if (lhs <= 0)
+	if (e->macrolen == e->macrocap) {
+		ncap = e->macrocap > 0 ? e->macrocap * 2 : 64;
+		np = memrealloc(Memreg, e->macrobuf, (size_t)e->macrocap * sizeof np[0],
+			(size_t)ncap * sizeof np[0]);
+		if (np == nil) {
+			e->macroreg = 0;
+			e->macrolen = 0;
+			setmsg(e, "Out of memory; recording stopped");
+			return;
+		}
+		e->macrobuf = np;
+		e->macrocap = ncap;
+	}
+	e->macrobuf[e->macrolen++] = *ev;
+}
+
+/*
+ * macrostop ends q{reg}: the keys recorded, less the q that stopped it,
+ * replace the register. They are stored ready to replay (nomap, since
+ * maps were already expanded when they were recorded).
+ */
+static void
+macrostop(Eek *e)
+{
+	KeyEvent *ev;
+	long i, n;
+	int r;
+
+	r = e->macroreg - 'a';
+	e->macroreg = 0;
+	n = e->macrolen;
+	if (n > 0 && e->macrobuf[n - 1].k.kind == Keyrune && e->macrobuf[n - 1].k.value == 'q')
+		n--;
+	e->macrolen = 0;
+	ev = nil;
+	if (n > 0) {
+		ev = memalloc(Memreg, (size_t)n * sizeof ev[0]);
+		if (ev == nil) {
+			setmsg(e, "Out of memory");
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			ev[i] = e->macrobuf[i];
+			ev[i].nomap = 1;
+			ev[i].src = Keysrcmacro;
+		}
+	}
+	memfree(Memreg, e->macro[r], (size_t)e->nmacro[r] * sizeof ev[0]);
+	e->macro[r] = ev;
+	e->nmacro[r] = n;
+}
+
+/*
+ * macroplay queues n copies of register reg for replay. The replay runs
+ * without redrawing until its last key (see main).
+ *
+ * Returns:
+ *  0 on success, -1 if the register is empty or memory ran out.
+ */
+static int
+macroplay(Eek *e, int reg, long n)
+{
+	long len, i;
+	int r;
+
+	r = reg - 'a';
+	len = e->nmacro[r];
+	if (len == 0) {
+		setmsg(e, "Register %c is empty", reg);
 		return -1;
-	if (*rhs == 0)
+	}
+	if (n > LONG_MAX / 2 / len || feedreserve(e, n * len) < 0) {
+		setmsg(e, "Out of memory");
 		return -1;
+	}
+	for (i = 0; i < n; i++)
+		(void)feedpushfrontn(e, e->macro[r], len);
+	e->macroleft += n * len;
+	e->lastmacro = reg;
+	return 0;
+}
 
-	for (i = 0; i < e->nmaps; i++) {
-		if (e->maps[i].lhs == lhs && e->maps[i].modes == modes) {
-			p = strdup(rhs);
-			if (p == nil)
-				return -1;
-			free(e->maps[i].rhs);
-			e->maps[i].rhs = p;
-			return 0;
+/*
+ * macroabort drops the rest of a running replay after a command failed
+ * (a search or motion went nowhere), so @{reg} with a big count stops at
+ * the end of what it can do, as in vi.
+ */
+static void
+macroabort(Eek *e)
+{
+	KeyEvent ev;
+
+	while (e->macroleft > 0 && feedpop(e, &ev)) {
+		if (ev.src == Keysrcmacro)
+			e->macroleft--;
+	}
+	e->macroleft = 0;
+}
+
+static void
+macrofree(Eek *e)
+{
+	int r;
+
+	for (r = 0; r < 26; r++) {
+		memfree(Memreg, e->macro[r], (size_t)e->nmacro[r] * sizeof e->macro[r][0]);
+		e->macro[r] = nil;
+		e->nmacro[r] = 0;
+	}
+	memfree(Memreg, e->macrobuf, (size_t)e->macrocap * sizeof e->macrobuf[0]);
+	e->macrobuf = nil;
+	e->macrolen = e->macrocap = 0;
+	e->macroreg = 0;
+}
+
+/*
+ * mapkid finds the child of n reached by rune r.
+ *
+ * Parameters:
+ *  n: trie node.
+ *  r: rune.
+ *  at: if not nil, receives the index of the child, or where it would go.
+ *
+ * Returns:
+ *  The child, or nil.
+ */
+static Mapnode *
+mapkid(const Mapnode *n, long r, long *at)
+{
+	long lo, hi, mid;
+
+	lo = 0;
+	hi = n->nkid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (n->kid[mid]->r < r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (at != nil)
+		*at = lo;
+	if (lo < n->nkid && n->kid[lo]->r == r)
+		return n->kid[lo];
+	return nil;
+}
+
+/*
+ * mapnodeclear frees the mapping and the subtree of n (not n itself).
+ */
+static void
+mapnodeclear(Mapnode *n)
+{
+	long i;
+
+	for (i = 0; i < n->nkid; i++) {
+		mapnodeclear(n->kid[i]);
+		memfree(Memmap, n->kid[i], sizeof *n->kid[i]);
+	}
+	memfree(Memmap, n->kid, (size_t)n->capkid * sizeof n->kid[0]);
+	memfree(Memmap, n->rhs, (size_t)n->nrhs * sizeof n->rhs[0]);
+	memset(n, 0, sizeof *n);
+}
+
+/*
+ * mapinsert returns the node for lhs under root, creating missing nodes.
+ *
+ * Returns:
+ *  The node, or nil on allocation failure.
+ */
+static Mapnode *
+mapinsert(Mapnode *root, const long *lhs, int nlhs)
+{
+	Mapnode *n, *k;
+	void *np;
+	long at, ncap;
+	int i;
+
+	n = root;
+	for (i = 0; i < nlhs; i++) {
+		k = mapkid(n, lhs[i], &at);
+		if (k != nil) {
+			n = k;
+			continue;
 		}
+		if (n->nkid + 1 > n->capkid) {
+			ncap = n->capkid > 0 ? n->capkid * 2 : 4;
+			np = memrealloc(Memmap, n->kid, (size_t)n->capkid * sizeof n->kid[0],
+				(size_t)ncap * sizeof n->kid[0]);
+			if (np == nil)
+				return nil;
+			n->kid = np;
+			n->capkid = ncap;
+		}
+		k = memalloc(Memmap, sizeof *k);
+		if (k == nil)
+			return nil;
+		memset(k, 0, sizeof *k);
+		k->r = lhs[i];
+		memmove(&n->kid[at + 1], &n->kid[at], (size_t)(n->nkid - at) * sizeof n->kid[0]);
+		n->kid[at] = k;
+		n->nkid++;
+		n = k;
 	}
+	return n;
+}
+
+/*
+ * mapremove drops the mapping for lhs under n and prunes the nodes left
+ * without mapping or children.
+ *
+ * Returns:
+ *  0 if a mapping was removed, -1 if lhs was not mapped.
+ */
+static int
+mapremove(Mapnode *n, const long *lhs, int nlhs)
+{
+	Mapnode *k;
+	long at;
 
-	if (e->nmaps + 1 > e->capmaps) {
-		ncap = e->capmaps > 0 ? e->capmaps * 2 : 16;
-		np = realloc(e->maps, (size_t)ncap * sizeof e->maps[0]);
-		if (np == nil)
+	if (nlhs == 0) {
+		if (n->rhs == nil)
 			return -1;
-		e->maps = np;
-		e->capmaps = ncap;
+		memfree(Memmap, n->rhs, (size_t)n->nrhs * sizeof n->rhs[0]);
+		n->rhs = nil;
+		n->nrhs = 0;
+		return 0;
 	}
-
-	p = strdup(rhs);
-	if (p == nil)
+	k = mapkid(n, lhs[0], &at);
+	if (k == nil || mapremove(k, lhs + 1, nlhs - 1) < 0)
 		return -1;
-	e->maps[e->nmaps].modes = modes;
-	e->maps[e->nmaps].lhs = lhs;
-	e->maps[e->nmaps].rhs = p;
-	e->nmaps++;
+	if (k->rhs == nil && k->nkid == 0) {
+		mapnodeclear(k);
+		memfree(Memmap, k, sizeof *k);
+		memmove(&n->kid[at], &n->kid[at + 1], (size_t)(n->nkid - at - 1) * sizeof n->kid[0]);
+		n->nkid--;
+	}
 	return 0;
 }
 
+/*
+ * mapset maps lhs to rhs in every mode of modes, replacing an existing
+ * mapping. rhs is decoded here, once, into non-remappable key events.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  modes: bitmask of Mode* values.
+ *  lhs: runes typed to trigger the mapping.
+ *  nlhs: number of lhs runes (1..Maplhsmax).
+ *  rhs: UTF-8 text injected as if typed.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
 static int
-mapdel(Eek *e, unsigned modes, long lhs)
+mapset(Eek *e, unsigned modes, const long *lhs, int nlhs, const char *rhs)
 {
-	long i;
+	Mapnode *n;
+	KeyEvent *ev, *np;
+	long len, nr, adv, r, off;
+	int m;
 
-	if (e == nil)
+	if (e == nil || lhs == nil || rhs == nil)
 		return -1;
-	for (i = 0; i < e->nmaps; i++) {
-		if (e->maps[i].lhs == lhs && e->maps[i].modes == modes) {
-			free(e->maps[i].rhs);
-			memmove(&e->maps[i], &e->maps[i + 1], (size_t)(e->nmaps - i - 1) * sizeof e->maps[0]);
-			e->nmaps--;
-			return 0;
+	if (nlhs <= 0 || nlhs > Maplhsmax || lhs[0] <= 0)
+		return -1;
+	len = (long)strlen(rhs);
+	if (len == 0)
+		return -1;
+
+	for (m = 0; m < Nmode; m++) {
+		if ((modes & (1u << (unsigned)m)) == 0)
+			continue;
+		/* A rune takes at least one byte: len events are enough. */
+		ev = memalloc(Memmap, (size_t)len * sizeof ev[0]);
+		if (ev == nil)
+			return -1;
+		for (nr = 0, off = 0; off < len; off += adv) {
+			r = utf8dec1(rhs + off, len - off, &adv);
+			if (adv <= 0)
+				break;
+			ev[nr].k.kind = Keyrune;
+			ev[nr].k.value = r;
+			ev[nr].nomap = 1;
+			ev[nr].src = Keysrcmap;
+			nr++;
+		}
+		if (nr < len) {
+			np = memrealloc(Memmap, ev, (size_t)len * sizeof ev[0], (size_t)nr * sizeof ev[0]);
+			if (np == nil) {
+				memfree(Memmap, ev, (size_t)len * sizeof ev[0]);
+				return -1;
+			}
+			ev = np;
+		}
+		n = mapinsert(&e->map[m], lhs, nlhs);
+		if (n == nil) {
+			memfree(Memmap, ev, (size_t)nr * sizeof ev[0]);
+			return -1;
 		}
+		memfree(Memmap, n->rhs, (size_t)n->nrhs * sizeof n->rhs[0]);
+		n->rhs = ev;
+		n->nrhs = nr;
 	}
-	return -1;
+	return 0;
 }
 
+/*
+ * mapdel removes the mapping for lhs from every mode of modes.
+ *
+ * Returns:
+ *  0 if a mapping was removed, -1 if lhs was not mapped.
+ */
 static int
-mapapply(Eek *e, int mode, long lhs)
+mapdel(Eek *e, unsigned modes, const long *lhs, int nlhs)
 {
-	unsigned bit;
-	long i;
-	const char *s;
-	long n;
-	long adv;
-	long r;
-	KeyEvent ev;
-	long cap;
-	long *rv;
-	long nr;
-	long ncap;
-	void *np;
+	int m, rc;
 
-	if (e == nil)
-		return 0;
-	if (mode < 0)
-		return 0;
-	bit = 1u << (unsigned)mode;
-	for (i = 0; i < e->nmaps; i++) {
-		if (e->maps[i].lhs != lhs)
-			continue;
-		if ((e->maps[i].modes & bit) == 0)
-			continue;
+	if (e == nil || lhs == nil || nlhs <= 0)
+		return -1;
+	rc = -1;
+	for (m = 0; m < Nmode; m++) {
+		if ((modes & (1u << (unsigned)m)) != 0 && mapremove(&e->map[m], lhs, nlhs) == 0)
+			rc = 0;
+	}
+	return rc;
+}
 
-		/* Inject rhs as non-remappable runes (push front, in reverse). */
-		s = e->maps[i].rhs;
-		n = (long)strlen(s);
-		/* Collect runes first so we can push in reverse order. */
-		{
-			cap = 64;
-			rv = malloc((size_t)cap * sizeof rv[0]);
-			if (rv == nil)
-				return 0;
-			for (nr = 0; n > 0; ) {
-				r = utf8dec1(s, n, &adv);
-				if (adv <= 0)
-					break;
-				if (nr + 1 > cap) {
-					ncap = cap * 2;
-					np = realloc(rv, (size_t)ncap * sizeof rv[0]);
-					if (np == nil) {
-						free(rv);
-						return 0;
-					}
-					rv = np;
-					cap = ncap;
-				}
-				rv[nr++] = r;
-				s += adv;
-				n -= adv;
-			}
-			for (; nr > 0; nr--) {
-				ev.k.kind = Keyrune;
-				ev.k.value = rv[nr];
-				ev.nomap = 1;
-				ev.src = Keysrcmap;
-				if (feedpushfront(e, &ev) < 0) {
-					free(rv);
-					setmsg(e, "map feed overflow");
-					return 1;
-				}
-			}
-			free(rv);
+/*
+ * maplhs decodes the UTF-8 LHS s of :map or :unmap into runes.
+ *
+ * Returns:
+ *  The number of runes (1..Maplhsmax), or -1 if s is too long.
+ */
+static int
+maplhs(const char *s, long lhs[Maplhsmax])
+{
+	long n, adv;
+	int nlhs;
+
+	n = (long)strlen(s);
+	for (nlhs = 0; n > 0; nlhs++) {
+		if (nlhs == Maplhsmax)
+			return -1;
+		lhs[nlhs] = utf8dec1(s, n, &adv);
+		s += adv;
+		n -= adv;
+	}
+	return nlhs;
+}
+
+/*
+ * mapresolve ends a held key sequence that cannot grow any further: the
+ * longest held prefix that is mapped is replaced by its RHS, and the
+ * keys after it go back to the feed to be mapped again. With no mapped
+ * prefix the first key runs unmapped.
+ */
+static void
+mapresolve(Eek *e)
+{
+	Mapnode *n, *hit;
+	int i, d, nheld;
+
+	if (e->maptimer > 0)
+		evdeltimer(e->maptimer);
+	e->maptimer = 0;
+	nheld = e->nmapheld;
+	e->nmapheld = 0;
+	e->mapat = nil;
+	if (nheld == 0)
+		return;
+
+	hit = nil;
+	d = 0;
+	n = &e->map[e->mapmode];
+	for (i = 0; i < nheld && n != nil; i++) {
+		n = mapkid(n, e->mapheld[i].k.value, nil);
+		if (n != nil && n->rhs != nil) {
+			hit = n;
+			d = i + 1;
 		}
+	}
+	if (hit == nil) {
+		e->mapheld[0].nomap = 1;
+		d = 0;
+	}
+	if (feedpushfrontn(e, &e->mapheld[d], nheld - d) < 0 ||
+	    (hit != nil && feedpushfrontn(e, hit->rhs, hit->nrhs) < 0))
+		setmsg(e, "Out of memory");
+}
+
+/*
+ * maptimeout runs when no key followed a held prefix within MAPTIMEOUT.
+ */
+static void
+maptimeout(void *arg)
+{
+	Eek *e;
+
+	e = arg;
+	e->maptimer = 0;
+	mapresolve(e);
+}
+
+/*
+ * mapapply feeds ev, a remappable key typed in mode, to the :map trie.
+ * Keys that may start or continue a multi-key LHS are held; a complete
+ * LHS is replaced by its RHS as soon as no longer LHS can follow it.
+ *
+ * Returns:
+ *  1 if ev was consumed (held, or queued again behind an expansion),
+ *  0 if ev is not mapped and should be dispatched.
+ */
+static int
+mapapply(Eek *e, int mode, const KeyEvent *ev)
+{
+	Mapnode *n, *k;
+
+	if (e == nil || ev == nil || mode < 0 || mode >= Nmode)
+		return 0;
+	n = e->nmapheld > 0 ? e->mapat : &e->map[mode];
+	k = nil;
+	if (ev->k.kind == Keyrune && e->nmapheld < Maplhsmax)
+		k = mapkid(n, ev->k.value, nil);
+	if (k == nil) {
+		if (e->nmapheld == 0)
+			return 0;
+		/* The held keys go first, then ev (which may start a new LHS). */
+		if (feedpushfront(e, ev) < 0)
+			setmsg(e, "Out of memory");
+		mapresolve(e);
 		return 1;
 	}
-	return 0;
+	e->mapmode = mode;
+	e->mapheld[e->nmapheld++] = *ev;
+	e->mapat = k;
+	if (k->nkid == 0) {
+		mapresolve(e);
+		return 1;
+	}
+	if (e->maptimer > 0)
+		evdeltimer(e->maptimer);
+	e->maptimer = evaddtimer(MAPTIMEOUT, 0, maptimeout, e);
+	if (e->maptimer < 0) {
+		e->maptimer = 0;
+		mapresolve(e);
+	}
+	return 1;
 }
 
 static void
 mapfreeall(Eek *e)
 {
-	long i;
+	int m;
 
 	if (e == nil)
 		return;
-	for (i = 0; i < e->nmaps; i++)
-		free(e->maps[i].rhs);
-	free(e->maps);
-	e->maps = nil;
-	e->nmaps = 0;
-	e->capmaps = 0;
+	if (e->maptimer > 0)
+		evdeltimer(e->maptimer);
+	e->maptimer = 0;
+	e->nmapheld = 0;
+	e->mapat = nil;
+	for (m = 0; m < Nmode; m++)
+		mapnodeclear(&e->map[m]);
 }
 
 static void
@@ -619,24 +1045,172 @@ movematch(const Move *m, int mode, const Key *k)
 	return 1;
 }
 
-static int
-movedispatch(Eek *e, int mode, const Move *moves, long nmoves, const Key *k, Args *a)
+/*
+ * movefirst returns the first entry of moves that matches k in mode.
+ *
+ * Returns:
+ *  The entry, or nil if none matches.
+ */
+static const Move *
+movefirst(const Move *moves, long nmoves, int mode, const Key *k)
 {
 	long i;
 
-	if (moves == nil || nmoves <= 0)
+	for (i = 0; i < nmoves; i++) {
+		if (movematch(&moves[i], mode, k))
+			return &moves[i];
+	}
+	return nil;
+}
+
+/*
+ * movecmp orders Keymap.rune entries by rune (for qsort).
+ */
+static int
+movecmp(const void *a, const void *b)
+{
+	long x, y;
+
+	x = ((const Move *)a)->value;
+	y = ((const Move *)b)->value;
+	return (x > y) - (x < y);
+}
+
+/*
+ * runecmp compares a rune key (long *) with a Keymap.rune entry (for
+ * bsearch).
+ */
+static int
+runecmp(const void *key, const void *m)
+{
+	long x, y;
+
+	x = *(const long *)key;
+	y = ((const Move *)m)->value;
+	return (x > y) - (x < y);
+}
+
+/*
+ * keymapbuild compiles the entries of moves active in mode into km. Each
+ * key gets the entry a scan with movematch would find first, so the table
+ * order keeps its meaning.
+ *
+ * Parameters:
+ *  km: keymap to fill (its previous contents are not freed).
+ *  mode: Mode* value.
+ *  moves: table.
+ *  nmoves: number of entries.
+ *
+ * Returns:
+ *  0 on success, -1 on allocation failure.
+ */
+static int
+keymapbuild(Keymap *km, int mode, const Move *moves, long nmoves)
+{
+	const Move *m;
+	Move *r;
+	Key k;
+	long i, n;
+
+	memset(km, 0, sizeof *km);
+	k.kind = Keyrune;
+	for (k.value = 0; k.value < 128; k.value++)
+		km->ascii[k.value] = movefirst(moves, nmoves, mode, &k);
+	k.value = 0;
+	for (k.kind = 0; k.kind < Nkey; k.kind++) {
+		if (k.kind != Keyrune)
+			km->kind[k.kind] = movefirst(moves, nmoves, mode, &k);
+	}
+	for (i = 0; i < nmoves; i++) {
+		m = &moves[i];
+		if (m->kind == Keyrune && m->value == -1 && movematch(m, mode, &(Key){ Keyrune, -1 })) {
+			km->anyrune = m;
+			break;
+		}
+	}
+
+	for (n = 0, i = 0; i < nmoves; i++) {
+		if (moves[i].kind == Keyrune && moves[i].value >= 128)
+			n++;
+	}
+	if (n == 0)
 		return 0;
+	km->rune = memalloc(Memother, (size_t)n * sizeof km->rune[0]);
+	if (km->rune == nil)
+		return -1;
+	k.kind = Keyrune;
 	for (i = 0; i < nmoves; i++) {
-		if (!movematch(&moves[i], mode, k))
+		if (moves[i].kind != Keyrune || moves[i].value < 128)
 			continue;
-		if (moves[i].fn == nil)
-			return 1;
-		(void)moves[i].fn(e, a);
-		return 1;
+		k.value = moves[i].value;
+		m = movefirst(moves, nmoves, mode, &k);
+		if (m == nil || bsearch(&k.value, km->rune, (size_t)km->nrune, sizeof km->rune[0], runecmp) != nil)
+			continue;
+		km->rune[km->nrune] = *m;
+		km->rune[km->nrune].value = k.value;
+		km->nrune++;
+		qsort(km->rune, (size_t)km->nrune, sizeof km->rune[0], movecmp);
+	}
+	/* Trim to nrune entries so keymapfree knows the block size. */
+	if (km->nrune == 0) {
+		memfree(Memother, km->rune, (size_t)n * sizeof km->rune[0]);
+		km->rune = nil;
+	} else if (km->nrune < n) {
+		r = memrealloc(Memother, km->rune, (size_t)n * sizeof r[0], (size_t)km->nrune * sizeof r[0]);
+		if (r == nil)
+			return -1;
+		km->rune = r;
 	}
 	return 0;
 }
 
+/*
+ * keymapfree releases what keymapbuild allocated for km.
+ */
+static void
+keymapfree(Keymap *km)
+{
+	memfree(Memother, km->rune, (size_t)km->nrune * sizeof km->rune[0]);
+	memset(km, 0, sizeof *km);
+}
+
+/*
+ * movedispatch runs the entry of km for k.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  km: compiled table for the current mode.
+ *  k: key.
+ *  a: arguments passed to the entry.
+ *
+ * Returns:
+ *  1 if an entry matched (even a no-op one), 0 otherwise.
+ */
+static int
+movedispatch(Eek *e, const Keymap *km, const Key *k, Args *a)
+{
+	const Move *m;
+
+	if (k->kind == Keyrune) {
+		if (k->value >= 0 && k->value < 128) {
+			m = km->ascii[k->value];
+		} else {
+			m = nil;
+			if (km->nrune > 0)
+				m = bsearch(&k->value, km->rune, (size_t)km->nrune, sizeof km->rune[0], runecmp);
+			if (m == nil)
+				m = km->anyrune;
+		}
+	} else {
+		m = k->kind >= 0 && k->kind < Nkey ? km->kind[k->kind] : nil;
+	}
+	if (m == nil)
+		return 0;
+	if (m->fn != nil)
+		(void)m->fn(e, a);
+	return 1;
+}
+
 /*
  * bytesfind finds the first occurrence of needle in haystack.
  *
@@ -863,15 +1437,17 @@ parseaddr(Eek *e, char **pp, long *out)
  *  re: compiled regex for the pattern.
  *  repl: replacement string.
  *  global: non-zero replaces all matches on the line.
- *  l: line to update.
+ *  b: buffer.
+ *  y: line to update (marked edited only if it changes).
  *  nsub: output number of substitutions performed on this line.
  *
  * Returns:
  *  0 on success, -1 on allocation failure.
  */
 static int
-subline(regex_t *re, const char *repl, int global, Line *l, long *nsub)
+subline(regex_t *re, const char *repl, int global, Buf *b, long y, long *nsub)
 {
+	Line *l;
 	char *in;
 	char *out;
 	long outn;
@@ -894,6 +1470,7 @@ subline(regex_t *re, const char *repl, int global, Line *l, long *nsub)
 
 	if (nsub)
 		*nsub = 0;
+	l = bufgetline(b, y);
 	if (re == nil || repl == nil || l == nil)
 		return -1;
 	ls = linebytes(l);
@@ -997,7 +1574,7 @@ subline(regex_t *re, const char *repl, int global, Line *l, long *nsub)
 			out = p;
 		outcap = outn;
 	}
-	(void)linetake(l, out, outn);
+	(void)linetake(bufeditline(b, y), out, outn);
 	out = nil;
 	ret = 0;
 
@@ -1043,7 +1620,6 @@ subexec(Eek *e, char *line)
 	long nsub;
 	long nline;
 	long t;
-	Line *l;
 	long nsl;
 
 	if (e == nil || line == nil)
@@ -1151,11 +1727,8 @@ subexec(Eek *e, char *line)
 	nsub = 0;
 	nline = 0;
 	for (y = a0; y <= a1 && y < lsz(e->b.nline); y++) {
-		l = bufgetline(&e->b, y);
-		if (l == nil)
-			continue;
 		nsl = 0;
-		if (subline(&re, new, global, l, &nsl) < 0) {
+		if (subline(&re, new, global, &e->b, y, &nsl) < 0) {
 			setmsg(e, "Out of memory");
 			goto out;
 		}
@@ -1166,6 +1739,7 @@ subexec(Eek *e, char *line)
 	}
 	if (nsub == 0) {
 		setmsg(e, "Pattern not found");
+		macroabort(e);
 		goto out;
 	}
 	e->dirty = 1;
@@ -1303,49 +1877,69 @@ vselblockbounds(Eek *e, long *y0, long *y1, long *rx0, long *rx1)
 }
 
 /*
- * invsel reports whether the byte position (y, x) lies inside the current
- * VISUAL selection.
+ * selinit captures the VISUAL selection of the loaded window, so draw can
+ * test each cell against a precomputed span instead of recomputing the
+ * selection bounds per character.
  *
  * Parameters:
- *  - e: editor state.
- *  - y, x: position to test.
- *
- * Returns:
- *  - non-zero if selected, 0 otherwise.
+ *  - e: editor state (window state loaded).
+ *  - sel: output selection geometry.
  */
-static int
-invsel(Eek *e, long y, long x)
+static void
+selinit(Eek *e, Sel *sel)
 {
-	long sy, sx, ey, ex;
-
+	memset(sel, 0, sizeof *sel);
 	if (e->mode != Modevisual && !(e->mode == Modecmd && e->cmdkeepvisual))
-		return 0;
-	vselbounds(e, &sy, &sx, &ey, &ex);
-	if (y < sy || y > ey)
-		return 0;
-	if (sy == ey)
-		return x >= sx && x < ex;
-	if (y == sy)
-		return x >= sx;
-	if (y == ey)
-		return x < ex;
-	return 1;
+		return;
+	sel->on = 1;
+	sel->block = e->vmode == Visualblock;
+	if (sel->block)
+		vselblockbounds(e, &sel->y0, &sel->y1, &sel->x0, &sel->x1);
+	else
+		vselbounds(e, &sel->y0, &sel->x0, &sel->y1, &sel->x1);
 }
 
-static int
-invselblock(Eek *e, long y, long rx)
+/*
+ * selrow returns the selected span [*lo, *hi) of line y: byte offsets for
+ * character selections, render columns for block selections.
+ *
+ * Parameters:
+ *  - sel: selection captured by selinit.
+ *  - y: line index.
+ *  - lo, hi: output span (empty if y is not selected).
+ */
+static void
+selrow(const Sel *sel, long y, long *lo, long *hi)
 {
-	long y0, y1;
-	long rx0, rx1;
+	*lo = 0;
+	*hi = 0;
+	if (!sel->on || y < sel->y0 || y > sel->y1)
+		return;
+	if (sel->block) {
+		*lo = sel->x0;
+		*hi = sel->x1 + 1;
+		return;
+	}
+	*lo = y == sel->y0 ? sel->x0 : 0;
+	*hi = y == sel->y1 ? sel->x1 : LONG_MAX;
+}
 
-	if (e == nil)
-		return 0;
-	if (e->mode != Modevisual && !(e->mode == Modecmd && e->cmdkeepvisual))
-		return 0;
-	vselblockbounds(e, &y0, &y1, &rx0, &rx1);
-	if (y < y0 || y > y1)
-		return 0;
-	return rx >= rx0 && rx <= rx1;
+/*
+ * mcat reports whether a cursor other than the primary one (which the
+ * terminal shows) sits at byte x of line y, for draw. Calls for a line
+ * go left to right, so *mi, from cursorline, only moves forward.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - mi: index into e->mc, advanced past cursors before x.
+ *  - y, x: position.
+ */
+static int
+mcat(Eek *e, long *mi, long y, long x)
+{
+	while (*mi < e->nmc && e->mc[*mi].y == y && e->mc[*mi].x < x)
+		(*mi)++;
+	return *mi < e->nmc && *mi != e->mcprim && e->mc[*mi].y == y && e->mc[*mi].x == x;
 }
 
 /*
@@ -1371,9 +1965,9 @@ vselectinside(Eek *e, long c)
 
 	if (!delimpair(c, &open, &close))
 		return -1;
-	if (findopen(e, open, close, &oy, &ox) < 0)
+	if (findopen(e, open, &oy, &ox) < 0)
 		return -1;
-	if (findclosefrom(e, oy, ox, open, close, &cy, &cx) < 0)
+	if (findclosefrom(e, oy, ox, open, &cy, &cx) < 0)
 		return -1;
 	starty = oy;
 	startx = ox + 1;
@@ -1398,17 +1992,9 @@ vsinnerword(Eek *e)
 	long y;
 	long len;
 	long pos;
-	long adv;
-	long r;
 	int cls;
 	long x0, x1;
 	long p;
-	long np;
-	long pp;
-	long px;
-	long pr;
-	long nr;
-	long nx;
 
 	if (e == nil)
 		return -1;
@@ -1423,88 +2009,29 @@ vsinnerword(Eek *e)
 
 	pos = e->cx;
 	if (pos >= len)
-		pos = prevutf8(e, y, len);
+		pos = utf8prev(ls, len);
 	if (pos < 0)
 		pos = 0;
 
 	/* Determine the word class at/near the cursor (word vs punct-word). */
-	r = (pos < len) ? utf8dec1(ls + pos, len - pos, &adv) : -1;
-	cls = isword(r) ? 1 : (ispunctword(r) ? 2 : 0);
-	if (cls == 0) {
-		/* Try to find the next word on this line. */
-		p = pos;
-		for (;;) {
-			if (p >= len)
-				break;
-			r = utf8dec1(ls + p, len - p, &adv);
-			cls = isword(r) ? 1 : (ispunctword(r) ? 2 : 0);
-			if (cls != 0) {
-				pos = p;
-				break;
-			}
-			np = nextutf8(e, y, p);
-			if (np <= p)
-				break;
-			p = np;
-		}
-
-		/* Otherwise, try to find a previous word on this line. */
-		if (cls == 0) {
-			p = pos;
-			for (;;) {
-				if (p <= 0)
-					break;
-				pp = prevutf8(e, y, p);
-				if (pp >= p)
-					break;
-				p = pp;
-				r = utf8dec1(ls + p, len - p, &adv);
-				cls = isword(r) ? 1 : (ispunctword(r) ? 2 : 0);
-				if (cls != 0) {
-					pos = p;
-					break;
-				}
-			}
-		}
-		if (cls == 0)
-			return -1;
-	}
-
-	/* Scan left to word start. */
-	x0 = pos;
-	for (;;) {
-		px = prevutf8(e, y, x0);
-		if (px >= x0)
-			break;
-		pr = utf8dec1(ls + px, len - px, &adv);
-		if (cls == 1) {
-			if (!isword(pr))
-				break;
+	cls = wordcls(ls, len, pos);
+	if (cls == Clsblank) {
+		/* Try the next word on this line, else the previous one. */
+		p = wordrun(ls, len, pos, Clsblank);
+		if (p < len) {
+			pos = p;
 		} else {
-			if (!ispunctword(pr))
-				break;
+			p = wordrunback(ls, len, pos, Clsblank);
+			if (p <= 0)
+				return -1;
+			pos = utf8prev(ls, p);
 		}
-		x0 = px;
+		cls = wordcls(ls, len, pos);
 	}
 
-	/* Scan right to exclusive word end. */
-	x1 = nextutf8(e, y, pos);
-	for (;;) {
-		if (x1 >= len)
-			break;
-		nr = utf8dec1(ls + x1, len - x1, &adv);
-		if (cls == 1) {
-			if (!isword(nr))
-				break;
-		} else {
-			if (!ispunctword(nr))
-				break;
-		}
-		nx = nextutf8(e, y, x1);
-		if (nx <= x1)
-			break;
-		x1 = nx;
-	}
+	/* Word start, and exclusive word end. */
+	x0 = wordrunback(ls, len, pos, cls);
+	x1 = wordrun(ls, len, pos, cls);
 
 	if (x1 <= x0)
 		return 0;
@@ -1512,7 +2039,7 @@ vsinnerword(Eek *e)
 	e->vay = y;
 	e->vax = x0;
 	e->cy = y;
-	e->cx = prevutf8(e, y, x1);
+	e->cx = utf8prev(ls, x1);
 	return 0;
 }
 
@@ -1561,7 +2088,7 @@ delimpair(long c, char *open, char *close)
  *
  * Parameters:
  *  - e: editor state.
- *  - open, close: delimiter pair.
+ *  - open: opening delimiter of the pair.
  *  - oy, ox: output position of the opening delimiter.
  *
  * Returns:
@@ -1569,45 +2096,9 @@ delimpair(long c, char *open, char *close)
  *  - -1 if not found.
  */
 static int
-findopen(Eek *e, char open, char close, long *oy, long *ox)
+findopen(Eek *e, char open, long *oy, long *ox)
 {
-	long y, x;
-	Line *l;
-	long depth;
-	const char *ls;
-	long ln;
-	unsigned char c;
-
-	depth = 0;
-	for (y = e->cy; y >= 0; y--) {
-		l = bufgetline(&e->b, y);
-		if (l == nil)
-			continue;
-		ls = linebytes(l);
-		if (l->n == 0)
-			continue;
-		ln = lsz(l->n);
-		x = ln - 1;
-		if (y == e->cy) {
-			x = e->cx;
-			if (x >= ln)
-				x = ln - 1;
-		}
-		for (; x >= 0; x--) {
-			c = (unsigned char)ls[x];
-			if (c == (unsigned char)close)
-				depth++;
-			else if (c == (unsigned char)open) {
-				if (depth == 0) {
-					*oy = y;
-					*ox = x;
-					return 0;
-				}
-				depth--;
-			}
-		}
-	}
-	return -1;
+	return bufmatch(&e->b, -1, open, e->cy, e->cx, oy, ox);
 }
 
 /*
@@ -1617,7 +2108,7 @@ findopen(Eek *e, char open, char close, long *oy, long *ox)
  * Parameters:
  *  - e: editor state.
  *  - sy, sx: starting position of an opening delimiter.
- *  - open, close: delimiter pair.
+ *  - open: opening delimiter of the pair.
  *  - cy, cx: output position of the closing delimiter.
  *
  * Returns:
@@ -1625,40 +2116,49 @@ findopen(Eek *e, char open, char close, long *oy, long *ox)
  *  - -1 if not found.
  */
 static int
-findclosefrom(Eek *e, long sy, long sx, char open, char close, long *cy, long *cx)
+findclosefrom(Eek *e, long sy, long sx, char open, long *cy, long *cx)
 {
-	long y, x;
-	Line *l;
-	long depth;
-	const char *ls;
-	long ln;
-	unsigned char c;
+	/* The match may be past the loaded lines. */
+	loadwait(e);
+	return bufmatch(&e->b, 1, open, sy, sx + 1, cy, cx);
+}
 
-	depth = 0;
-	for (y = sy; y < lsz(e->b.nline); y++) {
-		l = bufgetline(&e->b, y);
-		if (l == nil)
-			continue;
-		ls = linebytes(l);
-		ln = lsz(l->n);
-		x = 0;
-		if (y == sy)
-			x = sx + 1;
-		for (; x < ln; x++) {
-			c = (unsigned char)ls[x];
-			if (c == (unsigned char)open)
-				depth++;
-			else if (c == (unsigned char)close) {
-				if (depth == 0) {
-					*cy = y;
-					*cx = x;
-					return 0;
-				}
-				depth--;
-			}
-		}
+/*
+ * matchtarget finds where % jumps: the delimiter matching the first of
+ * ( ) [ ] { } at or after the cursor on its line.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - ty, tx: output position of the matching delimiter.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if the line has no delimiter there or it is unmatched.
+ */
+static int
+matchtarget(Eek *e, long *ty, long *tx)
+{
+	Line *l;
+	const char *ls;
+	long x, n;
+	char open, close;
+
+	l = bufgetline(&e->b, e->cy);
+	if (l == nil)
+		return -1;
+	ls = linebytes(l);
+	n = lsz(l->n);
+	for (x = e->cx < 0 ? 0 : e->cx; x < n; x++)
+		if (memchr("()[]{}", ls[x], 6) != nil)
+			break;
+	if (x >= n || !delimpair((unsigned char)ls[x], &open, &close))
+		return -1;
+	if (ls[x] == open) {
+		/* The match may be past the loaded lines. */
+		loadwait(e);
+		return bufmatch(&e->b, 1, open, e->cy, x + 1, ty, tx);
 	}
-	return -1;
+	return bufmatch(&e->b, -1, open, e->cy, x - 1, ty, tx);
 }
 
 /*
@@ -1680,7 +2180,6 @@ delrange(Eek *e, long y0, long x0, long y1, long x1, int yank)
 {
 	Line *l0, *l1;
 	const char *l1s;
-	long i;
 	long nline;
 	long ty, tx;
 	long l0n;
@@ -1709,7 +2208,7 @@ delrange(Eek *e, long y0, long x0, long y1, long x1, int yank)
 		(void)yankrange(e, y0, x0, y1, x1);
 
 	if (y0 == y1) {
-		l0 = bufgetline(&e->b, y0);
+		l0 = bufeditline(&e->b, y0);
 		if (l0 == nil)
 			return -1;
 		l0n = lsz(l0->n);
@@ -1732,11 +2231,10 @@ delrange(Eek *e, long y0, long x0, long y1, long x1, int yank)
 	}
 
 	/* delete middle lines */
-	for (i = y0 + 1; i < y1; i++)
-		(void)bufdelline(&e->b, y0 + 1);
+	(void)bufdellines(&e->b, y0 + 1, y1 - y0 - 1);
 
-	l0 = bufgetline(&e->b, y0);
-	l1 = bufgetline(&e->b, y0 + 1);
+	l0 = bufeditline(&e->b, y0);
+	l1 = bufeditline(&e->b, y0 + 1);
 	if (l0 == nil || l1 == nil)
 		return -1;
 
@@ -1797,9 +2295,9 @@ delinside(Eek *e, long op, long c)
 
 	if (!delimpair(c, &open, &close))
 		return -1;
-	if (findopen(e, open, close, &oy, &ox) < 0)
+	if (findopen(e, open, &oy, &ox) < 0)
 		return -1;
-	if (findclosefrom(e, oy, ox, open, close, &cy, &cx) < 0)
+	if (findclosefrom(e, oy, ox, open, &cy, &cx) < 0)
 		return -1;
 	y0 = oy;
 	x0 = ox + 1;
@@ -1810,6 +2308,31 @@ delinside(Eek *e, long op, long c)
 	return 0;
 }
 
+/*
+ * delmatch deletes (and yanks) from the cursor to the delimiter % would
+ * jump to, both included, for d% and c%.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *
+ * Returns:
+ *  - 0 on success.
+ *  - -1 if there is no match.
+ */
+static int
+delmatch(Eek *e)
+{
+	long ty, tx;
+
+	if (matchtarget(e, &ty, &tx) < 0) {
+		macroabort(e);
+		return -1;
+	}
+	if (poslt(ty, tx, e->cy, e->cx))
+		return delrange(e, ty, tx, e->cy, nextutf8(e, e->cy, e->cx), 1);
+	return delrange(e, e->cy, e->cx, ty, nextutf8(e, ty, tx), 1);
+}
+
 /*
  * countval converts a parsed numeric prefix to a repeat count.
  *
@@ -1857,7 +2380,7 @@ repeat(Eek *e, void (*fn)(Eek *), long n)
 static void
 yclear(Eek *e)
 {
-	free(e->ybuf);
+	memfree(Memreg, e->ybuf, (size_t)e->ylen);
 	e->ybuf = nil;
 	e->ylen = 0;
 	e->yline = 0;
@@ -1885,12 +2408,12 @@ yset(Eek *e, const char *s, long n, int linewise)
 		n = 0;
 	p = nil;
 	if (n > 0) {
-		p = malloc((size_t)n);
+		p = memalloc(Memreg, (size_t)n);
 		if (p == nil)
 			return -1;
 		memcpy(p, s, (size_t)n);
 	}
-	free(e->ybuf);
+	memfree(Memreg, e->ybuf, (size_t)e->ylen);
 	e->ybuf = p;
 	e->ylen = n;
 	e->yline = linewise;
@@ -1918,7 +2441,7 @@ yappend(Eek *e, const char *s, long n)
 		return 0;
 	if (e->ybuf == nil || e->ylen == 0)
 		return yset(e, s, n, e->yline);
-	p = realloc(e->ybuf, (size_t)(e->ylen + n));
+	p = memrealloc(Memreg, e->ybuf, (size_t)e->ylen, (size_t)(e->ylen + n));
 	if (p == nil)
 		return -1;
 	memcpy(p + e->ylen, s, (size_t)n);
@@ -1927,89 +2450,6 @@ yappend(Eek *e, const char *s, long n)
 	return 0;
 }
 
-static void
-blockclear(Eek *e)
-{
-	if (e == nil)
-		return;
-	free(e->blockbuf);
-	e->blockbuf = nil;
-	e->blockn = 0;
-	e->blockcap = 0;
-}
-
-static int
-blockappend(Eek *e, const char *s, long n)
-{
-	char *p;
-	long ncap;
-
-	if (e == nil)
-		return -1;
-	if (s == nil || n <= 0)
-		return 0;
-	if (e->blockn + n > e->blockcap) {
-		ncap = e->blockcap > 0 ? e->blockcap * 2 : 64;
-		for (; ncap < e->blockn + n; ncap *= 2)
-			;
-		p = realloc(e->blockbuf, (size_t)ncap);
-		if (p == nil)
-			return -1;
-		e->blockbuf = p;
-		e->blockcap = ncap;
-	}
-	memcpy(e->blockbuf + e->blockn, s, (size_t)n);
-	e->blockn += n;
-	return 0;
-}
-
-static void
-blockpop(Eek *e)
-{
-	long i;
-
-	if (e == nil)
-		return;
-	if (e->blockn <= 0)
-		return;
-	i = e->blockn - 1;
-	for (; i > 0 && ((unsigned char)e->blockbuf[i] & 0xc0) == 0x80; i--)
-		;
-	e->blockn = i;
-}
-
-static void
-blockapplyinsert(Eek *e)
-{
-	long y;
-	Line *l;
-	long cx;
-	long ln;
-
-	if (e == nil)
-		return;
-	if (!e->blockins)
-		return;
-	if (e->blockn <= 0)
-		return;
-	if (e->blocky1 <= e->blocky0)
-		return;
-
-	for (y = e->blocky0 + 1; y <= e->blocky1; y++) {
-		l = bufgetline(&e->b, y);
-		if (l == nil)
-			continue;
-		ln = lsz(l->n);
-		cx = cxfromrx(e, y, e->blockrx0);
-		if (cx < 0)
-			cx = 0;
-		if (cx > ln)
-			cx = ln;
-		(void)lineinsert(l, cx, e->blockbuf, e->blockn);
-	}
-	e->dirty = 1;
-}
-
 /*
  * yankrange yanks a range of text into the yank register.
  * The range is interpreted in byte coordinates; multi-line yanks include '\n'
@@ -2467,7 +2907,7 @@ tabfree(Tab *t)
 		return;
 	for (i = 0; i < t->nundo; i++)
 		buffree(&t->undo[i].b);
-	free(t->undo);
+	memfree(Memundo, t->undo, (size_t)t->capundo * sizeof t->undo[0]);
 	t->undo = nil;
 	t->nundo = 0;
 	t->capundo = 0;
@@ -2500,6 +2940,9 @@ tabtake(Eek *e)
 	if (e == nil)
 		return t;
 	/* Caller should have called winstore(e) already. */
+	loadwait(e);
+	savewait(e);
+	followstop();
 	t.b = e->b;
 	e->b = (Buf){0};
 	t.fname = e->fname;
@@ -2566,7 +3009,8 @@ tabsensure(Eek *e, long n)
 	cap = e->captab > 0 ? e->captab : 4;
 	for (; cap < n; cap *= 2)
 		;
-	p = realloc(e->tab, (size_t)cap * sizeof e->tab[0]);
+	p = memrealloc(Memother, e->tab, (size_t)e->captab * sizeof e->tab[0],
+		(size_t)cap * sizeof e->tab[0]);
 	if (p == nil)
 		return -1;
 	/* Zero new memory. */
@@ -3066,24 +3510,31 @@ static long
 rxfromcx(Eek *e, long y, long cx)
 {
 	Line *l;
-	long i, tx;
-	unsigned char c;
+	const char *ls;
+	long i, tx, k;
 	long ln;
 
 	l = bufgetline(&e->b, y);
 	if (l == nil)
 		return 0;
+	ls = linebytes(l);
 	ln = lsz(l->n);
+	if (cx < ln)
+		ln = cx;
 	tx = 0;
-	for (i = 0; i < cx && i < ln; ) {
-		c = (unsigned char)l->s[i];
-		if (c == '\t') {
+	for (i = 0; i < ln; ) {
+		k = asciirun(ls + i, ln - i);
+		i += k;
+		tx += k;
+		if (i >= ln)
+			break;
+		if (ls[i] == '\t') {
 			tx += TABSTOP - (tx % TABSTOP);
 			i++;
 			continue;
 		}
 		tx++;
-		i = nextutf8(e, y, i);
+		i = utf8next(ls, lsz(l->n), i);
 	}
 	return tx;
 }
@@ -3098,9 +3549,9 @@ long
 cxfromrx(Eek *e, long y, long rx)
 {
 	Line *l;
-	long i;
+	const char *ls;
+	long i, k;
 	long tx;
-	unsigned char c;
 	long w;
 	long ln;
 
@@ -3111,14 +3562,17 @@ cxfromrx(Eek *e, long y, long rx)
 		return 0;
 	if (rx <= 0)
 		return 0;
+	ls = linebytes(l);
 	ln = lsz(l->n);
 
 	tx = 0;
 	for (i = 0; i < ln; ) {
-		if (tx >= rx)
+		k = asciirun(ls + i, ln - i < rx - tx ? ln - i : rx - tx);
+		i += k;
+		tx += k;
+		if (i >= ln || tx >= rx)
 			return i;
-		c = (unsigned char)l->s[i];
-		if (c == '\t') {
+		if (ls[i] == '\t') {
 			w = TABSTOP - (tx % TABSTOP);
 			if (tx + w > rx)
 				return i;
@@ -3127,7 +3581,7 @@ cxfromrx(Eek *e, long y, long rx)
 			continue;
 		}
 		tx++;
-		i = nextutf8(e, y, i);
+		i = utf8next(ls, ln, i);
 	}
 	return ln;
 }
@@ -3224,7 +3678,7 @@ delblock(Eek *e, long y0, long y1, long rx0, long rx1, int yank)
 		(void)yankblock(e, y0, y1, rx0, rx1);
 
 	for (y = y0; y <= y1; y++) {
-		l = bufgetline(&e->b, y);
+		l = bufeditline(&e->b, y);
 		if (l == nil)
 			continue;
 		ln = lsz(l->n);
@@ -3495,6 +3949,8 @@ drawstatus(Eek *e)
 {
 	char buf[256];
 	char tbuf[64];
+	char sbuf[32];
+	char rbuf[16];
 	char pfx;
 	int n;
 	const char *m;
@@ -3508,19 +3964,26 @@ drawstatus(Eek *e)
 			snprintf(tbuf, sizeof tbuf, " tab %ld/%ld", e->curtab + 1, e->ntab);
 		else
 			tbuf[0] = 0;
+		if (!loadstatus(sbuf, sizeof sbuf) && !savestatus(sbuf, sizeof sbuf) &&
+		    !followstatus(sbuf, sizeof sbuf))
+			sbuf[0] = 0;
+		rbuf[0] = 0;
+		if (e->macroreg != 0)
+			snprintf(rbuf, sizeof rbuf, " recording @%c", e->macroreg);
 		if (e->msg[0] != 0)
-			n = snprintf(buf, sizeof buf, " %s  %s%s ", m, e->msg, tbuf);
+			n = snprintf(buf, sizeof buf, " %s%s  %s%s%s ", m, rbuf, e->msg, sbuf, tbuf);
 		else
-			n = snprintf(buf, sizeof buf, " %s  %s%s%s  %ld:%ld ", m,
-				e->fname ? e->fname : "[No Name]", e->dirty ? " [+]" : "", tbuf, e->cy + 1, e->cx + 1);
+			n = snprintf(buf, sizeof buf, " %s%s  %s%s%s%s  %ld:%ld ", m, rbuf,
+				e->fname ? e->fname : "[No Name]", e->dirty ? " [+]" : "", sbuf, tbuf, e->cy + 1, e->cx + 1);
 	}
 	if (n < 0)
 		n = 0;
-	termwrite(&e->t, "\x1b[7m", 4);
+	if (n > e->t.col)
+		n = e->t.col;
+	drawattrs(e, 1);
 	termwrite(&e->t, buf, n);
-	for (; n < e->t.col; n++)
-		termwrite(&e->t, " ", 1);
-	termwrite(&e->t, "\x1b[m", 3);
+	termrepeat(&e->t, ' ', e->t.col - n);
+	drawattrs(e, 0);
 }
 
 /*
@@ -3545,7 +4008,8 @@ setmsg(Eek *e, const char *fmt, ...)
 }
 
 /*
- * drawattrs writes terminal attributes for a cell: reset + optional inverse.
+ * drawattrs selects the attributes for the following cells: plain or
+ * inverse video. Nothing is written if they are already in effect.
  *
  * Parameters:
  *  - e: editor state (uses output fd).
@@ -3557,9 +4021,7 @@ setmsg(Eek *e, const char *fmt, ...)
 static void
 drawattrs(Eek *e, int inv)
 {
-	termwrite(&e->t, "\x1b[m", 3);
-	if (inv)
-		termwrite(&e->t, "\x1b[7m", 4);
+	termattr(&e->t, inv ? Attrinverse : 0, -1, -1);
 }
 
 /*
@@ -3778,6 +4240,7 @@ searchexec(Eek *e)
 		}
 		if (searchforward(e, e->lastsearch) < 0) {
 			setmsg(e, "Pattern not found: %s", e->lastsearch);
+			macroabort(e);
 			return -1;
 		}
 		return 0;
@@ -3791,6 +4254,7 @@ searchexec(Eek *e)
 	}
 	if (searchforward(e, pat) < 0) {
 		setmsg(e, "Pattern not found: %s", pat);
+		macroabort(e);
 		return -1;
 	}
 	return 0;
@@ -3910,7 +4374,7 @@ runinsert(Eek *e, const char *cmd)
 		;
 
 	/* Save and remove the tail to the right of the cursor. */
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil) {
 		goto out;
 	}
@@ -3947,7 +4411,7 @@ runinsert(Eek *e, const char *cmd)
 		if (insertnl(e) < 0) {
 			goto out;
 		}
-		l = bufgetline(&e->b, e->cy);
+		l = bufeditline(&e->b, e->cy);
 		if (l == nil) {
 			goto out;
 		}
@@ -3966,7 +4430,7 @@ runinsert(Eek *e, const char *cmd)
 
 	/* Re-attach original tail to the end of the last inserted line. */
 	if (tailn > 0 && tail != nil) {
-		l = bufgetline(&e->b, e->cy);
+		l = bufeditline(&e->b, e->cy);
 		if (l == nil) {
 			goto out;
 		}
@@ -4027,6 +4491,233 @@ setopt(Eek *e, const char *opt)
 	return -1;
 }
 
+/*
+ * tabmem adds up the memory held by one tab: its text buffer, and its undo
+ * stack including the snapshots.
+ *
+ * Parameters:
+ *  - b: tab text buffer.
+ *  - u: undo stack.
+ *  - nundo: snapshots in u.
+ *  - capundo: capacity of u in entries.
+ *  - text: set to the text buffer bytes.
+ *  - undo: set to the undo stack bytes.
+ */
+static void
+tabmem(Buf *b, Undo *u, long nundo, long capundo, long long *text, long long *undo)
+{
+	long i;
+
+	*text = (long long)bufmem(b);
+	*undo = (long long)((size_t)capundo * sizeof u[0]);
+	for (i = 0; i < nundo; i++)
+		*undo += (long long)bufmem(&u[i].b);
+}
+
+/*
+ * memexec runs :mem.
+ *
+ *	:mem               live/peak bytes per subsystem
+ *	:mem tabs          text/undo bytes per tab
+ *	:mem log FILE [s]  append live bytes to FILE every s seconds (default 10)
+ *	:mem log off       stop logging
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - arg: command arguments (modified in place).
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure.
+ */
+static int
+memexec(Eek *e, char *arg)
+{
+	char out[256];
+	char a[16], b[16];
+	const char *name;
+	long long text, undo;
+	char *file, *end;
+	long i, secs;
+	size_t n;
+	int w;
+
+	if (arg == nil || *arg == 0) {
+		memsummary(out, sizeof out);
+		setmsg(e, "%s", out);
+		return 0;
+	}
+	if (strcmp(arg, "tabs") == 0) {
+		n = (size_t)snprintf(out, sizeof out, "mem text/undo:");
+		for (i = 0; i < e->ntab && n < sizeof out; i++) {
+			if (i == e->curtab) {
+				name = e->fname;
+				tabmem(&e->b, e->undo, e->nundo, e->capundo, &text, &undo);
+			} else {
+				name = e->tab[i].fname;
+				tabmem(&e->tab[i].b, e->tab[i].undo, e->tab[i].nundo,
+					e->tab[i].capundo, &text, &undo);
+			}
+			memfmt(a, sizeof a, text);
+			memfmt(b, sizeof b, undo);
+			w = snprintf(out + n, sizeof out - n, " %c%ld:%s %s/%s",
+				i == e->curtab ? '*' : ' ', i + 1,
+				(name && name[0]) ? name : "[No Name]", a, b);
+			if (w < 0)
+				break;
+			n += (size_t)w;
+		}
+		setmsg(e, "%s", out);
+		return 0;
+	}
+	if (strncmp(arg, "log", 3) == 0 && (arg[3] == ' ' || arg[3] == '\t')) {
+		for (file = arg + 3; *file == ' ' || *file == '\t'; file++)
+			;
+		if (*file == 0) {
+			setmsg(e, "mem: missing file");
+			return -1;
+		}
+		if (strcmp(file, "off") == 0) {
+			memlog(nil, 0);
+			setmsg(e, "mem: logging off");
+			return 0;
+		}
+		for (end = file; *end && *end != ' ' && *end != '\t'; end++)
+			;
+		secs = 10;
+		if (*end) {
+			*end++ = 0;
+			secs = strtol(end, &end, 10);
+			if (*end != 0 || secs <= 0) {
+				setmsg(e, "mem: bad interval");
+				return -1;
+			}
+		}
+		if (memlog(file, secs) < 0) {
+			setmsg(e, "mem: %s: %s", file, strerror(errno));
+			return -1;
+		}
+		setmsg(e, "mem: logging to %s every %lds", file, secs);
+		return 0;
+	}
+	setmsg(e, "mem: unknown argument: %s", arg);
+	return -1;
+}
+
+/*
+ * cursorsexec runs :cursors [pattern]: it puts a cursor at every match of
+ * pattern (default: the last search) in the buffer, or in the VISUAL
+ * lines when the command line came from VISUAL, and starts INSERT at all
+ * of them.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - arg: pattern, or empty.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure.
+ */
+static int
+cursorsexec(Eek *e, const char *arg)
+{
+	const char *pat;
+	const char *ls;
+	Line *l;
+	long patn;
+	long y, y0, y1;
+	long x, at;
+	long ln;
+
+	pat = arg != nil && *arg != 0 ? arg : e->lastsearch;
+	if (pat == nil || *pat == 0) {
+		setmsg(e, "No previous search");
+		return -1;
+	}
+	patn = (long)strlen(pat);
+	y0 = 0;
+	y1 = lsz(e->b.nline) - 1;
+	if (e->cmdrange) {
+		y0 = clamp(e->cmdy0, 0, y1);
+		y1 = clamp(e->cmdy1, y0, y1);
+	}
+
+	cursorend(e);
+	for (y = y0; y <= y1; y++) {
+		l = bufgetline(&e->b, y);
+		if (l == nil)
+			continue;
+		ls = linebytes(l);
+		ln = lsz(l->n);
+		for (x = 0; (at = bytesfind(ls + x, ln - x, pat, patn)) >= 0; x += at + patn) {
+			if (cursoradd(e, y, x + at) < 0) {
+				cursorend(e);
+				setmsg(e, "Out of memory");
+				return -1;
+			}
+		}
+	}
+	if (e->nmc == 0) {
+		setmsg(e, "Pattern not found: %s", pat);
+		return -1;
+	}
+	if (cursorbegin(e) < 0) {
+		setmsg(e, "Out of memory");
+		return -1;
+	}
+	setmode(e, Modeinsert);
+	setmsg(e, "%ld cursors", e->nmc);
+	return 0;
+}
+
+/*
+ * bufreplaced resets undo, pending commands and every window's view after
+ * e->b got new contents (:e, a followed file that was replaced).
+ *
+ * Parameters:
+ *  e: editor state.
+ */
+void
+bufreplaced(Eek *e)
+{
+	Win **arr;
+	long n;
+	long i;
+
+	undofree(e);
+	cursorend(e);
+	e->cx = 0;
+	e->cy = 0;
+	e->rowoff = 0;
+	e->vax = 0;
+	e->vay = 0;
+	e->vtipending = 0;
+	pendclear(e);
+	e->count = 0;
+	e->opcount = 0;
+	e->seqcount = 0;
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	free(e->lastsearch);
+	e->lastsearch = nil;
+
+	n = nwins(e->layout);
+	arr = n > 0 ? malloc((size_t)n * sizeof arr[0]) : nil;
+	if (arr != nil) {
+		i = 0;
+		collectwins(e->layout, arr, &i);
+		while (i-- > 0) {
+			arr[i]->cx = 0;
+			arr[i]->cy = 0;
+			arr[i]->rowoff = 0;
+			arr[i]->vax = 0;
+			arr[i]->vay = 0;
+			arr[i]->vtipending = 0;
+		}
+		free(arr);
+	}
+	winload(e, e->curwin);
+	normalfixcursor(e);
+}
+
 /*
  * cmdexec executes the current ":" command line in e->cmd.
  *
@@ -4050,12 +4741,11 @@ cmdexec(Eek *e)
 	char *tok;
 	char *lhs;
 	char *rhs;
-	Win **arr;
+	long lhsv[Maplhsmax];
+	int nlhs;
 	const char *name;
 	char mark;
 	char out[256];
-	long adv;
-	long r;
 	long n;
 	long idx;
 	long to;
@@ -4145,13 +4835,12 @@ cmdexec(Eek *e)
 			setmsg(e, "Usage: map <lhs> <rhs>");
 			return -1;
 		}
-		n = (long)strlen(lhs);
-		r = utf8dec1(lhs, n, &adv);
-		if (adv <= 0 || adv != n) {
-			setmsg(e, "map lhs must be a single character");
+		nlhs = maplhs(lhs, lhsv);
+		if (nlhs < 0) {
+			setmsg(e, "map lhs is longer than %d keys", Maplhsmax);
 			return -1;
 		}
-		if (mapset(e, mapmodes, r, rhs) < 0) {
+		if (mapset(e, mapmodes, lhsv, nlhs, rhs) < 0) {
 			setmsg(e, "Cannot set map");
 			return -1;
 		}
@@ -4175,13 +4864,8 @@ cmdexec(Eek *e)
 			setmsg(e, "Usage: unmap <lhs>");
 			return -1;
 		}
-		n = (long)strlen(lhs);
-		r = utf8dec1(lhs, n, &adv);
-		if (adv <= 0 || adv != n) {
-			setmsg(e, "unmap lhs must be a single character");
-			return -1;
-		}
-		if (mapdel(e, mapmodes, r) < 0) {
+		nlhs = maplhs(lhs, lhsv);
+		if (nlhs < 0 || mapdel(e, mapmodes, lhsv, nlhs) < 0) {
 			setmsg(e, "not mapped");
 			return -1;
 		}
@@ -4190,6 +4874,7 @@ cmdexec(Eek *e)
 	}
 
 	if (strcmp(p, "q") == 0) {
+		savewait(e);
 		if (e->dirty && !force) {
 			setmsg(e, "No write since last change (add !)");
 			return -1;
@@ -4225,8 +4910,17 @@ cmdexec(Eek *e)
 			setmsg(e, "No file name");
 			return -1;
 		}
-		if (bufsave(&e->b, e->fname) < 0) {
-			setmsg(e, "Write failed");
+		if (!force && savetail(e, e->fname) == 0) {
+			e->dirty = 0;
+			setmsg(e, "Written %s", e->fname);
+			return 0;
+		}
+		if (savebg(e, e->fname) == 0) {
+			setmsg(e, "Writing %s", e->fname);
+			return 0;
+		}
+		if (savesync(e, e->fname) < 0) {
+			setmsg(e, "Write failed: %s", strerror(errno));
 			return -1;
 		}
 		e->dirty = 0;
@@ -4238,8 +4932,8 @@ cmdexec(Eek *e)
 			setmsg(e, "No file name");
 			return -1;
 		}
-		if (bufsave(&e->b, e->fname) < 0) {
-			setmsg(e, "Write failed");
+		if ((force || savetail(e, e->fname) < 0) && savesync(e, e->fname) < 0) {
+			setmsg(e, "Write failed: %s", strerror(errno));
 			return -1;
 		}
 		e->dirty = 0;
@@ -4418,10 +5112,12 @@ cmdexec(Eek *e)
 			setmsg(e, "No file name");
 			return -1;
 		}
+		savewait(e);
 		if (e->dirty && !force) {
 			setmsg(e, "No write since last change (add !)");
 			return -1;
 		}
+		followstop();
 
 		/* Replace buffer contents; if missing, start a new empty buffer. */
 		exists = access(arg, F_OK) == 0;
@@ -4445,46 +5141,7 @@ cmdexec(Eek *e)
 		}
 		e->ownfname = 1;
 		e->dirty = 0;
-		undofree(e);
-
-		/* Reset all window/view state for the new buffer. */
-		e->cx = 0;
-		e->cy = 0;
-		e->rowoff = 0;
-		e->vax = 0;
-		e->vay = 0;
-		e->vtipending = 0;
-		e->tipending = 0;
-		e->dpending = 0;
-		e->cpending = 0;
-		e->ypending = 0;
-		e->fpending = 0;
-		e->fcount = 0;
-		e->count = 0;
-		e->opcount = 0;
-		e->seqcount = 0;
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		free(e->lastsearch);
-		e->lastsearch = nil;
-
-		n = nwins(e->layout);
-		arr = n > 0 ? malloc((size_t)n * sizeof arr[0]) : nil;
-		if (arr != nil) {
-			i = 0;
-			collectwins(e->layout, arr, &i);
-			while (i-- > 0) {
-				arr[i]->cx = 0;
-				arr[i]->cy = 0;
-				arr[i]->rowoff = 0;
-				arr[i]->vax = 0;
-				arr[i]->vay = 0;
-				arr[i]->vtipending = 0;
-			}
-			free(arr);
-		}
-		winload(e, e->curwin);
-		normalfixcursor(e);
+		bufreplaced(e);
 		return 0;
 	}
 	if (strcmp(p, "tabnew") == 0) {
@@ -4580,7 +5237,7 @@ cmdexec(Eek *e)
 				continue;
 			tabfree(&e->tab[i]);
 		}
-		free(e->tab);
+		memfree(Memother, e->tab, (size_t)e->captab * sizeof e->tab[0]);
 		e->tab = nil;
 		e->ntab = 0;
 		e->captab = 0;
@@ -4605,9 +5262,61 @@ cmdexec(Eek *e)
 			setmsg(e, "Read failed");
 			return -1;
 		}
-		e->dirty = 1;
-		setmsg(e, "%ld lines read", nins);
-		return 0;
+		e->dirty = 1;
+		setmsg(e, "%ld lines read", nins);
+		return 0;
+	}
+
+	if (strcmp(p, "mem") == 0)
+		return memexec(e, arg);
+
+	if (strcmp(p, "cursors") == 0)
+		return cursorsexec(e, arg);
+
+	if (strcmp(p, "follow") == 0) {
+		if (arg != nil && strcmp(arg, "off") == 0) {
+			followstop();
+			setmsg(e, "Not following");
+			return 0;
+		}
+		if (arg != nil && *arg != 0) {
+			setmsg(e, "Usage: follow [off]");
+			return -1;
+		}
+		if (e->fname == nil) {
+			setmsg(e, "No file name");
+			return -1;
+		}
+		return followstart(e, e->fname);
+	}
+
+	if (strcmp(p, "perf") == 0) {
+		if (arg == nil || *arg == 0) {
+			perfsummary(out, sizeof out);
+			setmsg(e, "%s", out);
+			return 0;
+		}
+		if (strcmp(arg, "reset") == 0) {
+			perfreset();
+			setmsg(e, "perf: reset");
+			return 0;
+		}
+		if (strncmp(arg, "dump", 4) == 0 && (arg[4] == ' ' || arg[4] == '\t')) {
+			for (s = arg + 4; *s == ' ' || *s == '\t'; s++)
+				;
+			if (*s == 0) {
+				setmsg(e, "perf: missing file");
+				return -1;
+			}
+			if (perfdump(s) < 0) {
+				setmsg(e, "perf: %s: %s", s, strerror(errno));
+				return -1;
+			}
+			setmsg(e, "perf: wrote %s", s);
+			return 0;
+		}
+		setmsg(e, "perf: unknown argument: %s", arg);
+		return -1;
 	}
 
 	if (strcmp(p, "run") == 0) {
@@ -4675,8 +5384,12 @@ draw(Eek *e)
 	long gnum;
 	int wantinv;
 	long nsp;
-	int winv;
 	long txcur;
+	Sel sel;
+	long slo, shi;
+	long mi;
+	long fa, fb;
+	long p;
 	int yy;
 	int xx;
 	long cyrel;
@@ -4686,6 +5399,7 @@ draw(Eek *e)
 
 	if (e == nil)
 		return;
+	perfbegin(Perfdraw);
 
 	/* Keep the line-gap near the cursor for fast local line edits. */
 	buftrackgap(&e->b, e->cy);
@@ -4712,6 +5426,7 @@ draw(Eek *e)
 			if (nd->split == 0) {
 				winclamp(e, nd->w);
 				winload(e, nd->w);
+				selinit(e, &sel);
 				gutter = gutterwidth(e, rr.w);
 				numw = gutter ? gutter - 1 : 0;
 				for (y = 0; y < rr.h; y++) {
@@ -4720,15 +5435,16 @@ draw(Eek *e)
 					collim = rr.w;
 					rx = 0;
 					if (filerow >= lsz(e->b.nline)) {
+						drawattrs(e, 0);
 						if (collim > 0) {
 							termwrite(&e->t, "~", 1);
 							rx = 1;
 						}
-						for (; rx < collim; rx++)
-							termwrite(&e->t, " ", 1);
+						termrepeat(&e->t, ' ', collim - (int)rx);
 						continue;
 					}
 					if (gutter && collim > 0) {
+						drawattrs(e, 0);
 						gnum = 0;
 						if (e->relativenumbers) {
 							if (filerow == e->cy)
@@ -4746,17 +5462,23 @@ draw(Eek *e)
 							rx += nn;
 						}
 					}
+					mi = e->nmc > 0 ? cursorline(e, filerow) : 0;
 					l = bufgetline(&e->b, filerow);
 					if (l == nil || l->n == 0) {
-						for (; rx < collim; rx++)
-							termwrite(&e->t, " ", 1);
+						if (e->coloff == 0 && rx < collim && mcat(e, &mi, filerow, 0)) {
+							drawattrs(e, 1);
+							termputc(&e->t, ' ');
+							rx++;
+						}
+						drawattrs(e, 0);
+						termrepeat(&e->t, ' ', collim - (int)rx);
 						continue;
 					}
 					ln = lsz(l->n);
 					ls = linebytes(l);
 
-					curinv = 0;
-					drawattrs(e, 0);
+					curinv = -1;
+					selrow(&sel, filerow, &slo, &shi);
 
 					coloff = e->coloff;
 					if (coloff < 0)
@@ -4764,66 +5486,74 @@ draw(Eek *e)
 					rx = gutter;
 					tx = 0;
 					for (i = 0; i < ln && rx < collim; ) {
-						wantinv = 0;
-						if (e->vmode == Visualblock)
-							wantinv = invselblock(e, filerow, tx);
-						else
-							wantinv = invsel(e, filerow, i);
-						if (wantinv != curinv) {
-							drawattrs(e, wantinv);
-							curinv = wantinv;
+						/* Columns scrolled off to the left: skip plain ASCII in one step. */
+						if (tx < coloff) {
+							n = asciirun(ls + i, ln - i < coloff - tx ? ln - i : coloff - tx);
+							i += n;
+							tx += n;
+							if (i >= ln)
+								break;
 						}
-
 						if (ls[i] == '\t') {
 							nsp = TABSTOP - (tx % TABSTOP);
-							for (; nsp > 0 && rx < collim; nsp--) {
-								if (tx >= coloff && rx < collim) {
-									if (e->vmode == Visualblock) {
-										winv = invselblock(e, filerow, tx);
-										if (winv != curinv) {
-											drawattrs(e, winv);
-											curinv = winv;
-										}
-									}
-									termwrite(&e->t, " ", 1);
-									rx++;
+							for (; nsp > 0 && rx < collim; nsp--, tx++) {
+								if (tx < coloff)
+									continue;
+								p = sel.block ? tx : i;
+								wantinv = (p >= slo && p < shi) || mcat(e, &mi, filerow, i);
+								if (wantinv != curinv) {
+									drawattrs(e, wantinv);
+									curinv = wantinv;
 								}
-								tx++;
+								termputc(&e->t, ' ');
+								rx++;
 							}
 							i++;
 							continue;
 						}
-						ni = nextutf8(e, filerow, i);
+						ni = utf8next(ls, ln, i);
 						n = ni - i;
 						if (n <= 0)
 							n = 1;
 						if (i + n > ln)
 							n = ln - i;
-						if (tx >= coloff && rx < collim) {
+						if (tx >= coloff) {
+							p = sel.block ? tx : i;
+							wantinv = (p >= slo && p < shi) || mcat(e, &mi, filerow, i);
+							if (wantinv != curinv) {
+								drawattrs(e, wantinv);
+								curinv = wantinv;
+							}
 							termwrite(&e->t, &ls[i], n);
 							rx++;
 						}
 						tx++;
 						i += n;
 					}
-					if (e->vmode == Visualblock) {
-						/* Trailing fill: spaces are real columns in block selection. */
-						for (; rx < collim; rx++) {
-							txcur = coloff + (rx - gutter);
-							winv = invselblock(e, filerow, txcur);
-							if (winv != curinv) {
-								drawattrs(e, winv);
-								curinv = winv;
-							}
-							termwrite(&e->t, " ", 1);
-						}
-						if (curinv)
-							termwrite(&e->t, "\x1b[m", 3);
-					} else {
-						if (curinv)
-							termwrite(&e->t, "\x1b[m", 3);
-						for (; rx < collim; rx++)
-							termwrite(&e->t, " ", 1);
+
+					/* A cursor past the last character. */
+					if (i == ln && rx < collim && tx >= coloff && mcat(e, &mi, filerow, ln)) {
+						drawattrs(e, 1);
+						termputc(&e->t, ' ');
+						rx++;
+					}
+
+					/* Trailing fill: in a block selection the spaces are real columns. */
+					nsp = collim - rx;
+					txcur = coloff + (rx - gutter);
+					fa = sel.block ? clamp(slo - txcur, 0, nsp) : nsp;
+					fb = sel.block ? clamp(shi - txcur, fa, nsp) : nsp;
+					if (fa > 0) {
+						drawattrs(e, 0);
+						termrepeat(&e->t, ' ', (int)fa);
+					}
+					if (fb > fa) {
+						drawattrs(e, 1);
+						termrepeat(&e->t, ' ', (int)(fb - fa));
+					}
+					if (nsp > fb) {
+						drawattrs(e, 0);
+						termrepeat(&e->t, ' ', (int)(nsp - fb));
 					}
 				}
 				continue;
@@ -4843,6 +5573,7 @@ draw(Eek *e)
 				ra = (Rect){ rr.x, rr.y, aW, rr.h };
 				rb = (Rect){ rr.x + aW + sep, rr.y, bW, rr.h };
 				if (sep) {
+					drawattrs(e, 0);
 					for (yy = 0; yy < rr.h; yy++) {
 						termmoveto(&e->t, rr.y + yy, rr.x + aW);
 						termwrite(&e->t, "|", 1);
@@ -4856,6 +5587,7 @@ draw(Eek *e)
 				ra = (Rect){ rr.x, rr.y, rr.w, aH };
 				rb = (Rect){ rr.x, rr.y + aH + sep, rr.w, bH };
 				if (sep) {
+					drawattrs(e, 0);
 					termmoveto(&e->t, rr.y + aH, rr.x);
 					for (xx = 0; xx < rr.w; xx++)
 						termwrite(&e->t, "-", 1);
@@ -4878,6 +5610,7 @@ draw(Eek *e)
 
 	/* Restore active view state for status line and cursor placement. */
 	winload(e, e->curwin);
+	drawattrs(e, 0);
 	termmoveto(&e->t, (int)textrows, 0);
 	termwrite(&e->t, "\x1b[K", 3);
 	drawstatus(e);
@@ -4901,6 +5634,7 @@ draw(Eek *e)
 	}
 	termwrite(&e->t, "\x1b[?25h", 6);
 	termflush(&e->t);
+	perfend(Perfdraw);
 }
 
 /*
@@ -4924,7 +5658,7 @@ insertbytes(Eek *e, const char *s, long n)
 	if (undopush(e) < 0)
 		return -1;
 
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil)
 		return -1;
 	if (lineinsert(l, e->cx, s, n) < 0)
@@ -4967,7 +5701,7 @@ insertnl(Eek *e)
 	if (bufinsertline(&e->b, e->cy + 1, ls + e->cx, (size_t)tailn) < 0)
 		return -1;
 	/* bufinsertline may move b->line, so refresh l before mutating it. */
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil)
 		return -1;
 	if (tailn > 0 && linedelrange(l, e->cx, (size_t)tailn) < 0)
@@ -4978,43 +5712,6 @@ insertnl(Eek *e)
 	return 0;
 }
 
-/*
- * delat deletes the UTF-8 codepoint starting at the cursor.
- *
- * Parameters:
- *  e: editor state.
- *
- * Returns:
- *  0 on success, -1 on failure.
- */
-static int
-delat(Eek *e)
-{
-	Line *l;
-	long nx;
-	long n;
-	long ln;
-
-	if (undopush(e) < 0)
-		return -1;
-
-	l = bufgetline(&e->b, e->cy);
-	if (l == nil)
-		return -1;
-	ln = lsz(l->n);
-	if (e->cx >= ln)
-		return 0;
-
-	nx = nextutf8(e, e->cy, e->cx);
-	n = nx - e->cx;
-	if (n <= 0)
-		return 0;
-	if (linedelrange(l, e->cx, n) < 0)
-		return -1;
-	e->dirty = 1;
-	return 0;
-}
-
 /*
  * delat_yank deletes n codepoints starting at the cursor and yanks them.
  *
@@ -5030,9 +5727,7 @@ delat_yank(Eek *e, long n)
 {
 	Line *l;
 	long i;
-	long nx;
-	long nb;
-	char *tmp;
+	long x1;
 	long ln;
 
 	if (n <= 0)
@@ -5044,24 +5739,20 @@ delat_yank(Eek *e, long n)
 	if (e->cx >= ln)
 		return 0;
 
+	/* Find the end of the n codepoints, then yank and delete them at once. */
+	x1 = e->cx;
+	for (i = 0; i < n && x1 < ln; i++)
+		x1 = nextutf8(e, e->cy, x1);
 	yclear(e);
 	e->yline = 0;
-	for (i = 0; i < n; i++) {
-		ln = lsz(l->n);
-		if (e->cx >= ln)
-			break;
-		nx = nextutf8(e, e->cy, e->cx);
-		nb = nx - e->cx;
-		if (nb <= 0)
-			break;
-		tmp = l->s + e->cx;
-		if (yappend(e, tmp, nb) < 0)
-			return -1;
-		(void)delat(e);
-		l = bufgetline(&e->b, e->cy);
-		if (l == nil)
-			break;
-	}
+	if (yappend(e, linebytes(l) + e->cx, x1 - e->cx) < 0)
+		return -1;
+	if (undopush(e) < 0)
+		return -1;
+	l = bufeditline(&e->b, e->cy);
+	if (l == nil || linedelrange(l, e->cx, (size_t)(x1 - e->cx)) < 0)
+		return -1;
+	e->dirty = 1;
 	return 0;
 }
 
@@ -5090,7 +5781,7 @@ delback(Eek *e)
 	if (e->cx == 0) {
 		if (e->cy == 0)
 			return 0;
-		pl = bufgetline(&e->b, e->cy - 1);
+		pl = bufeditline(&e->b, e->cy - 1);
 		l = bufgetline(&e->b, e->cy);
 		if (pl == nil || l == nil)
 			return -1;
@@ -5104,7 +5795,7 @@ delback(Eek *e)
 		return 0;
 	}
 
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil)
 		return -1;
 	px = prevutf8(e, e->cy, e->cx);
@@ -5119,55 +5810,42 @@ delback(Eek *e)
 }
 
 /*
- * delline deletes the current line.
+ * dellines deletes n lines starting at the current line.
  *
  * Parameters:
  *  e: editor state.
+ *  n: number of lines to delete.
  *
  * Returns:
  *  0 on success, -1 on failure.
  */
 static int
-delline(Eek *e)
+dellines(Eek *e, long n)
 {
+	long y, nline;
+
 	if (undopush(e) < 0)
 		return -1;
-	if (bufdelline(&e->b, e->cy) < 0)
+	/* Past the last line the count takes the lines above instead. */
+	nline = lsz(e->b.nline);
+	y = e->cy;
+	if (n > nline - y)
+		y = n < nline ? nline - n : 0;
+	if (bufdellines(&e->b, y, n) < 0)
 		return -1;
-	if (e->cy >= lsz(e->b.nline))
-		e->cy = lsz(e->b.nline) - 1;
+	e->cy = clamp(y, 0, lsz(e->b.nline) - 1);
 	e->cx = 0;
 	e->dirty = 1;
 	return 0;
 }
 
 /*
- * dellines deletes n lines starting at the current line.
- *
- * Parameters:
- *  e: editor state.
- *  n: number of lines to delete.
- *
- * Returns:
- *  0 on success, -1 on failure.
- */
-static int
-dellines(Eek *e, long n)
-{
-	long i;
-
-	for (i = 0; i < n; i++) {
-		if (delline(e) < 0)
-			return -1;
-	}
-	return 0;
-}
-
-/*
- * wordtarget computes the target position for a "w"-style motion.
+ * wordfrom computes where a "w"-style motion from (y, x) lands.
  *
  * Parameters:
  *  e: editor state.
+ *  y: start line.
+ *  x: start column.
  *  ty: output target line.
  *  tx: output target column.
  *
@@ -5175,16 +5853,14 @@ dellines(Eek *e, long n)
  *  None.
  */
 static void
-wordtarget(Eek *e, long *ty, long *tx)
+wordfrom(Eek *e, long y, long x, long *ty, long *tx)
 {
-	long y, x;
-	long c;
+	Line *l;
+	const char *s;
 	long len;
 	int cls;
 	long nline;
 
-	y = e->cy;
-	x = e->cx;
 	nline = lsz(e->b.nline);
 
 	len = linelen(e, y);
@@ -5199,54 +5875,13 @@ wordtarget(Eek *e, long *ty, long *tx)
 		return;
 	}
 
-	c = peekbyte(e, y, x);
-	cls = isword(c) ? 1 : (ispunctword(c) ? 2 : 0);
-	if (cls == 1) {
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !isword(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-		/* vi: after a word, only skip blanks (not punctuation) */
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !isws(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-	} else if (cls == 2) {
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !ispunctword(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !isws(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-	} else {
-		/* on blanks or unknown: skip blanks, then stop at next nonblank */
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !isws(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-	}
+	l = bufgetline(&e->b, y);
+	s = linebytes(l);
+	/* vi: after a word or punctuation, only skip blanks (not the other class) */
+	cls = wordcls(s, len, x);
+	if (cls != Clsblank)
+		x = wordrun(s, len, x, cls);
+	x = wordrun(s, len, x, Clsblank);
 	if (x >= len && y + 1 < nline) {
 		y++;
 		x = 0;
@@ -5256,6 +5891,23 @@ wordtarget(Eek *e, long *ty, long *tx)
 	*tx = x;
 }
 
+/*
+ * wordtarget computes the target position for a "w"-style motion.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  ty: output target line.
+ *  tx: output target column.
+ *
+ * Returns:
+ *  None.
+ */
+static void
+wordtarget(Eek *e, long *ty, long *tx)
+{
+	wordfrom(e, e->cy, e->cx, ty, tx);
+}
+
 /*
  * delword deletes from the cursor to the "w" motion target.
  *
@@ -5282,7 +5934,7 @@ delword(Eek *e)
 		return 0;
 
 	if (ty == e->cy) {
-		l = bufgetline(&e->b, e->cy);
+		l = bufeditline(&e->b, e->cy);
 		if (l == nil)
 			return -1;
 		n = tx - e->cx;
@@ -5295,7 +5947,7 @@ delword(Eek *e)
 	}
 
 	/* delete to end of line, then delete newline (join with next) */
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	nl = bufgetline(&e->b, e->cy + 1);
 	if (l == nil || nl == nil)
 		return -1;
@@ -5312,7 +5964,9 @@ delword(Eek *e)
 }
 
 /*
- * delwords repeats delword n times.
+ * delwords deletes n "w" motions from the cursor as one range. Deleting
+ * a word leaves the rest of the text where the next motion would have
+ * started, so the n-th target from the cursor is where n deletions end.
  *
  * Parameters:
  *  e: editor state.
@@ -5324,20 +5978,29 @@ delword(Eek *e)
 static int
 delwords(Eek *e, long n)
 {
-	long i;
+	long i, y, x, ty, tx;
 
+	if (n <= 1)
+		return delword(e);
+	y = e->cy;
+	x = e->cx;
 	for (i = 0; i < n; i++) {
-		if (delword(e) < 0)
-			return -1;
+		wordfrom(e, y, x, &ty, &tx);
+		if (ty == y && tx <= x)
+			break;
+		y = ty;
+		x = tx;
 	}
-	return 0;
+	return delrange(e, e->cy, e->cx, y, x, 0);
 }
 
 /*
- * endwordtarget computes the target position for an "e"-style motion.
+ * endwordfrom computes where an "e"-style motion from (y, x) lands.
  *
  * Parameters:
  *  e: editor state.
+ *  y: start line.
+ *  x: start column.
  *  ty: output target line.
  *  tx: output target column.
  *
@@ -5345,16 +6008,13 @@ delwords(Eek *e, long n)
  *  None.
  */
 static void
-endwordtarget(Eek *e, long *ty, long *tx)
+endwordfrom(Eek *e, long y, long x, long *ty, long *tx)
 {
-	long y, x;
-	long c;
+	Line *l;
+	const char *s;
 	long len;
 	int cls;
 
-	y = e->cy;
-	x = e->cx;
-
 	len = linelen(e, y);
 	if (x >= len) {
 		*ty = y;
@@ -5362,42 +6022,34 @@ endwordtarget(Eek *e, long *ty, long *tx)
 		return;
 	}
 
-	for (;;) {
-		c = peekbyte(e, y, x);
-		if (c < 0)
-			break;
-		if (!isws(c))
-			break;
-		x = nextutf8(e, y, x);
-		if (x >= len)
-			break;
-	}
-	c = peekbyte(e, y, x);
-	cls = isword(c) ? 1 : (ispunctword(c) ? 2 : 0);
-	if (cls == 1) {
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !isword(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-	} else if (cls == 2) {
-		for (;;) {
-			c = peekbyte(e, y, x);
-			if (c < 0 || !ispunctword(c))
-				break;
-			x = nextutf8(e, y, x);
-			if (x >= len)
-				break;
-		}
-	}
+	l = bufgetline(&e->b, y);
+	s = linebytes(l);
+	x = wordrun(s, len, x, Clsblank);
+	cls = wordcls(s, len, x);
+	if (cls != Clsblank)
+		x = wordrun(s, len, x, cls);
 
 	*ty = y;
 	*tx = x;
 }
 
+/*
+ * endwordtarget computes the target position for an "e"-style motion.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  ty: output target line.
+ *  tx: output target column.
+ *
+ * Returns:
+ *  None.
+ */
+static void
+endwordtarget(Eek *e, long *ty, long *tx)
+{
+	endwordfrom(e, e->cy, e->cx, ty, tx);
+}
+
 /*
  * delendword deletes from the cursor to the end of the current word.
  *
@@ -5423,7 +6075,7 @@ delendword(Eek *e)
 	if (tx <= e->cx)
 		return 0;
 
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l == nil)
 		return -1;
 	n = tx - e->cx;
@@ -5434,7 +6086,8 @@ delendword(Eek *e)
 }
 
 /*
- * delendwords repeats delendword n times.
+ * delendwords deletes n "e" motions from the cursor (within the line) as
+ * one range, the way delwords does for "w".
  *
  * Parameters:
  *  e: editor state.
@@ -5446,13 +6099,18 @@ delendword(Eek *e)
 static int
 delendwords(Eek *e, long n)
 {
-	long i;
+	long i, x, ty, tx;
 
+	if (n <= 1)
+		return delendword(e);
+	x = e->cx;
 	for (i = 0; i < n; i++) {
-		if (delendword(e) < 0)
-			return -1;
+		endwordfrom(e, e->cy, x, &ty, &tx);
+		if (ty != e->cy || tx <= x)
+			break;
+		x = tx;
 	}
-	return 0;
+	return delrange(e, e->cy, e->cx, e->cy, x, 0);
 }
 
 /*
@@ -5522,16 +6180,25 @@ cmdesc(Eek *e, Args *a)
 static int
 cmdenter(Eek *e, Args *a)
 {
+	int quit;
+
 	(void)a;
 	if (e == nil)
 		return 0;
+	/* Searches and commands may need the whole file; :q and :q! do not. */
+	quit = e->cmdprefix == ':' && ((e->cmdn == 1 && e->cmd[0] == 'q') ||
+		(e->cmdn == 2 && memcmp(e->cmd, "q!", 2) == 0));
+	if (!quit)
+		loadwait(e);
 	if (e->cmdprefix == '/')
 		(void)searchexec(e);
 	else
 		(void)cmdexec(e);
 	e->cmdrange = 0;
 	e->cmdkeepvisual = 0;
-	setmode(e, Modenormal);
+	/* :cursors goes on in INSERT mode. */
+	if (e->mode == Modecmd)
+		setmode(e, Modenormal);
 	cmdclear(e);
 	e->cmdprefix = ':';
 	return 0;
@@ -5582,7 +6249,7 @@ cmdkey(Eek *e, const Key *k)
 	argsinit(&a);
 	if (k->kind == Keyrune)
 		(void)argspush(&a, k->value);
-	(void)movedispatch(e, Modecmd, cmdkeys, (long)(sizeof cmdkeys / sizeof cmdkeys[0]), k, &a);
+	(void)movedispatch(e, &cmdmap, k, &a);
 	argsfree(&a);
 	return 1;
 }
@@ -5593,11 +6260,7 @@ insesc(Eek *e, Args *a)
 	(void)a;
 	if (e == nil)
 		return 0;
-	if (e->blockins) {
-		blockapplyinsert(e);
-		e->blockins = 0;
-		blockclear(e);
-	}
+	cursorend(e);
 	if (e->cx > 0)
 		e->cx = prevutf8(e, e->cy, e->cx);
 	setmode(e, Modenormal);
@@ -5607,13 +6270,8 @@ insesc(Eek *e, Args *a)
 	e->seqcount = 0;
 	e->count = 0;
 	e->opcount = 0;
-	e->dpending = 0;
-	e->cpending = 0;
-	e->ypending = 0;
+	pendclear(e);
 	e->cmdrange = 0;
-	e->fcount = 0;
-	e->fpending = 0;
-	e->tipending = 0;
 	e->vtipending = 0;
 	normalfixcursor(e);
 	return 0;
@@ -5623,7 +6281,10 @@ static int
 insleft(Eek *e, Args *a)
 {
 	(void)a;
-	movel(e);
+	if (e->nmc > 0)
+		cursormove(e, movel);
+	else
+		movel(e);
 	return 0;
 }
 
@@ -5631,7 +6292,10 @@ static int
 insright(Eek *e, Args *a)
 {
 	(void)a;
-	mover(e);
+	if (e->nmc > 0)
+		cursormove(e, mover);
+	else
+		mover(e);
 	return 0;
 }
 
@@ -5639,7 +6303,10 @@ static int
 insup(Eek *e, Args *a)
 {
 	(void)a;
-	moveu(e);
+	if (e->nmc > 0)
+		cursormove(e, moveu);
+	else
+		moveu(e);
 	return 0;
 }
 
@@ -5647,17 +6314,45 @@ static int
 insdown(Eek *e, Args *a)
 {
 	(void)a;
-	moved(e);
+	if (e->nmc > 0)
+		cursormove(e, moved);
+	else
+		moved(e);
 	return 0;
 }
 
+/*
+ * mcbytes, mcnl and mcbs are the INSERT edits in the form cursoreach
+ * runs at every cursor of a multi-cursor session.
+ */
+static int
+mcbytes(Eek *e, void *arg)
+{
+	return insertbytes(e, arg, (long)strlen(arg));
+}
+
+static int
+mcnl(Eek *e, void *arg)
+{
+	(void)arg;
+	return insertnl(e);
+}
+
+static int
+mcbs(Eek *e, void *arg)
+{
+	(void)arg;
+	return delback(e);
+}
+
 static int
 insbs(Eek *e, Args *a)
 {
 	(void)a;
-	if (e && e->blockins)
-		blockpop(e);
-	(void)delback(e);
+	if (e->nmc > 0)
+		(void)cursoreach(e, mcbs, nil);
+	else
+		(void)delback(e);
 	return 0;
 }
 
@@ -5665,11 +6360,10 @@ static int
 insenter(Eek *e, Args *a)
 {
 	(void)a;
-	if (e && e->blockins) {
-		setmsg(e, "Block insert: no newline");
-		return 0;
-	}
-	(void)insertnl(e);
+	if (e->nmc > 0)
+		(void)cursoreach(e, mcnl, nil);
+	else
+		(void)insertnl(e);
 	return 0;
 }
 
@@ -5683,27 +6377,16 @@ insrune(Eek *e, Args *a)
 	if (e == nil)
 		return 0;
 	r = argsat(a, 0, 0);
-	if (r == '\n') {
-		if (e && e->blockins) {
-			setmsg(e, "Block insert: no newline");
-			return 0;
-		}
-		(void)insertnl(e);
-		return 0;
-	}
-	if (r == '\t') {
-		s[0] = '\t';
-		(void)insertbytes(e, s, 1);
-		if (e->blockins)
-			(void)blockappend(e, s, 1);
-		return 0;
-	}
-	if (r < 0x20)
+	if (r == '\n')
+		return insenter(e, a);
+	if (r != '\t' && r < 0x20)
 		return 0;
 	n = utf8enc(r, s);
-	(void)insertbytes(e, s, n);
-	if (e->blockins)
-		(void)blockappend(e, s, n);
+	s[n] = 0;
+	if (e->nmc > 0)
+		(void)cursoreach(e, mcbytes, s);
+	else
+		(void)insertbytes(e, s, n);
 	return 0;
 }
 
@@ -5728,17 +6411,46 @@ inskey(Eek *e, const Key *k)
 	argsinit(&a);
 	if (k->kind == Keyrune)
 		(void)argspush(&a, k->value);
-	(void)movedispatch(e, Modeinsert, inskeys, (long)(sizeof inskeys / sizeof inskeys[0]), k, &a);
+	(void)movedispatch(e, &insmap, k, &a);
 	argsfree(&a);
 	return 1;
 }
 
 /* NORMAL/VISUAL move implementations (table-driven). */
+
+/*
+ * macroq is q: it stops a running recording, or waits for the register
+ * to record into.
+ */
+static int
+macroq(Eek *e, Args *a)
+{
+	(void)a;
+	if (e->macroreg != 0)
+		macrostop(e);
+	else
+		pendset(e, Pendmacro, 0, 0, 0);
+	e->count = 0;
+	e->opcount = 0;
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
+	return 0;
+}
+
+/*
+ * macroat is {n}@: it waits for the register to replay.
+ */
 static int
-quit(Eek *e, Args *a)
+macroat(Eek *e, Args *a)
 {
 	(void)a;
-	e->quit = 1;
+	pendset(e, Pendplay, 0, 0, countval(e->count));
+	e->count = 0;
+	e->opcount = 0;
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
 	return 0;
 }
 
@@ -5763,8 +6475,10 @@ searchnext(Eek *e, Args *a)
 		setmsg(e, "No previous search");
 		return 0;
 	}
-	if (searchforward(e, e->lastsearch) < 0)
+	if (searchforward(e, e->lastsearch) < 0) {
 		setmsg(e, "Pattern not found: %s", e->lastsearch);
+		macroabort(e);
+	}
 	e->count = 0;
 	e->opcount = 0;
 	e->lastnormalrune = 0;
@@ -5781,8 +6495,10 @@ searchprev(Eek *e, Args *a)
 		setmsg(e, "No previous search");
 		return 0;
 	}
-	if (searchbackward(e, e->lastsearch) < 0)
+	if (searchbackward(e, e->lastsearch) < 0) {
 		setmsg(e, "Pattern not found: %s", e->lastsearch);
+		macroabort(e);
+	}
 	e->count = 0;
 	e->opcount = 0;
 	e->lastnormalrune = 0;
@@ -5795,20 +6511,15 @@ static int
 searchword(Eek *e, Args *a)
 {
 	Line *l;
+	const char *ls;
 	long pos;
 	long x0, x1;
-	long adv;
-	long r;
 	int cls;
 	char *pat;
 	long patn;
 	long n;
 	long i;
 	long ln;
-	long px;
-	long pr;
-	long nr;
-	long nx;
 
 	(void)a;
 	if (e == nil)
@@ -5818,56 +6529,24 @@ searchword(Eek *e, Args *a)
 		setmsg(e, "No word under cursor");
 		goto out;
 	}
+	ls = linebytes(l);
 	ln = lsz(l->n);
 
 	pos = e->cx;
 	if (pos >= ln)
-		pos = prevutf8(e, e->cy, ln);
+		pos = utf8prev(ls, ln);
 	if (pos < 0 || pos >= ln) {
 		setmsg(e, "No word under cursor");
 		goto out;
 	}
 
-	r = utf8dec1(l->s + pos, (size_t)(ln - pos), &adv);
-	cls = isword(r) ? 1 : (ispunctword(r) ? 2 : 0);
-	if (cls == 0) {
+	cls = wordcls(ls, ln, pos);
+	if (cls == Clsblank) {
 		setmsg(e, "No word under cursor");
 		goto out;
 	}
-
-	x0 = pos;
-	for (;;) {
-		px = prevutf8(e, e->cy, x0);
-		if (px >= x0)
-			break;
-		pr = utf8dec1(l->s + px, (size_t)(ln - px), &adv);
-		if (cls == 1) {
-			if (!isword(pr))
-				break;
-		} else {
-			if (!ispunctword(pr))
-				break;
-		}
-		x0 = px;
-	}
-
-	x1 = nextutf8(e, e->cy, pos);
-	for (;;) {
-		if (x1 >= ln)
-			break;
-		nr = utf8dec1(l->s + x1, (size_t)(ln - x1), &adv);
-		if (cls == 1) {
-			if (!isword(nr))
-				break;
-		} else {
-			if (!ispunctword(nr))
-				break;
-		}
-		nx = nextutf8(e, e->cy, x1);
-		if (nx <= x1)
-			break;
-		x1 = nx;
-	}
+	x0 = wordrunback(ls, ln, pos, cls);
+	x1 = wordrun(ls, ln, pos, cls);
 
 	patn = x1 - x0;
 	if (patn <= 0) {
@@ -5879,7 +6558,7 @@ searchword(Eek *e, Args *a)
 		setmsg(e, "Out of memory");
 		goto out;
 	}
-	memcpy(pat, l->s + x0, (size_t)patn);
+	memcpy(pat, ls + x0, (size_t)patn);
 	pat[patn] = 0;
 
 	free(e->lastsearch);
@@ -5889,6 +6568,7 @@ searchword(Eek *e, Args *a)
 	for (i = 0; i < n; i++) {
 		if (searchforward(e, e->lastsearch) < 0) {
 			setmsg(e, "Pattern not found: %s", e->lastsearch);
+			macroabort(e);
 			break;
 		}
 	}
@@ -5907,21 +6587,11 @@ vistoggle(Eek *e, Args *a)
 {
 	(void)a;
 	if (e->mode == Modevisual) {
-		e->dpending = 0;
-		e->cpending = 0;
-		e->ypending = 0;
-		e->fpending = 0;
-		e->fcount = 0;
-		e->tipending = 0;
+		pendclear(e);
 		e->vtipending = 0;
 		setmode(e, Modenormal);
 	} else {
-		e->dpending = 0;
-		e->cpending = 0;
-		e->ypending = 0;
-		e->fpending = 0;
-		e->fcount = 0;
-		e->tipending = 0;
+		pendclear(e);
 		e->vay = e->cy;
 		e->vax = e->cx;
 		e->vmode = Visualchar;
@@ -5941,14 +6611,7 @@ visline(Eek *e, Args *a)
 		return 0;
 
 	/* Clear any operator-pending state and select the entire current line. */
-	e->dpending = 0;
-	e->cpending = 0;
-	e->ypending = 0;
-	e->fpending = 0;
-	e->fcount = 0;
-	e->rpending = 0;
-	e->rcount = 0;
-	e->tipending = 0;
+	pendclear(e);
 	e->vtipending = 0;
 
 	e->vay = e->cy;
@@ -5971,14 +6634,7 @@ visblock(Eek *e, Args *a)
 
 	/* If already in column-wise visual, toggle back to NORMAL. */
 	if (e->mode == Modevisual && e->vmode == Visualblock) {
-		e->dpending = 0;
-		e->cpending = 0;
-		e->ypending = 0;
-		e->fpending = 0;
-		e->fcount = 0;
-		e->rpending = 0;
-		e->rcount = 0;
-		e->tipending = 0;
+		pendclear(e);
 		e->vtipending = 0;
 		setmode(e, Modenormal);
 		e->vmode = Visualchar;
@@ -5988,14 +6644,7 @@ visblock(Eek *e, Args *a)
 	}
 
 	/* Enter (or switch to) column-wise VISUAL selection. */
-	e->dpending = 0;
-	e->cpending = 0;
-	e->ypending = 0;
-	e->fpending = 0;
-	e->fcount = 0;
-	e->rpending = 0;
-	e->rcount = 0;
-	e->tipending = 0;
+	pendclear(e);
 	e->vtipending = 0;
 
 	if (e->mode != Modevisual) {
@@ -6058,7 +6707,7 @@ opdel(Eek *e, Args *a)
 	(void)a;
 	e->opcount = countval(e->count);
 	e->count = 0;
-	e->dpending = 1;
+	pendset(e, Pendop, 'd', 0, 0);
 	e->lastnormalrune = 0;
 	e->lastmotioncount = 0;
 	e->seqcount = 0;
@@ -6071,7 +6720,7 @@ opchg(Eek *e, Args *a)
 	(void)a;
 	e->opcount = countval(e->count);
 	e->count = 0;
-	e->cpending = 1;
+	pendset(e, Pendop, 'c', 0, 0);
 	e->lastnormalrune = 0;
 	e->lastmotioncount = 0;
 	e->seqcount = 0;
@@ -6084,7 +6733,7 @@ opyank(Eek *e, Args *a)
 	(void)a;
 	e->opcount = countval(e->count);
 	e->count = 0;
-	e->ypending = 1;
+	pendset(e, Pendop, 'y', 0, 0);
 	e->lastnormalrune = 0;
 	e->lastmotioncount = 0;
 	e->seqcount = 0;
@@ -6097,10 +6746,7 @@ findbegin(Eek *e, Args *a)
 	long mode;
 
 	mode = argsat(a, 0, 0);
-	e->fpending = 1;
-	e->fcount = countval(e->count);
-	e->fmode = mode;
-	e->fop = 0;
+	pendset(e, Pendfind, 0, mode, countval(e->count));
 	e->count = 0;
 	e->opcount = 0;
 	e->lastnormalrune = 0;
@@ -6148,7 +6794,7 @@ chgend(Eek *e, Args *a)
 	e->count = 0;
 	if (undopush(e) < 0)
 		return 0;
-	l = bufgetline(&e->b, e->cy);
+	l = bufeditline(&e->b, e->cy);
 	if (l != nil) {
 		len = l->n;
 		if (e->cx < len)
@@ -6244,7 +6890,7 @@ curleft(Eek *e, Args *a)
 static int
 curdown(Eek *e, Args *a)
 {
-	long n;
+	long n, y;
 	if (e && e->mode == Modevisual && e->vmode == Visualblock) {
 		n = countval(e->count);
 		e->count = 0;
@@ -6253,15 +6899,18 @@ curdown(Eek *e, Args *a)
 		return 0;
 	}
 	(void)a;
+	y = e->cy;
 	repeat(e, moved, countval(e->count));
 	e->count = 0;
+	if (e->cy == y)
+		macroabort(e);
 	return 0;
 }
 
 static int
 curup(Eek *e, Args *a)
 {
-	long n;
+	long n, y;
 	if (e && e->mode == Modevisual && e->vmode == Visualblock) {
 		n = countval(e->count);
 		e->count = 0;
@@ -6270,8 +6919,11 @@ curup(Eek *e, Args *a)
 		return 0;
 	}
 	(void)a;
+	y = e->cy;
 	repeat(e, moveu, countval(e->count));
 	e->count = 0;
+	if (e->cy == y)
+		macroabort(e);
 	return 0;
 }
 
@@ -6349,6 +7001,36 @@ eol(Eek *e, Args *a)
 	return 0;
 }
 
+static int
+matchjump(Eek *e, Args *a)
+{
+	long ty, tx, n, pct;
+
+	(void)a;
+	pct = e->count;
+	e->count = 0;
+	e->opcount = 0;
+	if (pct > 0) {
+		/* {n}%: the line n percent of the way into the file, as in vi. */
+		if (pct > 100) {
+			macroabort(e);
+			return 0;
+		}
+		loadwait(e);
+		n = lsz(e->b.nline);
+		e->cy = clamp((pct * n + 99) / 100 - 1, 0, n - 1);
+		e->cx = 0;
+		return 0;
+	}
+	if (matchtarget(e, &ty, &tx) < 0) {
+		macroabort(e);
+		return 0;
+	}
+	e->cy = ty;
+	e->cx = tx;
+	return 0;
+}
+
 static int
 wordnext(Eek *e, Args *a)
 {
@@ -6509,6 +7191,7 @@ findagain(Eek *e, Args *a)
 	}
 	if (pos < 0) {
 		setmsg(e, "Not found: %lc", (long)r);
+		macroabort(e);
 		e->cx = origcx;
 		return 0;
 	}
@@ -6551,9 +7234,7 @@ static int
 dotrepeat(Eek *e, Args *a)
 {
 	long n;
-	long i;
-	int j;
-	KeyEvent ev;
+	long i, j;
 
 	(void)a;
 	if (e == nil)
@@ -6570,18 +7251,17 @@ dotrepeat(Eek *e, Args *a)
 	if (n < 1)
 		n = 1;
 
-	for (i = 0; i < n; i++) {
-		for (j = e->dotlen - 1; j >= 0; j--) {
-			ev = e->dotbuf[j];
-			ev.nomap = 1;
-			ev.src = Keysrcdot;
-			if (feedpushfront(e, &ev) < 0) {
-				setmsg(e, "dot feed overflow");
-				return 0;
-			}
-		}
-		e->dotreplayleft += e->dotlen;
+	/*
+	 * Run the change straight through the mode handlers rather than the
+	 * feed: its keys are already mapped and '.' cannot be one of them, so
+	 * none needs the main loop, which draws once when '.' returns.
+	 */
+	e->undohold = 1;
+	for (i = 0; i < n && !e->quit; i++) {
+		for (j = 0; j < e->dotlen; j++)
+			dispatchkey(e, &e->dotbuf[j].k);
 	}
+	e->undohold = 0;
 	return 0;
 }
 
@@ -6595,6 +7275,7 @@ static const Move nvkeys[] = {
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, ')', "{n}<PgDn>", page },
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, '0', "0", bol },
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, '$', "$", eol },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, '%', "{n}%", matchjump },
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'w', "{n}w", wordnext },
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'b', "{n}b", wordprev },
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'G', "{n}G", gotoline },
@@ -6633,21 +7314,408 @@ static const Move nvkeys[] = {
 	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'C', "C", chgend },
 	{ 1u << Modenormal, Keyrune, 'S', "{n}S", sublinecmd },
 
-	/* paste */
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'p', "p", paste },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'P', "P", pastebefore },
+	/* paste */
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'p', "p", paste },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'P', "P", pastebefore },
+
+	/* search */
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'n', "n", searchnext },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'N', "N", searchprev },
+	{ 1u << Modenormal, Keyrune, '*', "*", searchword },
+
+	/* meta */
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'u', "u", undo },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, '.', ".", dotrepeat },
+	{ 1u << Modenormal, Keyrune, 'q', "q{reg}", macroq },
+	{ 1u << Modenormal, Keyrune, '@', "{n}@{reg}", macroat },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, ' ', " <leader>", leader },
+	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 0x17, "<C-w>", ctrlw },
+};
+
+/*
+ * pendset makes the next NORMAL/VISUAL key complete a pending command.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  state: Pendop, Pendfind, Pendrepl or Pendinside.
+ *  op: pending operator ('d', 'c', 'y') or 0.
+ *  find: find mode ('f', 'F', 't', 'T') for Pendfind, else 0.
+ *  count: repeat count carried to the command.
+ */
+static void
+pendset(Eek *e, int state, long op, long find, long count)
+{
+	e->pending = state;
+	e->pendop = op;
+	e->pendfind = find;
+	e->pendcount = count;
+}
+
+/*
+ * pendclear drops any pending command (see pendset).
+ *
+ * Parameters:
+ *  e: editor state.
+ */
+static void
+pendclear(Eek *e)
+{
+	pendset(e, Pendnone, 0, 0, 0);
+}
+
+/*
+ * pendrepl completes r{c}: replaces the pending count of characters.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  k: key typed after r.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendrepl(Eek *e, const Key *k)
+{
+	long n;
+
+	n = e->pendcount;
+	pendclear(e);
+	if (k->kind == Keyrune && k->value != '\n' && k->value != '\r' &&
+	    (k->value == '\t' || k->value >= 0x20))
+		replchars(e, k->value, n);
+	e->count = 0;
+	e->opcount = 0;
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
+	if (e->mode == Modenormal)
+		normalfixcursor(e);
+	return 1;
+}
+
+/*
+ * pendfindkey completes f/F/t/T{c}, as a motion or as the target of a
+ * pending operator (current line only).
+ *
+ * Parameters:
+ *  e: editor state.
+ *  k: target key.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendfindkey(Eek *e, const Key *k)
+{
+	long n, mode, op;
+	long origcx, pos, posend, curend;
+	long x0, x1;
+
+	n = e->pendcount;
+	mode = e->pendfind;
+	op = e->pendop;
+	pendclear(e);
+	if (k->kind != Keyrune)
+		goto done;
+
+	origcx = e->cx;
+	pos = -1;
+	switch (mode) {
+	case 'f':
+	case 't':
+		if (findfwd(e, k->value, n) == 0)
+			pos = e->cx;
+		break;
+	case 'F':
+	case 'T':
+		if (findbwd(e, k->value, n) == 0)
+			pos = e->cx;
+		break;
+	}
+	if (pos < 0) {
+		setmsg(e, "Not found: %lc", (long)k->value);
+		macroabort(e);
+		e->cx = origcx;
+		goto done;
+	}
+	e->lastfindmode = mode;
+	e->lastfindr = k->value;
+	posend = nextutf8(e, e->cy, pos);
+	curend = nextutf8(e, e->cy, origcx);
+
+	if (op == 0) {
+		switch (mode) {
+		case 'f':
+		case 'F':
+			e->cx = pos;
+			break;
+		case 't':
+			e->cx = prevutf8(e, e->cy, pos);
+			break;
+		case 'T':
+			e->cx = posend;
+			break;
+		default:
+			e->cx = origcx;
+			break;
+		}
+		goto done;
+	}
+
+	/* Operator-pending applies to current line only. */
+	e->cx = origcx;
+	x0 = origcx;
+	x1 = origcx;
+	switch (mode) {
+	case 'f': /* through */
+		x1 = posend;
+		break;
+	case 't': /* until */
+		x1 = pos;
+		break;
+	case 'F': /* backward through */
+		x0 = pos;
+		x1 = curend;
+		break;
+	case 'T': /* backward until */
+		x0 = posend;
+		x1 = curend;
+		break;
+	}
+	if (x0 != x1) {
+		if (op == 'y') {
+			(void)yankrange(e, e->cy, x0, e->cy, x1);
+			/* Preserve cursor. */
+			e->cx = origcx;
+		} else {
+			(void)delrange(e, e->cy, x0, e->cy, x1, 1);
+			if (op == 'c')
+				setmode(e, Modeinsert);
+		}
+	}
+
+done:
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
+	e->count = 0;
+	e->opcount = 0;
+	return 1;
+}
+
+/*
+ * pendinside completes di{c}/ci{c}.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  k: delimiter key.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendinside(Eek *e, const Key *k)
+{
+	long op;
+
+	op = e->pendop;
+	pendclear(e);
+	if (k->kind == Keyrune)
+		(void)delinside(e, op, k->value);
+	e->opcount = 0;
+	e->count = 0;
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
+	return 1;
+}
+
+/*
+ * pendyank runs y{motion} for the rune r.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  r: motion rune.
+ *  total: operator count times motion count.
+ */
+static void
+pendyank(Eek *e, long r, long total)
+{
+	long sy, sx, cy, cx, ty, tx;
+	long i;
+
+	sy = e->cy;
+	sx = e->cx;
+	switch (r) {
+	case 'y':
+		(void)yanklines(e, e->cy, total);
+		break;
+	case 'w':
+		cy = sy;
+		cx = sx;
+		for (i = 0; i < total; i++) {
+			e->cy = cy;
+			e->cx = cx;
+			wordtarget(e, &ty, &tx);
+			if (ty == cy && tx <= cx)
+				break;
+			cy = ty;
+			cx = tx;
+		}
+		e->cy = sy;
+		e->cx = sx;
+		(void)yankrange(e, sy, sx, cy, cx);
+		break;
+	case 'e':
+		endwordtarget(e, &ty, &tx);
+		(void)yankrange(e, e->cy, e->cx, e->cy, tx);
+		break;
+	case '$':
+		(void)yankrange(e, e->cy, e->cx, e->cy, linelen(e, e->cy));
+		break;
+	case '%':
+		if (matchtarget(e, &ty, &tx) < 0)
+			macroabort(e);
+		else if (poslt(ty, tx, sy, sx))
+			(void)yankrange(e, ty, tx, sy, nextutf8(e, sy, sx));
+		else
+			(void)yankrange(e, sy, sx, ty, nextutf8(e, ty, tx));
+		break;
+	default:
+		setmsg(e, "Unknown y%lc", r);
+		break;
+	}
+	e->cy = sy;
+	e->cx = sx;
+}
+
+/*
+ * pendopkey completes d, c or y: digits extend the motion count, f/F/t/T
+ * and i wait for one more key, anything else is the motion.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  k: key typed after the operator.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendopkey(Eek *e, const Key *k)
+{
+	long op, r, total;
+
+	if (k->kind == Keyrune && k->value >= '0' && k->value <= '9') {
+		if (e->count > 0 || k->value != '0') {
+			e->count = e->count * 10 + (k->value - '0');
+			return 1;
+		}
+	}
+
+	op = e->pendop;
+	pendclear(e);
+	if (k->kind == Keyrune) {
+		r = k->value;
+		total = countval(e->opcount) * countval(e->count);
+		e->opcount = 0;
+		e->count = 0;
+		if (r == 'f' || r == 't' || r == 'F' || r == 'T') {
+			pendset(e, Pendfind, op, r, total);
+			return 1;
+		}
+		if (r == 'i' && op != 'y') {
+			pendset(e, Pendinside, op, 0, 0);
+			e->opcount = total;
+			return 1;
+		}
+		switch (op) {
+		case 'd':
+			if (r == 'd')
+				(void)dellines(e, total);
+			else if (r == 'w')
+				(void)delwords(e, total);
+			else if (r == 'e')
+				(void)delendwords(e, total);
+			else if (r == '%')
+				(void)delmatch(e);
+			else
+				setmsg(e, "Unknown d%lc", r);
+			break;
+		case 'c':
+			if (r == 'w') {
+				(void)delwords(e, total);
+				setmode(e, Modeinsert);
+			} else if (r == '%') {
+				if (delmatch(e) == 0)
+					setmode(e, Modeinsert);
+			} else {
+				setmsg(e, "Unknown c%lc", r);
+			}
+			break;
+		case 'y':
+			pendyank(e, r, total);
+			break;
+		}
+	}
+	if (op != 'y' && e->mode == Modenormal)
+		normalfixcursor(e);
+	e->lastnormalrune = 0;
+	e->lastmotioncount = 0;
+	e->seqcount = 0;
+	return 1;
+}
+
+/*
+ * pendmacro completes q{reg}: starts recording into register a..z.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendmacro(Eek *e, const Key *k)
+{
+	pendclear(e);
+	if (k->kind != Keyrune || k->value < 'a' || k->value > 'z')
+		return 1;
+	e->macroreg = (int)k->value;
+	e->macrolen = 0;
+	return 1;
+}
 
-	/* search */
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'n', "n", searchnext },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'N', "N", searchprev },
-	{ 1u << Modenormal, Keyrune, '*', "*", searchword },
+/*
+ * pendplay completes {n}@{reg}: replays register a..z, or the last one
+ * replayed for @@, n times.
+ *
+ * Returns:
+ *  1 (the key is consumed).
+ */
+static int
+pendplay(Eek *e, const Key *k)
+{
+	long n;
+	int reg;
 
-	/* meta */
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'u', "u", undo },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, '.', ".", dotrepeat },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 'q', "q", quit },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, ' ', " <leader>", leader },
-	{ (1u << Modenormal) | (1u << Modevisual), Keyrune, 0x17, "<C-w>", ctrlw },
+	n = e->pendcount;
+	pendclear(e);
+	if (k->kind != Keyrune)
+		return 1;
+	reg = k->value == '@' ? e->lastmacro : (int)k->value;
+	if (reg < 'a' || reg > 'z') {
+		setmsg(e, k->value == '@' ? "No previous macro" : "Invalid register");
+		return 1;
+	}
+	(void)macroplay(e, reg, n);
+	return 1;
+}
+
+/* What the next key does while a command is pending, by Eek.pending. */
+static int (*const pendkeys[])(Eek *e, const Key *k) = {
+	[Pendop] = pendopkey,
+	[Pendfind] = pendfindkey,
+	[Pendrepl] = pendrepl,
+	[Pendinside] = pendinside,
+	[Pendmacro] = pendmacro,
+	[Pendplay] = pendplay,
 };
 
 static int
@@ -6655,26 +7723,12 @@ nvkey(Eek *e, const Key *k)
 {
 	Args a;
 	long r;
-	long rr;
-	long n;
 	long idx;
 	long line;
-	long total;
 	long sy, sx;
 	long ey, ex;
-	long ty, tx;
-	long cy, cx;
-	long len;
-	long i;
 	long y0, y1;
 	long rx0, rx1;
-	long mode;
-	long op;
-	long origcx;
-	long pos;
-	long posend;
-	long curend;
-	long x0, x1;
 	int did;
 	int dir;
 	int handled;
@@ -6699,14 +7753,7 @@ nvkey(Eek *e, const Key *k)
 		}
 		if (did && dir >= 0) {
 			(void)focusdir(e, dir);
-			e->dpending = 0;
-			e->cpending = 0;
-			e->ypending = 0;
-			e->fpending = 0;
-			e->fcount = 0;
-			e->rpending = 0;
-			e->rcount = 0;
-			e->tipending = 0;
+			pendclear(e);
 			e->vtipending = 0;
 			e->lastnormalrune = 0;
 			e->lastmotioncount = 0;
@@ -6719,14 +7766,7 @@ nvkey(Eek *e, const Key *k)
 
 	/* ESC cancels pending operators / exits visual like before. */
 	if (k->kind == Keyesc) {
-		e->dpending = 0;
-		e->cpending = 0;
-		e->ypending = 0;
-		e->fpending = 0;
-		e->fcount = 0;
-		e->rpending = 0;
-		e->rcount = 0;
-		e->tipending = 0;
+		pendclear(e);
 		e->vtipending = 0;
 		e->lastnormalrune = 0;
 		e->lastmotioncount = 0;
@@ -6738,312 +7778,9 @@ nvkey(Eek *e, const Key *k)
 		return 1;
 	}
 
-	if (e->rpending) {
-		e->rpending = 0;
-		if (k->kind == Keyrune) {
-			rr = k->value;
-			n = e->rcount;
-			e->rcount = 0;
-			if (rr == '\n' || rr == '\r')
-				goto repldone;
-			if (rr == '\t')
-				replchars(e, rr, n);
-			else if (rr >= 0x20)
-				replchars(e, rr, n);
-		}
-	repldone:
-		e->count = 0;
-		e->opcount = 0;
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		if (e->mode == Modenormal)
-			normalfixcursor(e);
-		return 1;
-	}
-
-	if (e->fpending) {
-		e->fpending = 0;
-		if (k->kind == Keyrune) {
-			n = e->fcount;
-			mode = e->fmode;
-			op = e->fop;
-			e->fcount = 0;
-			e->fmode = 0;
-			e->fop = 0;
-
-			origcx = e->cx;
-			pos = -1;
-			switch (mode) {
-			case 'f':
-			case 't':
-				if (findfwd(e, k->value, n) < 0)
-					pos = -1;
-				else
-					pos = e->cx;
-				break;
-			case 'F':
-			case 'T':
-				if (findbwd(e, k->value, n) < 0)
-					pos = -1;
-				else
-					pos = e->cx;
-				break;
-			default:
-				pos = -1;
-				break;
-			}
-
-			if (pos < 0) {
-				setmsg(e, "Not found: %lc", (long)k->value);
-				e->cx = origcx;
-				goto finddone;
-			}
-			e->lastfindmode = mode;
-			e->lastfindr = k->value;
-			posend = nextutf8(e, e->cy, pos);
-			curend = nextutf8(e, e->cy, origcx);
-
-			if (op == 0) {
-				switch (mode) {
-				case 'f':
-				case 'F':
-					e->cx = pos;
-					break;
-				case 't':
-					e->cx = prevutf8(e, e->cy, pos);
-					break;
-				case 'T':
-					e->cx = posend;
-					break;
-				default:
-					e->cx = origcx;
-					break;
-				}
-			} else {
-				/* Operator-pending applies to current line only. */
-				e->cx = origcx;
-				x0 = origcx;
-				x1 = origcx;
-				switch (mode) {
-				case 'f': /* through */
-					x0 = origcx;
-					x1 = posend;
-					break;
-				case 't': /* until */
-					x0 = origcx;
-					x1 = pos;
-					break;
-				case 'F': /* backward through */
-					x0 = pos;
-					x1 = curend;
-					break;
-				case 'T': /* backward until */
-					x0 = posend;
-					x1 = curend;
-					break;
-				default:
-					break;
-				}
-				if (x0 != x1) {
-					if (op == 'y') {
-						(void)yankrange(e, e->cy, x0, e->cy, x1);
-						/* Preserve cursor. */
-						e->cx = origcx;
-					} else {
-						(void)delrange(e, e->cy, x0, e->cy, x1, 1);
-						if (op == 'c')
-							setmode(e, Modeinsert);
-					}
-				}
-			}
-		finddone:
-			;
-		}
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		e->count = 0;
-		e->opcount = 0;
-		return 1;
-	}
-
-	if (e->dpending) {
-		if (k->kind == Keyrune && k->value >= '0' && k->value <= '9') {
-			if (e->count > 0 || k->value != '0') {
-				e->count = e->count * 10 + (k->value - '0');
-				return 1;
-			}
-		}
-
-		e->dpending = 0;
-		if (k->kind == Keyrune) {
-			total = countval(e->opcount) * countval(e->count);
-			e->opcount = 0;
-			e->count = 0;
-			switch (k->value) {
-			case 'd':
-				(void)dellines(e, total);
-				break;
-			case 'i':
-				e->tipending = 1;
-				e->tiop = 'd';
-				e->opcount = total;
-				return 1;
-			case 'w':
-				(void)delwords(e, total);
-				break;
-			case 'e':
-				(void)delendwords(e, total);
-				break;
-			case 'f':
-			case 't':
-			case 'F':
-			case 'T':
-				e->fpending = 1;
-				e->fcount = total;
-				e->fmode = k->value;
-				e->fop = 'd';
-				return 1;
-			default:
-				setmsg(e, "Unknown d%lc", (long)k->value);
-				break;
-			}
-		}
-		if (e->mode == Modenormal)
-			normalfixcursor(e);
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		return 1;
-	}
-
-	if (e->tipending) {
-		e->tipending = 0;
-		if (k->kind == Keyrune)
-			(void)delinside(e, e->tiop, k->value);
-		e->tiop = 0;
-		e->opcount = 0;
-		e->count = 0;
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		return 1;
-	}
-
-	if (e->ypending) {
-		if (k->kind == Keyrune && k->value >= '0' && k->value <= '9') {
-			if (e->count > 0 || k->value != '0') {
-				e->count = e->count * 10 + (k->value - '0');
-				return 1;
-			}
-		}
-
-		e->ypending = 0;
-		if (k->kind == Keyrune) {
-			total = countval(e->opcount) * countval(e->count);
-			e->opcount = 0;
-			e->count = 0;
-			sy = e->cy;
-			sx = e->cx;
-
-			switch (k->value) {
-			case 'y':
-				(void)yanklines(e, e->cy, total);
-				break;
-			case 'w':
-				{
-					cy = sy;
-					cx = sx;
-					for (i = 0; i < total; i++) {
-						e->cy = cy;
-						e->cx = cx;
-						wordtarget(e, &ty, &tx);
-						if (ty == cy && tx <= cx)
-							break;
-						cy = ty;
-						cx = tx;
-					}
-					e->cy = sy;
-					e->cx = sx;
-					(void)yankrange(e, sy, sx, cy, cx);
-				}
-				break;
-			case 'e':
-				endwordtarget(e, &ty, &tx);
-				(void)yankrange(e, e->cy, e->cx, e->cy, tx);
-				break;
-			case '$': {
-				len = linelen(e, e->cy);
-				(void)yankrange(e, e->cy, e->cx, e->cy, len);
-				break;
-			}
-			case 'f':
-			case 't':
-			case 'F':
-			case 'T':
-				e->fpending = 1;
-				e->fcount = total;
-				e->fmode = k->value;
-				e->fop = 'y';
-				return 1;
-			default:
-				setmsg(e, "Unknown y%lc", (long)k->value);
-				break;
-			}
-			e->cy = sy;
-			e->cx = sx;
-		}
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		return 1;
-	}
-
-	if (e->cpending) {
-		if (k->kind == Keyrune && k->value >= '0' && k->value <= '9') {
-			if (e->count > 0 || k->value != '0') {
-				e->count = e->count * 10 + (k->value - '0');
-				return 1;
-			}
-		}
-
-		e->cpending = 0;
-		if (k->kind == Keyrune) {
-			total = countval(e->opcount) * countval(e->count);
-			e->opcount = 0;
-			e->count = 0;
-			switch (k->value) {
-			case 'w':
-				(void)delwords(e, total);
-				setmode(e, Modeinsert);
-				break;
-			case 'f':
-			case 't':
-			case 'F':
-			case 'T':
-				e->fpending = 1;
-				e->fcount = total;
-				e->fmode = k->value;
-				e->fop = 'c';
-				return 1;
-			case 'i':
-				e->tipending = 1;
-				e->tiop = 'c';
-				e->opcount = total;
-				return 1;
-			default:
-				setmsg(e, "Unknown c%lc", (long)k->value);
-				break;
-			}
-		}
-		if (e->mode == Modenormal)
-			normalfixcursor(e);
-		e->lastnormalrune = 0;
-		e->lastmotioncount = 0;
-		e->seqcount = 0;
-		return 1;
-	}
+	/* A pending command (operator, find, replace) takes this key. */
+	if (e->pending != Pendnone)
+		return pendkeys[e->pending](e, k);
 
 	/* Arrow key motions work regardless of counts. */
 	if (k->kind == Keyup) {
@@ -7102,15 +7839,19 @@ nvkey(Eek *e, const Key *k)
 	/* VISUAL extra keys: v, yi{obj}, di{obj} etc. */
 	if (e->mode == Modevisual) {
 		if (e->vmode == Visualblock && k->value == 'I') {
+			/* One cursor per line at the block's left edge. */
 			vselblockbounds(e, &y0, &y1, &rx0, &rx1);
-			e->blockins = 1;
-			e->blocky0 = y0;
-			e->blocky1 = y1;
-			e->blockrx0 = rx0;
-			blockclear(e);
-
+			cursorend(e);
+			for (line = y0; line <= y1; line++) {
+				if (cursoradd(e, line, clamp(cxfromrx(e, line, rx0), 0, linelen(e, line))) < 0)
+					break;
+			}
 			e->cy = y0;
-			e->cx = cxfromrx(e, y0, rx0);
+			e->cx = e->nmc > 0 ? e->mc[0].x : 0;
+			if (line <= y1 || cursorbegin(e) < 0) {
+				cursorend(e);
+				setmsg(e, "Out of memory");
+			}
 			setmode(e, Modeinsert);
 			e->vtipending = 0;
 			e->vmode = Visualchar;
@@ -7309,7 +8050,7 @@ nvkey(Eek *e, const Key *k)
 	argsinit(&a);
 	if (k->value == 'f' || k->value == 'F' || k->value == 't' || k->value == 'T' || k->value == '(' || k->value == ')')
 		(void)argspush(&a, k->value);
-	handled = movedispatch(e, e->mode, nvkeys, (long)(sizeof nvkeys / sizeof nvkeys[0]), k, &a);
+	handled = movedispatch(e, &nvmap[e->mode], k, &a);
 	argsfree(&a);
 
 	/* Apply the original afterkey state cleanup rules when a rune move fired. */
@@ -7331,12 +8072,115 @@ afterkey:
 	return 1;
 }
 
+/*
+ * resize re-reads the terminal size after a SIGWINCH and clamps the
+ * active window cursor.
+ *
+ * Parameters:
+ *  - e: editor state.
+ */
+static void
+resize(Eek *e)
+{
+	if (!termresized())
+		return;
+	termgetwinsz(&e->t);
+	winclamp(e, e->curwin);
+	normalfixcursor(e);
+}
+
+/*
+ * onresize is the event loop callback for the SIGWINCH self-pipe.
+ */
+static void
+onresize(int fd, int revents, void *arg)
+{
+	(void)fd;
+	(void)revents;
+	resize(arg);
+}
+
+/*
+ * dispatchkey runs k through the handler of the current mode.
+ *
+ * Parameters:
+ *  e: editor state.
+ *  k: key to run (maps already applied).
+ */
+static void
+dispatchkey(Eek *e, const Key *k)
+{
+	if (e->mode == Modecmd) {
+		perfbegin(Perfcmdkey);
+		(void)cmdkey(e, k);
+		perfend(Perfcmdkey);
+		return;
+	}
+	if (e->mode == Modeinsert) {
+		perfbegin(Perfinskey);
+		(void)inskey(e, k);
+		perfend(Perfinskey);
+		return;
+	}
+	/* Jumps and searches past the loaded lines wait for the loader. */
+	if (k->kind == Keyrune && k->value > 0 && k->value < 0x80 &&
+	    strchr("GnN*", (int)k->value) != nil)
+		loadwait(e);
+	perfbegin(Perfnvkey);
+	(void)nvkey(e, k);
+	perfend(Perfnvkey);
+}
+
+/*
+ * keymapinit compiles nvkeys, inskeys and cmdkeys into per-mode tables,
+ * so a key costs one lookup instead of a scan of its table.
+ *
+ * Returns:
+ *  0 on success, -1 on allocation failure.
+ */
+static int
+keymapinit(void)
+{
+	int m;
+
+	for (m = 0; m < Nmode; m++) {
+		if (keymapbuild(&nvmap[m], m, nvkeys, (long)(sizeof nvkeys / sizeof nvkeys[0])) < 0)
+			return -1;
+	}
+	if (keymapbuild(&insmap, Modeinsert, inskeys, (long)(sizeof inskeys / sizeof inskeys[0])) < 0)
+		return -1;
+	return keymapbuild(&cmdmap, Modecmd, cmdkeys, (long)(sizeof cmdkeys / sizeof cmdkeys[0]));
+}
+
+/*
+ * keymapfini releases the tables built by keymapinit.
+ */
+static void
+keymapfini(void)
+{
+	int m;
+
+	for (m = 0; m < Nmode; m++)
+		keymapfree(&nvmap[m]);
+	keymapfree(&insmap);
+	keymapfree(&cmdmap);
+}
+
+/*
+ * usage prints the command line synopsis and exits.
+ */
+static void
+usage(void)
+{
+	die("usage: eek [-f] [--headless WxH --keys script] [file]");
+}
+
 /*
  * main starts the editor.
  *
  * Parameters:
  *  argc: argument count.
- *  argv: argument vector; argv[1] (if present) is the file to open.
+ *  argv: argument vector (options and an optional file, see usage).
  *
  * Returns:
  *  Process exit status.
@@ -7345,27 +8189,79 @@ int
 main(int argc, char **argv)
 {
 	Eek e;
+	Headless hl;
+	Headless *h;
+	char *geom;
+	char *script;
+	char *file;
+	int follow;
+	int wascmd;
 	KeyEvent kev;
 	Rect root;
 	Rect cur;
 	long textrows;
 	int gut;
+	int r;
 	long textcols;
 	long i;
 
 	memset(&e, 0, sizeof e);
 	bufinit(&e.b);
 	e.cmdprefix = ':';
-	if (tabinit1(&e) < 0)
+	if (tabinit1(&e) < 0 || keymapinit() < 0)
 		die("Out of memory");
 
-	if (argc > 1) {
-		e.fname = argv[1];
+	geom = script = file = nil;
+	follow = 0;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			if (i + 1 < argc)
+				file = argv[i + 1];
+			if (i + 2 < argc)
+				usage();
+			break;
+		}
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+			geom = argv[++i];
+		else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc)
+			script = argv[++i];
+		else if (strcmp(argv[i], "-f") == 0)
+			follow = 1;
+		else if (argv[i][0] == '-' && argv[i][1] != 0)
+			usage();
+		else if (file == nil)
+			file = argv[i];
+		else
+			usage();
+	}
+	if ((geom == nil) != (script == nil) || (follow && file == nil))
+		usage();
+
+	if (evinit() < 0)
+		die("evinit: %s", strerror(errno));
+	h = nil;
+	if (geom != nil) {
+		/* Headless: scripted keys in, in-memory screen out, no tty. */
+		h = &hl;
+		headlessinit(h, geom, script);
+	}
+
+	if (file != nil) {
+		e.fname = file;
 		e.ownfname = 0;
-		(void)bufload(&e.b, e.fname);
+		/* Big files stream in after the first screen (not in scripted runs). */
+		if (h != nil || loadstart(&e, e.fname) < 0)
+			(void)bufload(&e.b, e.fname);
 	}
 
-	terminit(&e.t);
+	if (h != nil) {
+		termheadless(&e.t, &h->vt);
+		keysetinput(h->keys, h->nkeys);
+	} else {
+		terminit(&e.t);
+		if (evaddfd(e.t.fdwinch, onresize, &e) < 0)
+			die("Out of memory");
+	}
 	/* Initialize the window layout with a single window/view. */
 	e.layout = nodeleaf(winnewfrom(&e));
 	if (e.layout == nil || e.layout->w == nil)
@@ -7373,15 +8269,12 @@ main(int argc, char **argv)
 	e.curwin = e.layout->w;
 	setmode(&e, Modenormal);
 	cmdclear(&e);
+	if (follow)
+		(void)followstart(&e, e.fname);
 	draw(&e);
 
 	for (;;) {
-		if (termresized()) {
-			termgetwinsz(&e.t);
-			/* Clamp the active window cursor after a resize. */
-			winclamp(&e, e.curwin);
-			normalfixcursor(&e);
-		}
+		resize(&e);
 		/* Scroll the active window based on its viewport height. */
 		textrows = e.t.row - 1;
 		if (textrows < 1)
@@ -7396,60 +8289,76 @@ main(int argc, char **argv)
 		hscroll(&e, textcols);
 		winstore(&e);
 		winload(&e, e.curwin);
-		draw(&e);
+		/* Headless runs never sleep in the loop; finish saves in step. */
+		if (h != nil)
+			savewait(&e);
+		/* A macro replay is drawn once, when its last key has run. */
+		if (e.macroleft <= 0 || e.feedlen == 0)
+			draw(&e);
 		if (e.quit)
 			break;
 		if (!feedpop(&e, &kev)) {
+			if (h != nil)
+				headlessend(h);
+			/* Sleep in the event loop; anything but input just redraws. */
+			if (!keypending(&e.t) && !evwait(e.t.fdin, -1))
+				continue;
 			memset(&kev, 0, sizeof kev);
-			if (keyread(&e.t, &kev.k) < 0)
+			perfbegin(Perfkeyread);
+			r = keyread(&e.t, &kev.k);
+			perfend(Perfkeyread);
+			if (r < 0)
 				break;
+			if (h != nil)
+				headlessbegin(h);
 			kev.nomap = 0;
 			kev.src = Keysrcuser;
 		}
-		if (kev.src == Keysrcdot && e.dotreplayleft > 0)
-			e.dotreplayleft--;
+		if (kev.src == Keysrcmacro && e.macroleft > 0)
+			e.macroleft--;
 		if (e.mode != Modeinsert)
 			e.undopending = 0;
-		if (e.msg[0] != 0 && e.mode != Modecmd)
+		if (e.msg[0] != 0 && e.mode != Modecmd && kev.src != Keysrcmacro)
 			e.msg[0] = 0;
 
 		/* Apply maps (NORMAL/VISUAL only) before dispatch. */
-		if (!kev.nomap && (e.mode == Modenormal || e.mode == Modevisual) && kev.k.kind == Keyrune) {
-			if (mapapply(&e, e.mode, kev.k.value))
+		if (!kev.nomap && (e.mode == Modenormal || e.mode == Modevisual) &&
+		    (kev.k.kind == Keyrune || e.nmapheld > 0)) {
+			if (mapapply(&e, e.mode, &kev))
 				continue;
 		}
 
+		/* q{reg}: record what is dispatched (maps expanded), not replays. */
+		if (e.macroreg != 0 && (kev.src == Keysrcuser || kev.src == Keysrcmap))
+			macrorecadd(&e, &kev);
+
 		/* '.' recording: start on change keys in NORMAL; record effective keys. */
-		if (e.dotreplayleft <= 0) {
-			if (!e.dotrec && e.mode == Modenormal && kev.k.kind == Keyrune && dotstartkey(kev.k.value))
-				dotrecstart(&e);
-			if (e.dotrec) {
-				if (!(e.mode == Modenormal && kev.k.kind == Keyrune && kev.k.value == '.'))
-					dotrecadd(&e, &kev);
-			}
+		if (!e.dotrec && e.mode == Modenormal && kev.k.kind == Keyrune && dotstartkey(kev.k.value))
+			dotrecstart(&e);
+		if (e.dotrec) {
+			if (!(e.mode == Modenormal && kev.k.kind == Keyrune && kev.k.value == '.'))
+				dotrecadd(&e, &kev);
 		}
 
-		if (e.mode == Modecmd) {
-			(void)cmdkey(&e, &kev.k);
+		wascmd = e.mode == Modecmd;
+		dispatchkey(&e, &kev.k);
+		if (wascmd)
 			continue;
-		}
-		if (e.mode == Modeinsert) {
-			(void)inskey(&e, &kev.k);
-			goto afterdispatch;
-		}
-		(void)nvkey(&e, &kev.k);
-	afterdispatch:
-		;
 
 		if (e.dotrec) {
-			if (e.mode == Modenormal && !e.dpending && !e.cpending && !e.ypending &&
-			    !e.fpending && !e.rpending && !e.tipending && !e.vtipending)
+			if (e.mode == Modenormal && e.pending == Pendnone && !e.vtipending)
 				dotrecsave(&e);
 		}
 		if (e.quit)
 			break;
 	}
 
+	followstop();
+	loadcancel();
+	savewait(&e);
+	if (h != nil)
+		headlessdump(&e, h, stdout);
+
 	/* Free inactive tabs (the active tab lives in e.* fields). */
 	if (e.tab != nil) {
 		for (i = 0; i < e.ntab; i++) {
@@ -7457,7 +8366,7 @@ main(int argc, char **argv)
 				continue;
 			tabfree(&e.tab[i]);
 		}
-		free(e.tab);
+		memfree(Memother, e.tab, (size_t)e.captab * sizeof e.tab[0]);
 		e.tab = nil;
 		e.ntab = 0;
 		e.captab = 0;
@@ -7465,22 +8374,26 @@ main(int argc, char **argv)
 	}
 	yclear(&e);
 	undofree(&e);
+	keymapfini();
 	nodefree(e.layout);
 	mapfreeall(&e);
+	feedfree(&e);
+	macrofree(&e);
 	free(e.lastsearch);
-	free(e.blockbuf);
-	e.blockbuf = nil;
-	e.blockn = 0;
-	e.blockcap = 0;
+	cursorend(&e);
 	setcursorshape(&e, Cursornormal);
 	termclear(&e.t);
 	termmoveto(&e.t, 0, 0);
 	termflush(&e.t);
-	free(e.t.out);
+	memfree(Memrender, e.t.out, (size_t)e.t.outcap);
 	e.t.out = nil;
 	e.t.outn = 0;
 	e.t.outcap = 0;
 	termrestore();
+	if (h != nil)
+		headlessfree(h);
+	memlog(nil, 0);
+	evfree();
 	if (e.ownfname)
 		free(e.fname);
 	buffree(&e.b);
@@ -7514,7 +8427,13 @@ undopush(Eek *e)
 		return 0;
 	if (e->undopending)
 		return 0;
+	/* A '.' replay is one step: only its first change takes a snapshot. */
+	if (e->undohold > 1)
+		return 0;
+	/* A snapshot of a half-loaded buffer would lose the rest on undo. */
+	loadwait(e);
 
+	perfbegin(Perfundo);
 	if (e->nundo >= Undomax) {
 		buffree(&e->undo[0].b);
 		memmove(&e->undo[0], &e->undo[1], (size_t)(e->nundo - 1) * sizeof e->undo[0]);
@@ -7523,18 +8442,23 @@ undopush(Eek *e)
 
 	if (e->nundo + 1 > e->capundo) {
 		ncap = e->capundo > 0 ? e->capundo * 2 : 32;
-		p = realloc(e->undo, (size_t)ncap * sizeof e->undo[0]);
-		if (p == nil)
+		p = memrealloc(Memundo, e->undo, (size_t)e->capundo * sizeof e->undo[0],
+			(size_t)ncap * sizeof e->undo[0]);
+		if (p == nil) {
+			perfend(Perfundo);
 			return -1;
+		}
 		e->undo = p;
 		e->capundo = ncap;
 	}
 
 	u = &e->undo[e->nundo++];
 	bufinit(&u->b);
+	bufsettag(&u->b, Memundo);
 	if (bufcopy(&u->b, &e->b) < 0) {
 		buffree(&u->b);
 		e->nundo--;
+		perfend(Perfundo);
 		return -1;
 	}
 	u->cx = e->cx;
@@ -7543,6 +8467,9 @@ undopush(Eek *e)
 	u->coloff = e->coloff;
 	u->dirty = e->dirty;
 	e->undopending = 1;
+	if (e->undohold)
+		e->undohold = 2;
+	perfend(Perfundo);
 	return 0;
 }
 
@@ -7569,6 +8496,7 @@ undopop(Eek *e)
 	e->inundo = 1;
 	buffree(&e->b);
 	e->b = u.b;
+	bufsettag(&e->b, Memline);
 	e->cx = u.cx;
 	e->cy = clamp(u.cy, 0, e->b.nline > 0 ? e->b.nline - 1 : 0);
 	e->rowoff = clamp(u.rowoff, 0, e->b.nline > 0 ? e->b.nline - 1 : 0);
@@ -7601,7 +8529,7 @@ undofree(Eek *e)
 		return;
 	for (i = 0; i < e->nundo; i++)
 		buffree(&e->undo[i].b);
-	free(e->undo);
+	memfree(Memundo, e->undo, (size_t)e->capundo * sizeof e->undo[0]);
 	e->undo = nil;
 	e->nundo = 0;
 	e->capundo = 0;
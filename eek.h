@@ -25,6 +25,14 @@ enum {
 	Keyend,
 	Keypgup,
 	Keypgdown,
+	Nkey,
+};
+
+/* SGR attribute bits (see termattr). */
+enum {
+	Attrbold = 1 << 0,
+	Attrunderline = 1 << 1,
+	Attrinverse = 1 << 2,
 };
 
 struct Term {
@@ -35,6 +43,12 @@ struct Term {
 	char *out; /* Buffered output bytes (optional). */
 	long outn; /* Number of bytes used in out[]. */
 	long outcap; /* Capacity of out[] in bytes. */
+	int inframe; /* Non-zero once part of the current frame was written. */
+	int attr;    /* Attr* bits in effect on the terminal, or -1 if unknown. */
+	int fg;      /* Foreground in effect: -1 default, 0..255 palette. */
+	int bg;      /* Background in effect: -1 default, 0..255 palette. */
+	int fdwinch; /* Readable after SIGWINCH (self-pipe), or -1. */
+	struct Vt *vt; /* Headless screen receiving output instead of fdout, or nil. */
 };
 
 /*
@@ -48,6 +62,19 @@ struct Term {
  */
 void terminit(Term *t);
 
+/*
+ * termheadless initializes t without a tty: output is interpreted by the
+ * in-memory screen vt, whose size becomes the terminal size.
+ *
+ * Parameters:
+ *  - t: terminal state to initialize.
+ *  - vt: initialized screen model (see vt.h).
+ *
+ * Returns:
+ *  - void.
+ */
+void termheadless(Term *t, struct Vt *vt);
+
 /*
  * termrestore restores the terminal state to what it was before terminit.
  *
@@ -105,6 +132,22 @@ void termclear(Term *t);
  */
 void termmoveto(Term *t, int r, int c);
 
+/*
+ * termattr switches the terminal to the given SGR state, emitting only the
+ * parameters that differ from the state already in effect (nothing at all
+ * if it is unchanged).
+ *
+ * Parameters:
+ *  - t: terminal.
+ *  - attr: Attr* bits.
+ *  - fg: foreground color (-1 for default, 0..255 palette index).
+ *  - bg: background color (-1 for default, 0..255 palette index).
+ *
+ * Returns:
+ *  - void.
+ */
+void termattr(Term *t, int attr, int fg, int bg);
+
 /*
  * Buffered output helpers.
  * These append to t->out and are flushed by termflush().
@@ -114,7 +157,8 @@ void termputc(Term *t, char c);
 void termrepeat(Term *t, char c, int n);
 
 /*
- * termflush flushes any buffered terminal output, if applicable.
+ * termflush writes the buffered frame in one writev(2), wrapped in a
+ * synchronized update (mode 2026) when SYNCOUTPUT is set.
  *
  * Parameters:
  *  - t: terminal.
@@ -138,4 +182,38 @@ void termflush(Term *t);
  */
 int keyread(Term *t, Key *k);
 
+/*
+ * keypending reports whether keyread can return without touching the fd
+ * (bytes were pushed back while decoding an earlier sequence).
+ *
+ * Parameters:
+ *  - t: terminal.
+ *
+ * Returns:
+ *  - non-zero if input is already buffered, 0 otherwise.
+ */
+int keypending(Term *t);
+
+/*
+ * keysetinput makes keyread decode the given bytes instead of reading the
+ * terminal (headless mode). keyread returns -1 once they are consumed.
+ *
+ * Parameters:
+ *  - s: input bytes; must stay valid while keys are read.
+ *  - n: number of bytes.
+ *
+ * Returns:
+ *  - void.
+ */
+void keysetinput(const char *s, long n);
+
+/*
+ * keyinputoff returns how many bytes of the keysetinput buffer have been
+ * decoded into keys so far (bytes read ahead and pushed back excluded).
+ *
+ * Returns:
+ *  - byte offset into the scripted input.
+ */
+long keyinputoff(void);
+
 #endif /* EEK_H */
\ No newline at end of file
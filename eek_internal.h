@@ -7,6 +7,7 @@
 #include "buf.h"
 #include "eek.h"
 #include "util.h"
+#include "vt.h"
 
 typedef struct Eek Eek;
 
@@ -21,7 +22,27 @@ struct KeyEvent {
 enum {
 	Keysrcuser, /* Physical user input from the terminal. */
 	Keysrcmap,  /* Injected from :map expansion. */
-	Keysrcdot,  /* Injected from '.' repeat replay. */
+	Keysrcdot,  /* Recorded for '.' repeat replay. */
+	Keysrcmacro, /* Injected from @{reg} macro replay. */
+};
+
+/*
+ * Mapnode is a node of a mode's :map trie, one per LHS prefix. Where a
+ * mapping ends it holds the RHS already decoded to key events, so an
+ * expansion is a block copy into the feed.
+ */
+typedef struct Mapnode Mapnode;
+struct Mapnode {
+	long r;        /* Rune leading here from the parent (unused in the root). */
+	KeyEvent *rhs; /* Events injected for this LHS, or nil if none ends here. */
+	long nrhs;     /* Number of rhs[] events. */
+	Mapnode **kid; /* Children, sorted by r. */
+	long nkid;     /* Number of children. */
+	long capkid;   /* Allocated capacity of kid[] in entries. */
+};
+
+enum {
+	Maplhsmax = 16, /* Longest :map LHS in keys. */
 };
 
 typedef struct Args Args;
@@ -53,6 +74,21 @@ struct Move {
 	MoveFn fn;           /* Implementation function (nil means “handled but no-op”). */
 };
 
+/*
+ * Keymap is a Move table compiled for one mode, so a key finds its entry
+ * without scanning: the entry movematch would pick first, for every ASCII
+ * rune and every other key kind, plus the other runes that have their own
+ * entry (sorted by rune) and the "any rune" entry.
+ */
+typedef struct Keymap Keymap;
+struct Keymap {
+	const Move *ascii[128]; /* Entry for each ASCII rune, or nil. */
+	const Move *kind[Nkey]; /* Entry for each non-rune key kind, or nil. */
+	Move *rune;             /* Entries for non-ASCII runes, sorted by value. */
+	long nrune;             /* Number of rune[] entries. */
+	const Move *anyrune;    /* Entry for other runes (value -1), or nil. */
+};
+
 typedef struct Win Win;
 struct Win {
 	long cx;         /* Cursor x (byte offset within line). */
@@ -91,6 +127,23 @@ enum {
 	Dirright, /* Focus window to the right. */
 };
 
+typedef struct Sel Sel;
+struct Sel {
+	int on;      /* Non-zero if a VISUAL selection is shown. */
+	int block;   /* Non-zero for a block selection (x0/x1 are render columns). */
+	long y0;     /* First selected line. */
+	long y1;     /* Last selected line. */
+	long x0;     /* Char: start byte on y0. Block: left render column. */
+	long x1;     /* Char: end byte on y1 (exclusive). Block: right render column. */
+};
+
+/* Cursor is one of the cursors of a multi-cursor INSERT session. */
+typedef struct Cursor Cursor;
+struct Cursor {
+	long y; /* Line index. */
+	long x; /* Byte offset within the line. */
+};
+
 typedef struct Undo Undo;
 struct Undo {
 	Buf b;       /* Snapshot of the full text buffer. */
@@ -125,6 +178,18 @@ enum {
 	Modeinsert, /* INSERT mode: text entry. */
 	Modecmd,    /* CMD mode: ':' and '/' prompts. */
 	Modevisual, /* VISUAL mode: selection-based operations. */
+	Nmode,
+};
+
+/* NORMAL/VISUAL commands waiting for their next key (Eek.pending). */
+enum {
+	Pendnone,   /* Nothing pending. */
+	Pendop,     /* d, c or y typed (pendop): waiting for a motion. */
+	Pendfind,   /* f, F, t or T typed (pendfind): waiting for the target. */
+	Pendrepl,   /* r typed: waiting for the replacement rune. */
+	Pendinside, /* di or ci typed: waiting for the delimiter. */
+	Pendmacro,  /* q typed: waiting for the register to record. */
+	Pendplay,   /* @ typed (pendcount): waiting for the register to replay. */
 };
 
 /* VISUAL selection kinds. */
@@ -155,34 +220,24 @@ struct Eek {
 	long rowoff;         /* Vertical scroll offset (topmost visible line). */
 	long coloff;         /* Horizontal scroll offset (leftmost visible render column). */
 	long dirty;          /* Non-zero if buffer has unsaved modifications. */
-	long dpending;       /* Pending delete operator ('d' has been typed). */
-	long cpending;       /* Pending change operator ('c' has been typed). */
-	long ypending;       /* Pending yank operator ('y' has been typed). */
+	int pending;         /* What the next key completes (Pendnone, Pendop, ...). */
+	long pendop;         /* Pending operator: 0, 'd', 'c' or 'y'. */
+	long pendfind;       /* Pending find mode: 'f','F','t','T' (Pendfind). */
+	long pendcount;      /* Count for the pending find or replace. */
 	long mark[26];       /* Bookmarks ('a'..'z'): stored cursor line (0-based). */
 	unsigned char markset[26]; /* Non-zero if corresponding mark is set. */
-	long fpending;       /* Pending find-char motion ('f' has been typed). */
-	long fcount;         /* Count for pending find motion (nth occurrence). */
-	long fmode;          /* Pending find mode: 'f','F','t','T'. */
-	long fop;            /* Pending operator for find: 0,'d','c','y'. */
 	long lastfindr;      /* Last successful find target rune. */
 	long lastfindmode;   /* Last successful find mode: 'f','F','t','T'. */
-	long rpending;       /* Pending replace-char command ('r' waiting for a rune). */
-	long rcount;         /* Repeat count for pending replace. */
-	long tipending;      /* Pending text-object modifier (e.g. 'di' waiting for delimiter). */
-	long tiop;           /* Text-object operator that is pending ('d' or 'c'). */
 	long vax;            /* VISUAL anchor x (byte offset). */
 	long vay;            /* VISUAL anchor y (line index). */
 	int vmode;           /* VISUAL selection kind (Visualchar/Visualblock). */
 	long vbrx;           /* VISUAL block anchor render column (virtual). */
 	long vrx;            /* VISUAL block cursor render column (virtual). */
 	long vtipending;     /* VISUAL pending text-object modifier. */
-	int blockins;        /* Non-zero while doing VISUAL block insert (I). */
-	long blocky0;        /* Block insert: first line index (inclusive). */
-	long blocky1;        /* Block insert: last line index (inclusive). */
-	long blockrx0;       /* Block insert: left edge render column. */
-	char *blockbuf;      /* Block insert typed bytes to replicate. */
-	long blockn;         /* Block insert length in bytes. */
-	long blockcap;       /* Block insert capacity in bytes. */
+	Cursor *mc;          /* Multi-cursor INSERT (:cursors, VISUAL block I): all cursors in buffer order. */
+	long nmc;            /* Number of mc[] entries; 0 outside such a session. */
+	long capmc;          /* Allocated capacity of mc[] in entries. */
+	long mcprim;         /* Index in mc[] of the cursor mirrored in cx/cy. */
 	Node *layout;        /* Window layout tree (leaves are windows). */
 	Win *curwin;         /* Active window (mirrored into cx/cy/rowoff/v* fields). */
 	char cmd[256];       /* Command-line buffer (for ':' and '/' prompts). */
@@ -200,27 +255,37 @@ struct Eek {
 	long capundo;        /* Allocated capacity of undo[] in entries. */
 	int undopending;     /* Groups multiple edits into a single undo step (e.g. INSERT session). */
 	int inundo;          /* Non-zero while restoring undo (prevents recursive snapshotting). */
+	int undohold;        /* Set during '.': 1 until its replay snapshots, then 2 (one undo step). */
 	Tab *tab;            /* Tabs (inactive tabs stored here). */
 	long ntab;           /* Number of tabs (tab slots). */
 	long captab;         /* Allocated capacity of tab[] in entries. */
 	long curtab;         /* Active tab index (tab[curtab] slot is empty). */
-	KeyEvent feed[512];  /* Injected key events (for maps/macros). */
-	int feedhead;        /* Index of first valid event in feed[]. */
-	int feedlen;         /* Number of valid events in feed[]. */
-	KeyEvent dotbuf[512]; /* Last change (NORMAL '.') replay buffer. */
-	int dotlen;
-	KeyEvent dotrecbuf[512]; /* Recording buffer for in-progress change. */
-	int dotreclen;
+	KeyEvent *feed;      /* Injected key events (maps, macros, '.'): ring of feedcap. */
+	long feedcap;        /* Allocated capacity of feed[] in events. */
+	long feedhead;       /* Index of first valid event in feed[]. */
+	long feedlen;        /* Number of valid events in feed[]. */
+	KeyEvent *dotbuf;    /* Last change (NORMAL '.'), ready to replay. */
+	long dotlen;         /* Number of dotbuf[] events. */
+	long dotcap;         /* Allocated capacity of dotbuf[] in events. */
+	KeyEvent *dotrecbuf; /* Recording buffer for in-progress change. */
+	long dotreclen;      /* Number of dotrecbuf[] events. */
+	long dotreccap;      /* Allocated capacity of dotrecbuf[] in events. */
 	int dotrec;
 	long dotnundo0;
-	int dotreplayleft;
-	struct {
-		unsigned modes; /* Bitmask of Mode* values this mapping applies to. */
-		long lhs;       /* Left-hand side trigger key (single rune). */
-		char *rhs;      /* Right-hand side UTF-8 string to inject as key events. */
-	} *maps;
-	long nmaps;   /* Number of mappings currently installed. */
-	long capmaps; /* Allocated capacity of maps[] in entries. */
+	KeyEvent *macro[26]; /* q{reg} recordings ('a'..'z'), ready to replay. */
+	long nmacro[26];     /* Number of macro[] events per register. */
+	int macroreg;        /* Register being recorded ('a'..'z'), or 0. */
+	KeyEvent *macrobuf;  /* Keys recorded so far for macroreg. */
+	long macrolen;       /* Number of macrobuf[] events. */
+	long macrocap;       /* Allocated capacity of macrobuf[] in events. */
+	int lastmacro;       /* Register of the last @{reg} (for @@), or 0. */
+	long macroleft;      /* Replayed macro events still in the feed. */
+	Mapnode map[Nmode];  /* :map trie root per mode. */
+	KeyEvent mapheld[Maplhsmax]; /* Keys typed so far of a possible multi-key LHS. */
+	int nmapheld;        /* Number of mapheld[] events. */
+	int mapmode;         /* Mode whose trie mapheld[] walks. */
+	Mapnode *mapat;      /* Trie node reached by mapheld[]. */
+	long maptimer;       /* MAPTIMEOUT timer while keys are held, or 0. */
 };
 
 /* motion.c: UTF-8, word classes, cursor motions, and find motions */
@@ -268,6 +333,7 @@ int delrange(Eek *e, long y0, long x0, long y1, long x1, int yank);
 int insertbytes(Eek *e, const char *s, long n);
 int insertnl(Eek *e);
 void normalfixcursor(Eek *e);
+void bufreplaced(Eek *e);
 
 void vselbounds(Eek *e, long *sy, long *sx, long *ey, long *ex);
 void vselblockbounds(Eek *e, long *y0, long *y1, long *rx0, long *rx1);
@@ -283,6 +349,24 @@ long clamp(long v, long lo, long hi);
  */
 long linelen(Eek *e, long y);
 
+/*
+ * utf8next and utf8prev step over one codepoint of a contiguous line view
+ * s (see linebytes) of n bytes: they return the boundary after at (n at
+ * the end) and before at (0 at the start). nextutf8 and prevutf8 do the
+ * same for line y; loops over a line should fetch the view once and use
+ * these.
+ */
+long utf8next(const char *s, long n, long at);
+long utf8prev(const char *s, long at);
+
+/*
+ * asciirun returns the length of the run of bytes at the start of
+ * s[0..n-1] that are ASCII and not a tab. Each of them is one codepoint
+ * and one column, so callers can step over the run at once. It tests
+ * eight bytes at a time.
+ */
+long asciirun(const char *s, long n);
+
 /*
  * prevutf8 returns the previous UTF-8 codepoint boundary at or before at.
  */
@@ -294,24 +378,36 @@ long prevutf8(Eek *e, long y, long at);
 long nextutf8(Eek *e, long y, long at);
 
 /*
- * isword reports whether c is considered a word character for word motions.
+ * Word classes for w, b, de, iw and *: blanks separate words, and a run of
+ * word characters and a run of punctuation are words of their own.
  */
-int isword(long c);
+enum {
+	Clsblank, /* Space, tab, line breaks, Unicode spaces. */
+	Clsword,  /* Letters, digits, '_', most non-ASCII runes. */
+	Clspunct, /* Other ASCII (control bytes too), Unicode punctuation. */
+};
 
 /*
- * ispunctword reports whether c is considered a punctuation-word character.
+ * wordcls returns the word class of the codepoint at s[at] in s[0..n-1],
+ * blank outside it. ASCII is looked up in a byte table and other runes
+ * in a sorted range table; invalid UTF-8 bytes are word characters.
  */
-int ispunctword(long c);
+int wordcls(const char *s, long n, long at);
 
 /*
- * isws reports whether c is considered whitespace by motions.
+ * wordrun returns the end of the run of codepoints of class cls that
+ * starts at at in s[0..n-1]: the first boundary at or after at whose
+ * class differs, or n. ASCII is classified a byte at a time by table
+ * lookup; only non-ASCII bytes are decoded.
  */
-int isws(long c);
+long wordrun(const char *s, long n, long at, int cls);
 
 /*
- * peekbyte returns the byte value at (y, at) or -1 if out of range.
+ * wordrunback returns the start of the run of codepoints of class cls
+ * that ends at at in s[0..n-1]: at itself if the codepoint before it
+ * differs.
  */
-long peekbyte(Eek *e, long y, long at);
+long wordrunback(const char *s, long n, long at, int cls);
 
 /*
  * movel/mover/moveu/moved/movew/moveb mutate the cursor position according
@@ -334,4 +430,192 @@ void moveb(Eek *e);
 int findfwd(Eek *e, long r, long n);
 int findbwd(Eek *e, long r, long n);
 
+/* cursor.c: multi-cursor INSERT sessions */
+
+/*
+ * cursoradd adds a cursor at (y, x) to the session being set up.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+int cursoradd(Eek *e, long y, long x);
+
+/*
+ * cursorbegin starts a session with the cursors added so far: it sorts
+ * them, makes the first one at or after cx/cy the primary (moving cx/cy
+ * there) and takes the undo snapshot the whole session shares. The caller
+ * enters INSERT mode.
+ *
+ * Returns:
+ *  - 0 on success, -1 if there are no cursors or memory ran out (the
+ *    cursors are dropped).
+ */
+int cursorbegin(Eek *e);
+
+/*
+ * cursorend drops all cursors (INSERT <Esc>, or a buffer replaced).
+ */
+void cursorend(Eek *e);
+
+/*
+ * cursoreach runs the edit fn at every cursor in turn, in buffer order,
+ * with cx/cy set to it, and keeps the cursors after it in place as the
+ * text shifts under them: in one pass, whatever fn inserts or deletes.
+ * fn must only edit at its cursor and leave cx/cy after its edit.
+ *
+ * Returns:
+ *  - 0 on success, -1 if fn failed at some cursor.
+ */
+int cursoreach(Eek *e, int (*fn)(Eek *e, void *arg), void *arg);
+
+/*
+ * cursormove applies the motion move to every cursor. Cursors that meet
+ * become one.
+ */
+void cursormove(Eek *e, void (*move)(Eek *e));
+
+/*
+ * cursorline returns the index of the first cursor on line y or after it
+ * (nmc if none).
+ */
+long cursorline(Eek *e, long y);
+
+/* save.c: atomic writes, in the background for :w */
+
+/*
+ * savebg starts writing a snapshot of e->b to path on a background thread
+ * (temp file, fsync, rename). Editing continues meanwhile; the status
+ * line shows the progress and the result once it is done. A save still
+ * running is finished first.
+ *
+ * Returns:
+ *  - 0 if the save was started.
+ *  - -1 if it could not be (the caller should fall back to savesync).
+ */
+int savebg(Eek *e, const char *path);
+
+/*
+ * savesync writes e->b to path atomically and waits for it.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+int savesync(Eek *e, const char *path);
+
+/*
+ * savetail writes only the part of e->b after its clean prefix, in place,
+ * when path is still the file it was loaded from or saved to and the
+ * tail is no longer than the prefix. Not atomic.
+ *
+ * Returns:
+ *  - 0 on success, -1 if not applicable or on failure (save in full then).
+ */
+int savetail(Eek *e, const char *path);
+
+/*
+ * savewait blocks until the background save (if any) is done and reports
+ * its result through setmsg. A failed save marks the buffer dirty again.
+ */
+void savewait(Eek *e);
+
+/*
+ * savestatus formats " [saving N%]" into buf while a save is running.
+ *
+ * Returns:
+ *  - 1 if a save is running, 0 otherwise (buf is untouched).
+ */
+int savestatus(char *buf, size_t n);
+
+/* load.c: progressive open of big files */
+
+/*
+ * loadstart opens path into e->b progressively when it is a regular file
+ * of at least LOADPROGRESSIVE bytes: it returns once the first screens
+ * are in and a thread streams in the rest, appended by the event loop.
+ *
+ * Returns:
+ *  - 0 if the load was started.
+ *  - -1 otherwise (load the file with bufload).
+ */
+int loadstart(Eek *e, const char *path);
+
+/*
+ * loaddrain appends the lines the loader has read so far (event loop).
+ */
+void loaddrain(Eek *e);
+
+/*
+ * loadwait blocks until the whole file is in e->b. Anything that edits,
+ * saves or looks past the loaded lines calls it first.
+ */
+void loadwait(Eek *e);
+
+/*
+ * loadcancel stops a running load, leaving e->b partly loaded (exit only).
+ */
+void loadcancel(void);
+
+/*
+ * loadstatus formats " [loading N%]" into buf while a load is running.
+ *
+ * Returns:
+ *  - 1 if a load is running, 0 otherwise (buf is untouched).
+ */
+int loadstatus(char *buf, size_t n);
+
+/* follow.c: tail-follow of growing files (:follow, -f) */
+
+/*
+ * followstart makes e->b follow path: bytes appended to the file are
+ * appended to the buffer as they arrive (inotify, or a FOLLOWPOLL timer),
+ * and a truncated or rotated file is read again from the start. A buffer
+ * that is not path's contents is reloaded first. Reports through setmsg.
+ *
+ * Returns:
+ *  - 0 if following, -1 otherwise.
+ */
+int followstart(Eek *e, const char *path);
+
+/*
+ * followstop stops following (:follow off, :e, tab switches, exit).
+ */
+void followstop(void);
+
+/*
+ * followstatus formats " [follow]" into buf while a file is followed.
+ *
+ * Returns:
+ *  - 1 if following, 0 otherwise (buf is untouched).
+ */
+int followstatus(char *buf, size_t n);
+
+/* headless.c: scripted runs against an in-memory screen (--headless) */
+typedef struct HeadlessCmd HeadlessCmd;
+struct HeadlessCmd {
+	long off;        /* Offset of the command's first byte in Headless.keys. */
+	char *text;      /* Script line as written (NUL-terminated). */
+	long nkey;       /* Keys attributed to the command. */
+	long long total; /* Time spent handling those keys (ns). */
+};
+
+typedef struct Headless Headless;
+struct Headless {
+	Vt vt;           /* Screen model receiving all terminal output. */
+	char *keys;      /* Decoded key script (raw terminal input bytes). */
+	long nkeys;      /* Length of keys in bytes. */
+	HeadlessCmd *cmd; /* One entry per non-empty script line. */
+	long ncmd;       /* Number of entries in cmd. */
+	long curcmd;     /* Command owning the key in flight. */
+	long nkey;       /* Keys read so far. */
+	long long t0;    /* Start of the key in flight (ns), or 0. */
+	long long total; /* Time spent handling keys (ns). */
+	long long max;   /* Slowest key (ns). */
+};
+
+void headlessinit(Headless *h, const char *geom, const char *script);
+void headlessbegin(Headless *h);
+void headlessend(Headless *h);
+void headlessdump(Eek *e, Headless *h, FILE *fp);
+void headlessfree(Headless *h);
+
 #endif
@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "util.h"
+
+typedef struct Src Src;
+struct Src {
+	int fd;       /* Watched fd, or -1 once removed. */
+	EvFdFn fn;    /* Readiness callback. */
+	void *arg;    /* Callback argument. */
+};
+
+typedef struct Timer Timer;
+struct Timer {
+	long id;       /* Timer id (0 once cancelled). */
+	long long due; /* Expiry time on the monotonic clock, in ms. */
+	long period;   /* Re-arm interval in ms, or 0 for one-shot. */
+	EvFn fn;       /* Expiry callback. */
+	void *arg;     /* Callback argument. */
+};
+
+typedef struct Post Post;
+struct Post {
+	EvFn fn;   /* Function to run on the loop thread. */
+	void *arg; /* Its argument. */
+};
+
+static int wakefd[2] = { -1, -1 };
+static Src *src;
+static long nsrc;
+static long capsrc;
+static Timer *tmr;
+static long ntmr;
+static long captmr;
+static long lastid;
+static struct pollfd *pfd;
+static long cappfd;
+
+/*
+ * nowms returns the monotonic clock in milliseconds.
+ */
+static long long
+nowms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * cloexec marks fd close-on-exec and optionally non-blocking.
+ */
+static int
+cloexec(int fd, int nonblock)
+{
+	int fl;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+		return -1;
+	if (!nonblock)
+		return 0;
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+int
+evinit(void)
+{
+	if (wakefd[0] >= 0)
+		return 0;
+	if (pipe(wakefd) < 0)
+		return -1;
+	/*
+	 * Posts are fixed-size records well below PIPE_BUF, so concurrent
+	 * writers never interleave. The write end stays blocking: a full
+	 * pipe simply throttles the producer until the loop catches up.
+	 */
+	if (cloexec(wakefd[0], 1) < 0 || cloexec(wakefd[1], 0) < 0) {
+		evfree();
+		return -1;
+	}
+	return 0;
+}
+
+void
+evfree(void)
+{
+	if (wakefd[0] >= 0)
+		(void)close(wakefd[0]);
+	if (wakefd[1] >= 0)
+		(void)close(wakefd[1]);
+	wakefd[0] = wakefd[1] = -1;
+	free(src);
+	src = nil;
+	nsrc = capsrc = 0;
+	free(tmr);
+	tmr = nil;
+	ntmr = captmr = 0;
+	free(pfd);
+	pfd = nil;
+	cappfd = 0;
+}
+
+int
+evaddfd(int fd, EvFdFn fn, void *arg)
+{
+	Src *p;
+	long cap;
+
+	if (fd < 0 || fn == nil)
+		return -1;
+	if (nsrc == capsrc) {
+		cap = capsrc > 0 ? capsrc * 2 : 4;
+		p = realloc(src, (size_t)cap * sizeof src[0]);
+		if (p == nil)
+			return -1;
+		src = p;
+		capsrc = cap;
+	}
+	src[nsrc].fd = fd;
+	src[nsrc].fn = fn;
+	src[nsrc].arg = arg;
+	nsrc++;
+	return 0;
+}
+
+void
+evdelfd(int fd)
+{
+	long i;
+
+	/* Mark only; evwait() compacts so callers may remove from callbacks. */
+	for (i = 0; i < nsrc; i++) {
+		if (src[i].fd == fd)
+			src[i].fd = -1;
+	}
+}
+
+long
+evaddtimer(long ms, long period, EvFn fn, void *arg)
+{
+	Timer *p;
+	long cap;
+
+	if (fn == nil)
+		return -1;
+	if (ntmr == captmr) {
+		cap = captmr > 0 ? captmr * 2 : 4;
+		p = realloc(tmr, (size_t)cap * sizeof tmr[0]);
+		if (p == nil)
+			return -1;
+		tmr = p;
+		captmr = cap;
+	}
+	if (ms < 0)
+		ms = 0;
+	if (period < 0)
+		period = 0;
+	tmr[ntmr].id = ++lastid;
+	tmr[ntmr].due = nowms() + ms;
+	tmr[ntmr].period = period;
+	tmr[ntmr].fn = fn;
+	tmr[ntmr].arg = arg;
+	ntmr++;
+	return lastid;
+}
+
+void
+evdeltimer(long id)
+{
+	long i;
+
+	if (id <= 0)
+		return;
+	for (i = 0; i < ntmr; i++) {
+		if (tmr[i].id == id)
+			tmr[i].id = 0;
+	}
+}
+
+int
+evpost(EvFn fn, void *arg)
+{
+	Post p;
+	ssize_t w;
+
+	if (wakefd[1] < 0 || fn == nil)
+		return -1;
+	p.fn = fn;
+	p.arg = arg;
+	for (;;) {
+		w = write(wakefd[1], &p, sizeof p);
+		if (w == (ssize_t)sizeof p)
+			return 0;
+		if (w < 0 && errno == EINTR)
+			continue;
+		return -1;
+	}
+}
+
+/*
+ * compact drops removed fd sources and cancelled timers.
+ */
+static void
+compact(void)
+{
+	long i, j;
+
+	for (i = j = 0; i < nsrc; i++) {
+		if (src[i].fd >= 0)
+			src[j++] = src[i];
+	}
+	nsrc = j;
+	for (i = j = 0; i < ntmr; i++) {
+		if (tmr[i].id != 0)
+			tmr[j++] = tmr[i];
+	}
+	ntmr = j;
+}
+
+/*
+ * runposts drains the wakeup pipe and runs every queued post.
+ */
+static void
+runposts(void)
+{
+	Post p[64];
+	ssize_t r;
+	long i, n;
+
+	for (;;) {
+		r = read(wakefd[0], p, sizeof p);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return;
+		n = (long)((size_t)r / sizeof p[0]);
+		for (i = 0; i < n; i++)
+			p[i].fn(p[i].arg);
+		if ((size_t)r < sizeof p)
+			return;
+	}
+}
+
+/*
+ * runtimers fires all timers due at now.
+ *
+ * Returns:
+ *  - number of callbacks run.
+ */
+static long
+runtimers(long long now)
+{
+	long i, n, fired;
+	EvFn fn;
+	void *arg;
+
+	fired = 0;
+	/* Timers armed by callbacks wait for the next round. */
+	n = ntmr;
+	for (i = 0; i < n; i++) {
+		if (tmr[i].id == 0 || tmr[i].due > now)
+			continue;
+		fn = tmr[i].fn;
+		arg = tmr[i].arg;
+		if (tmr[i].period > 0) {
+			tmr[i].due += tmr[i].period;
+			if (tmr[i].due <= now)
+				tmr[i].due = now + tmr[i].period;
+		} else {
+			tmr[i].id = 0;
+		}
+		fn(arg);
+		fired++;
+	}
+	return fired;
+}
+
+int
+evwait(int fd, long ms)
+{
+	struct pollfd *p;
+	long long now, due;
+	long i, n, nfd;
+	int timeout;
+	int r;
+
+	compact();
+	nfd = nsrc + 2;
+	if (nfd > cappfd) {
+		p = realloc(pfd, (size_t)nfd * sizeof pfd[0]);
+		if (p == nil)
+			die("Out of memory");
+		pfd = p;
+		cappfd = nfd;
+	}
+
+	n = 0;
+	pfd[n].fd = fd;
+	pfd[n].events = POLLIN;
+	pfd[n].revents = 0;
+	n++;
+	pfd[n].fd = wakefd[0];
+	pfd[n].events = POLLIN;
+	pfd[n].revents = 0;
+	n++;
+	for (i = 0; i < nsrc; i++) {
+		pfd[n].fd = src[i].fd;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+
+	now = nowms();
+	due = ms >= 0 ? now + ms : -1;
+	for (i = 0; i < ntmr; i++) {
+		if (tmr[i].id != 0 && (due < 0 || tmr[i].due < due))
+			due = tmr[i].due;
+	}
+	timeout = -1;
+	if (due >= 0)
+		timeout = due > now ? (int)(due - now) : 0;
+
+	for (;;) {
+		/* poll(2) ignores negative fds, so a missing fd/pipe is harmless. */
+		r = poll(pfd, (nfds_t)n, timeout);
+		if (r >= 0)
+			break;
+		if (errno == EINTR)
+			return 0;
+		die("poll: %s", strerror(errno));
+	}
+
+	if (pfd[1].revents != 0)
+		runposts();
+	for (i = 2; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		/* Look up by index; the callback may have removed the source. */
+		if (src[i - 2].fd == pfd[i].fd)
+			src[i - 2].fn(pfd[i].fd, pfd[i].revents, src[i - 2].arg);
+	}
+	(void)runtimers(nowms());
+
+	if (fd >= 0 && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+		return 1;
+	return 0;
+}
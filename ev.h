@@ -0,0 +1,90 @@
+#ifndef EV_H
+#define EV_H
+
+/*
+ * Event loop
+ *
+ * A small poll(2) based loop. Subsystems register fd sources and timers;
+ * background threads hand work back to the main thread with evpost().
+ * Callbacks always run on the thread that calls evwait().
+ */
+
+typedef void (*EvFn)(void *arg);
+typedef void (*EvFdFn)(int fd, int revents, void *arg);
+
+/*
+ * evinit sets up the event loop (wakeup pipe and empty source lists).
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+int evinit(void);
+
+/*
+ * evfree releases all event loop resources. Registered fds are not closed.
+ */
+void evfree(void);
+
+/*
+ * evaddfd registers fn to be called whenever fd becomes readable.
+ *
+ * Parameters:
+ *  - fd: file descriptor to watch.
+ *  - fn: callback (receives fd, poll revents and arg).
+ *  - arg: opaque callback argument.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+int evaddfd(int fd, EvFdFn fn, void *arg);
+
+/*
+ * evdelfd unregisters fd. Safe to call from within a callback.
+ */
+void evdelfd(int fd);
+
+/*
+ * evaddtimer arms a timer that calls fn after ms milliseconds.
+ *
+ * Parameters:
+ *  - ms: delay until the first expiry.
+ *  - period: re-arm interval in milliseconds, or 0 for a one-shot timer.
+ *  - fn: callback.
+ *  - arg: opaque callback argument.
+ *
+ * Returns:
+ *  - a positive timer id, or -1 on allocation failure.
+ */
+long evaddtimer(long ms, long period, EvFn fn, void *arg);
+
+/*
+ * evdeltimer cancels timer id. Safe to call from within a callback.
+ */
+void evdeltimer(long id);
+
+/*
+ * evpost queues fn(arg) to run on the event loop thread.
+ * This is the only event loop function that may be called from other
+ * threads; it never touches editor state.
+ *
+ * Returns:
+ *  - 0 on success, -1 if the loop is not initialized or the write failed.
+ */
+int evpost(EvFn fn, void *arg);
+
+/*
+ * evwait blocks until fd is readable, a source fires, or ms elapses.
+ * Callbacks for fired sources, expired timers and posted work are run
+ * before returning.
+ *
+ * Parameters:
+ *  - fd: primary input fd (usually the terminal), or -1 for none.
+ *  - ms: timeout in milliseconds, or -1 to wait indefinitely.
+ *
+ * Returns:
+ *  - 1 if fd is readable.
+ *  - 0 if something else woke the loop (caller should redraw) or on timeout.
+ */
+int evwait(int fd, long ms);
+
+#endif /* EV_H */
@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "eek_internal.h"
+#include "ev.h"
+
+enum {
+	Followblock = 1 << 20, /* Most bytes read per read(2). */
+};
+
+/*
+ * Tail-follow: the buffer mirrors a file that grows at the end; new bytes
+ * are appended as they arrive. Only one file is followed at a time.
+ */
+typedef struct Follow Follow;
+struct Follow {
+	Eek *e;                 /* Editor whose buffer mirrors the file. */
+	char *path;             /* File followed (by name, across rotations). */
+	int fd;                 /* The file currently open. */
+	unsigned long long dev; /* Its device. */
+	unsigned long long ino; /* Its inode. */
+	unsigned long long off; /* Bytes of it already in the buffer. */
+	int part;               /* Non-zero if the last line has no newline yet. */
+	BufStamp seen;          /* e->b.disk when last synced (saves move it). */
+	const char *base;       /* Last component of path. */
+	int ifd;                /* inotify instance on its directory, or -1. */
+	long timer;             /* Poll timer, or 0. */
+};
+
+static Follow *fw;
+
+/*
+ * openline tells whether the byte before off in fd is not a newline, that
+ * is whether the last line read so far is still open. An empty file reads
+ * into bufinit's empty line, which counts as open.
+ */
+static int
+openline(int fd, unsigned long long off)
+{
+	char c;
+
+	if (off == 0)
+		return 1;
+	if (pread(fd, &c, 1, (off_t)(off - 1)) != 1)
+		return 0;
+	return c != '\n';
+}
+
+/*
+ * reopen switches f to the file now at f->path.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set; f is unchanged).
+ */
+static int
+reopen(Follow *f)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(f->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		(void)close(fd);
+		return -1;
+	}
+	(void)close(f->fd);
+	f->fd = fd;
+	f->dev = (unsigned long long)st.st_dev;
+	f->ino = (unsigned long long)st.st_ino;
+	return 0;
+}
+
+/*
+ * readnew appends the bytes of f's file past f->off to the buffer. If the
+ * buffer's disk stamp is this file it moves along, so :w still writes
+ * only what was edited. A cursor on the last line stays on the last line.
+ */
+static void
+readnew(Follow *f)
+{
+	Eek *e;
+	BufStamp st;
+	char *buf;
+	size_t want;
+	ssize_t r;
+	int tail;
+
+	e = f->e;
+	/* Read up to the size seen here, so the stamp matches what was read. */
+	if (bufstamp(f->fd, &st) < 0 || st.size <= f->off)
+		return;
+	want = st.size - f->off < (unsigned long long)Followblock ? (size_t)(st.size - f->off) : Followblock;
+	buf = malloc(want);
+	if (buf == nil) {
+		setmsg(e, "Out of memory");
+		return;
+	}
+	tail = e->mode == Modenormal && e->cy == lsz(e->b.nline) - 1;
+	while (f->off < st.size) {
+		if (st.size - f->off < want)
+			want = (size_t)(st.size - f->off);
+		r = pread(f->fd, buf, want, (off_t)f->off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		if (bufappendbytes(&e->b, buf, (size_t)r, &f->part) < 0) {
+			setmsg(e, "Out of memory");
+			break;
+		}
+		f->off += (size_t)r;
+	}
+	free(buf);
+	/* The clean prefix grew with the file; it means nothing for another. */
+	if (e->b.disk.ino == f->ino && e->b.disk.dev == f->dev && f->off == st.size)
+		e->b.disk = st;
+	else
+		bufmarkclean(&e->b, nil);
+	f->seen = e->b.disk;
+	if (tail) {
+		e->cy = lsz(e->b.nline) - 1;
+		e->cx = 0;
+		normalfixcursor(e);
+	}
+}
+
+/*
+ * reload replaces the buffer with the file now at f->path, after it was
+ * truncated or replaced. A modified buffer is kept and following stops.
+ */
+static void
+reload(Follow *f)
+{
+	Eek *e;
+	BufStamp st;
+
+	e = f->e;
+	if (e->dirty) {
+		setmsg(e, "No write since last change; not following %s", f->path);
+		followstop();
+		return;
+	}
+	if (reopen(f) < 0 || bufstamp(f->fd, &st) < 0) {
+		setmsg(e, "%s: %s; not following", f->path, strerror(errno));
+		followstop();
+		return;
+	}
+	buffree(&e->b);
+	bufinit(&e->b);
+	bufreplaced(e);
+	/* The buffer is the file's first 0 bytes; readnew stamps the rest. */
+	st.size = 0;
+	e->b.disk = st;
+	f->off = 0;
+	f->part = 1;
+	readnew(f);
+}
+
+/*
+ * check brings the buffer up to date with the file: it appends what was
+ * added, and reloads after a truncation or when another file took the
+ * name (log rotation). The buffer's own saves are recognised by its disk
+ * stamp and only move the offset.
+ */
+static void
+check(Follow *f)
+{
+	Eek *e;
+	struct stat st;
+	char sbuf[32];
+
+	e = f->e;
+	/* A save in progress renames over the file; look once it is done. */
+	if (savestatus(sbuf, sizeof sbuf))
+		return;
+	if (e->b.disk.ino != 0 && memcmp(&e->b.disk, &f->seen, sizeof f->seen) != 0) {
+		/* Written since: if to path, the file is the buffer up to disk.size. */
+		f->seen = e->b.disk;
+		if (stat(f->path, &st) == 0 && (unsigned long long)st.st_ino == e->b.disk.ino &&
+		    (unsigned long long)st.st_dev == e->b.disk.dev) {
+			if ((st.st_ino != f->ino || st.st_dev != f->dev) && reopen(f) < 0)
+				return;
+			f->off = e->b.disk.size;
+			f->part = openline(f->fd, f->off);
+		}
+	}
+	if (stat(f->path, &st) < 0) {
+		/* Moved away and not recreated yet: keep reading the old file. */
+		readnew(f);
+		return;
+	}
+	if ((unsigned long long)st.st_ino != f->ino || (unsigned long long)st.st_dev != f->dev ||
+	    (unsigned long long)st.st_size < f->off)
+		reload(f);
+	else
+		readnew(f);
+}
+
+#ifdef __linux__
+/*
+ * onnotify is the event loop callback for the inotify descriptor.
+ */
+static void
+onnotify(int fd, int revents, void *arg)
+{
+	union {
+		struct inotify_event ev;
+		char b[4096];
+	} u;
+	struct inotify_event *ev;
+	ssize_t r, i;
+	int hit;
+
+	(void)revents;
+	(void)arg;
+	/* Events only say "look again" (check works out what happened). */
+	hit = 0;
+	while ((r = read(fd, u.b, sizeof u.b)) > 0) {
+		for (i = 0; i < r; i += (ssize_t)(sizeof *ev + ev->len)) {
+			ev = (struct inotify_event *)(u.b + i);
+			if (fw != nil && ev->len > 0 && strcmp(ev->name, fw->base) == 0)
+				hit = 1;
+		}
+	}
+	if (hit && fw != nil)
+		check(fw);
+}
+#endif
+
+/*
+ * ontimer polls the file where inotify is not available.
+ */
+static void
+ontimer(void *arg)
+{
+	(void)arg;
+	if (fw != nil)
+		check(fw);
+}
+
+/*
+ * watch arranges for check to run when the file may have changed:
+ * inotify on its directory, which sees writes as well as new files
+ * taking the name (rotation, saves), or else a FOLLOWPOLL timer.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure.
+ */
+static int
+watch(Follow *f)
+{
+#ifdef __linux__
+	char dir[PATH_MAX];
+	const char *slash;
+
+	f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (f->ifd >= 0) {
+		slash = strrchr(f->path, '/');
+		if (slash == nil)
+			strcpy(dir, ".");
+		else if (slash == f->path)
+			strcpy(dir, "/");
+		else if ((size_t)(slash - f->path) < sizeof dir)
+			snprintf(dir, sizeof dir, "%.*s", (int)(slash - f->path), f->path);
+		else
+			dir[0] = 0;
+		if (dir[0] != 0 &&
+		    inotify_add_watch(f->ifd, dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) >= 0 &&
+		    evaddfd(f->ifd, onnotify, nil) == 0)
+			return 0;
+		(void)close(f->ifd);
+	}
+#endif
+	f->ifd = -1;
+	f->timer = evaddtimer(FOLLOWPOLL, FOLLOWPOLL, ontimer, nil);
+	return f->timer < 0 ? -1 : 0;
+}
+
+int
+followstart(Eek *e, const char *path)
+{
+	Follow *f;
+	struct stat st;
+	char real[PATH_MAX];
+	int fd;
+
+	loadwait(e);
+	savewait(e);
+	followstop();
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		setmsg(e, "follow: %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			(void)close(fd);
+		return -1;
+	}
+	f = calloc(1, sizeof *f);
+	if (f != nil)
+		f->path = strdup(realpath(path, real) != nil ? real : path);
+	if (f == nil || f->path == nil) {
+		if (f != nil)
+			free(f);
+		(void)close(fd);
+		setmsg(e, "Out of memory");
+		return -1;
+	}
+	f->base = strrchr(f->path, '/') != nil ? strrchr(f->path, '/') + 1 : f->path;
+	f->e = e;
+	f->fd = fd;
+	f->dev = (unsigned long long)st.st_dev;
+	f->ino = (unsigned long long)st.st_ino;
+	if (watch(f) < 0) {
+		(void)close(fd);
+		free(f->path);
+		free(f);
+		setmsg(e, "Out of memory");
+		return -1;
+	}
+	fw = f;
+
+	if (e->b.disk.ino == f->ino && e->b.disk.dev == f->dev) {
+		/* Loaded from (or saved to) this file: go on from there. */
+		f->off = e->b.disk.size;
+		f->part = openline(fd, f->off);
+		f->seen = e->b.disk;
+		check(f);
+	} else {
+		/* The buffer is not this file (yet): start over from it. */
+		reload(f);
+	}
+	if (fw != nil)
+		setmsg(e, "Following %s", path);
+	return fw != nil ? 0 : -1;
+}
+
+void
+followstop(void)
+{
+	Follow *f;
+
+	f = fw;
+	if (f == nil)
+		return;
+	fw = nil;
+	if (f->ifd >= 0) {
+		evdelfd(f->ifd);
+		(void)close(f->ifd);
+	}
+	if (f->timer > 0)
+		evdeltimer(f->timer);
+	(void)close(f->fd);
+	free(f->path);
+	free(f);
+}
+
+int
+followstatus(char *buf, size_t n)
+{
+	if (fw == nil)
+		return 0;
+	snprintf(buf, n, " [follow]");
+	return 1;
+}
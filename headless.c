@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "eek_internal.h"
+
+/* Names accepted inside <...> in key scripts. */
+static const struct {
+	const char *name;  /* Key name (case-insensitive). */
+	const char *bytes; /* Terminal bytes the key sends. */
+} keynames[] = {
+	{ "Esc", "\x1b" },
+	{ "CR", "\r" },
+	{ "Enter", "\r" },
+	{ "BS", "\x7f" },
+	{ "Tab", "\t" },
+	{ "Space", " " },
+	{ "lt", "<" },
+	{ "Up", "\x1b[A" },
+	{ "Down", "\x1b[B" },
+	{ "Right", "\x1b[C" },
+	{ "Left", "\x1b[D" },
+	{ "Home", "\x1b[H" },
+	{ "End", "\x1b[F" },
+};
+
+/*
+ * nowns returns the monotonic clock in nanoseconds.
+ */
+static long long
+nowns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * keyname decodes the <...> token at s[0..n-1] (without the brackets).
+ *
+ * Parameters:
+ *  - s: token text.
+ *  - n: token length.
+ *  - out: output buffer (at least 8 bytes).
+ *
+ * Returns:
+ *  - number of bytes written to out, or 0 if the token is unknown.
+ */
+static long
+keyname(const char *s, long n, char *out)
+{
+	size_t i;
+	long k;
+
+	if (n == 3 && (s[0] == 'C' || s[0] == 'c') && s[1] == '-') {
+		out[0] = (char)(s[2] & 0x1f);
+		return 1;
+	}
+	for (i = 0; i < sizeof keynames / sizeof keynames[0]; i++) {
+		if ((long)strlen(keynames[i].name) != n)
+			continue;
+		if (strncasecmp(keynames[i].name, s, (size_t)n) != 0)
+			continue;
+		k = (long)strlen(keynames[i].bytes);
+		memcpy(out, keynames[i].bytes, (size_t)k);
+		return k;
+	}
+	return 0;
+}
+
+/*
+ * addcmd records a script line starting at decoded offset off.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+static int
+addcmd(Headless *h, long *cap, long off, const char *s, long n)
+{
+	HeadlessCmd *p;
+	long c;
+
+	if (h->ncmd == *cap) {
+		c = *cap > 0 ? *cap * 2 : 64;
+		p = realloc(h->cmd, (size_t)c * sizeof h->cmd[0]);
+		if (p == nil)
+			return -1;
+		h->cmd = p;
+		*cap = c;
+	}
+	if (n > 0 && s[n - 1] == '\r')
+		n--;
+	p = &h->cmd[h->ncmd];
+	memset(p, 0, sizeof *p);
+	p->off = off;
+	p->text = malloc((size_t)n + 1);
+	if (p->text == nil)
+		return -1;
+	memcpy(p->text, s, (size_t)n);
+	p->text[n] = 0;
+	h->ncmd++;
+	return 0;
+}
+
+/*
+ * keyscript decodes a key script into raw terminal input bytes.
+ *
+ * Scripts are plain text typed as-is, except that newlines are ignored
+ * (so a script can hold one command per line) and <Name> stands for a
+ * special key: <Esc>, <CR>, <BS>, <Tab>, <Space>, <Up>, <C-x>, <lt>, ...
+ * Every non-empty line is also recorded as a command for per-command
+ * timing.
+ *
+ * Parameters:
+ *  - h: headless state; keys, nkeys and cmd are filled in.
+ *  - s: script text.
+ *  - n: script length.
+ *
+ * Returns:
+ *  - 0 on success, -1 on allocation failure.
+ */
+static int
+keyscript(Headless *h, const char *s, long n)
+{
+	char *out;
+	char tmp[8];
+	const char *gt;
+	long i, o, k, bol, cap;
+
+	/* Decoding never grows the script: every token shrinks or stays. */
+	out = malloc((size_t)n + 1);
+	if (out == nil)
+		return -1;
+	h->keys = out;
+	cap = 0;
+	bol = 0;
+	for (i = o = 0; i < n; i++) {
+		if (s[i] == '\n') {
+			bol = i + 1;
+			continue;
+		}
+		if (i == bol) {
+			gt = memchr(s + i, '\n', (size_t)(n - i));
+			if (addcmd(h, &cap, o, s + i, gt != nil ? gt - (s + i) : n - i) < 0)
+				return -1;
+		}
+		if (s[i] == '<') {
+			gt = memchr(s + i + 1, '>', (size_t)(n - i - 1));
+			if (gt != nil && gt - (s + i) <= 16) {
+				k = keyname(s + i + 1, gt - (s + i) - 1, tmp);
+				if (k > 0 && k <= gt - (s + i) + 1) {
+					memcpy(out + o, tmp, (size_t)k);
+					o += k;
+					i = gt - s;
+					continue;
+				}
+			}
+		}
+		out[o++] = s[i];
+	}
+	h->nkeys = o;
+	return 0;
+}
+
+/*
+ * headlessinit prepares a headless run: a cols x rows screen model and the
+ * decoded key script. Errors are fatal (this runs during startup).
+ *
+ * Parameters:
+ *  - h: headless state to initialize.
+ *  - geom: screen size as "WxH".
+ *  - script: path of the key script.
+ */
+void
+headlessinit(Headless *h, const char *geom, const char *script)
+{
+	FILE *fp;
+	char *s;
+	char *end;
+	long w, ht;
+	long n, cap;
+	size_t r;
+
+	memset(h, 0, sizeof *h);
+	w = strtol(geom, &end, 10);
+	if (end == geom || (*end != 'x' && *end != 'X'))
+		die("eek: bad --headless size '%s' (want WxH)", geom);
+	ht = strtol(end + 1, &end, 10);
+	if (*end != 0 || vtinit(&h->vt, (int)ht, (int)w) < 0)
+		die("eek: bad --headless size '%s' (want WxH)", geom);
+
+	fp = fopen(script, "rb");
+	if (fp == nil)
+		die("eek: %s: %s", script, strerror(errno));
+	s = nil;
+	n = cap = 0;
+	for (;;) {
+		if (n == cap) {
+			cap = cap > 0 ? cap * 2 : 4096;
+			s = realloc(s, (size_t)cap);
+			if (s == nil)
+				die("Out of memory");
+		}
+		r = fread(s + n, 1, (size_t)(cap - n), fp);
+		if (r == 0)
+			break;
+		n += (long)r;
+	}
+	if (ferror(fp))
+		die("eek: %s: read error", script);
+	fclose(fp);
+	if (keyscript(h, s, n) < 0)
+		die("Out of memory");
+	free(s);
+}
+
+/*
+ * headlessbegin starts timing a key that was just read.
+ */
+void
+headlessbegin(Headless *h)
+{
+	long off;
+
+	h->t0 = nowns();
+	h->nkey++;
+	/* The key just decoded ends at off, so it starts before it. */
+	off = keyinputoff();
+	while (h->curcmd + 1 < h->ncmd && h->cmd[h->curcmd + 1].off < off)
+		h->curcmd++;
+	if (h->ncmd > 0)
+		h->cmd[h->curcmd].nkey++;
+}
+
+/*
+ * headlessend stops timing the key in flight, if any. The main loop calls
+ * it before blocking for the next key, so the time covers dispatch, any
+ * injected events and the redraw.
+ */
+void
+headlessend(Headless *h)
+{
+	long long d;
+
+	if (h->t0 == 0)
+		return;
+	d = nowns() - h->t0;
+	h->t0 = 0;
+	h->total += d;
+	if (d > h->max)
+		h->max = d;
+	if (h->ncmd > 0)
+		h->cmd[h->curcmd].total += d;
+}
+
+/*
+ * headlessdump prints the final screen, the buffer and run statistics,
+ * followed by one "cmd" line per script line.
+ *
+ * Parameters:
+ *  - e: editor state.
+ *  - h: headless state.
+ *  - fp: output stream.
+ */
+void
+headlessdump(Eek *e, Headless *h, FILE *fp)
+{
+	Line *l;
+	long y, i;
+
+	headlessend(h);
+	fprintf(fp, "screen %dx%d cursor %d,%d\n", h->vt.cols, h->vt.rows,
+		h->vt.cy + 1, h->vt.cx + 1);
+	vtdump(&h->vt, fp);
+	fprintf(fp, "buffer %ld lines\n", lsz(e->b.nline));
+	for (y = 0; y < lsz(e->b.nline); y++) {
+		l = bufgetline(&e->b, y);
+		if (l != nil && l->n > 0)
+			fwrite(linebytes(l), 1, l->n, fp);
+		fputc('\n', fp);
+	}
+	fprintf(fp, "stats keys=%ld frames=%ld bytes=%lld total_us=%lld mean_us=%lld max_us=%lld\n",
+		h->nkey, h->vt.nframes, h->vt.nbytes, h->total / 1000,
+		h->nkey > 0 ? h->total / 1000 / h->nkey : 0, h->max / 1000);
+	for (i = 0; i < h->ncmd; i++)
+		fprintf(fp, "cmd %ld keys=%ld us=%lld %s\n", i + 1, h->cmd[i].nkey,
+			h->cmd[i].total / 1000, h->cmd[i].text);
+}
+
+/*
+ * headlessfree releases headless state.
+ */
+void
+headlessfree(Headless *h)
+{
+	long i;
+
+	keysetinput(nil, 0);
+	free(h->keys);
+	h->keys = nil;
+	for (i = 0; i < h->ncmd; i++)
+		free(h->cmd[i].text);
+	free(h->cmd);
+	h->cmd = nil;
+	h->ncmd = 0;
+	vtfree(&h->vt);
+}
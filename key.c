@@ -8,6 +8,9 @@
 
 static unsigned char pushbuf[8];
 static int pushn;
+static const unsigned char *inbuf; /* Scripted input replacing the fd, or nil. */
+static long inlen;
+static long inoff;
 
 /*
  * readbyte reads one byte from fd (or from the internal pushback buffer).
@@ -29,6 +32,12 @@ readbyte(int fd, unsigned char *b)
 		*b = pushbuf[--pushn];
 		return 0;
 	}
+	if (inbuf != nil) {
+		if (inoff >= inlen)
+			return -1;
+		*b = inbuf[inoff++];
+		return 0;
+	}
 
 	for (;;) {
 		n = read(fd, b, 1);
@@ -87,9 +96,10 @@ readbyte_timeout(int fd, unsigned char *b, int timeoutms)
 	 * Without a short timeout, reading ESC would block waiting for the next
 	 * byte of a sequence and a lone Esc could appear to require a second key
 	 * press before it takes effect (e.g. Insert->Normal mode switch).
+	 * Scripted input is all available up front, so it never waits.
 	 */
 
-	for (;;) {
+	for (; inbuf == nil && pushn == 0; ) {
 		FD_ZERO(&rfds);
 		FD_SET(fd, &rfds);
 		tv.tv_sec = timeoutms / 1000;
@@ -228,3 +238,50 @@ keyread(Term *t, Key *k)
 	k->value = r;
 	return 0;
 }
+
+/*
+ * keypending reports whether pushed-back bytes are waiting to be decoded.
+ *
+ * Parameters:
+ *  - t: terminal state (unused).
+ *
+ * Returns:
+ *  - non-zero if keyread would not block.
+ */
+int
+keypending(Term *t)
+{
+	(void)t;
+	return pushn > 0 || inbuf != nil;
+}
+
+/*
+ * keysetinput makes keyread decode s[0..n-1] instead of reading the
+ * terminal; keyread reports EOF once it is consumed.
+ *
+ * Parameters:
+ *  - s: input bytes (must outlive all keyread calls).
+ *  - n: length of s.
+ */
+void
+keysetinput(const char *s, long n)
+{
+	inbuf = (const unsigned char *)s;
+	inlen = n;
+	inoff = 0;
+}
+
+/*
+ * keyinputoff returns the scripted input offset of the next undecoded
+ * byte.
+ *
+ * Returns:
+ *  - offset into the keysetinput buffer.
+ */
+long
+keyinputoff(void)
+{
+	if (inbuf == nil)
+		return 0;
+	return inoff - pushn;
+}
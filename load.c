@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eek_internal.h"
+#include "ev.h"
+
+enum {
+	Loadfirst = 256 << 10, /* Bytes read for the first batch (the first screens). */
+	Loadblock = 16 << 20,  /* Bytes per read(2) after that (and per batch). */
+};
+
+/* Lines built by the loader thread, waiting to be appended. */
+typedef struct Loadbatch Loadbatch;
+struct Loadbatch {
+	Line *line;      /* Lines (storage from malloc, not yet counted). */
+	size_t n;        /* Number of lines. */
+	Loadbatch *next; /* Next batch in file order. */
+};
+
+/*
+ * A progressive open: a thread reads the file and hands over batches of
+ * lines, which the loop appends to e->b. Only one runs at a time.
+ */
+typedef struct Loadjob Loadjob;
+struct Loadjob {
+	Eek *e;               /* Editor whose buffer receives the lines. */
+	int fd;               /* File being read. */
+	size_t size;          /* Its size when opened. */
+	pthread_t thr;        /* Reader thread. */
+	pthread_mutex_t mu;   /* Guards everything below. */
+	pthread_cond_t cv;    /* Signalled when a batch is queued or the thread ends. */
+	Loadbatch *head;      /* Queued batches. */
+	Loadbatch *tail;      /* Last queued batch. */
+	size_t done;          /* Bytes read so far. */
+	int finished;         /* Non-zero once the thread is done. */
+	int cancel;           /* Set to make the thread stop early. */
+	int err;              /* errno of a failure, or 0. */
+	size_t clean;         /* Leading lines stored as "text\n". */
+	size_t cleanoff;      /* Their bytes. */
+	BufStamp stamp;       /* The file, once read. */
+	int first;            /* Non-zero until the first batch is appended. */
+};
+
+static Loadjob *job;
+
+/*
+ * batchfree releases a batch that was never appended.
+ */
+static void
+batchfree(Loadbatch *bt)
+{
+	size_t i;
+
+	for (i = 0; i < bt->n; i++)
+		free(bt->line[i].s);
+	free(bt->line);
+	free(bt);
+}
+
+/*
+ * loadwake runs on the loop thread whenever the reader queued a batch or
+ * finished; it appends what is there.
+ */
+static void
+loadwake(void *arg)
+{
+	(void)arg;
+	if (job != nil)
+		loaddrain(job->e);
+}
+
+/*
+ * push queues bt and wakes the loop if the queue was empty.
+ *
+ * Returns:
+ *  - 0, or -1 if the load was cancelled (bt is freed).
+ */
+static int
+push(Loadjob *j, Loadbatch *bt, size_t done)
+{
+	int wake, cancel;
+
+	pthread_mutex_lock(&j->mu);
+	cancel = j->cancel;
+	wake = 0;
+	if (!cancel) {
+		wake = j->head == nil;
+		bt->next = nil;
+		if (j->tail != nil)
+			j->tail->next = bt;
+		else
+			j->head = bt;
+		j->tail = bt;
+		j->done = done;
+		pthread_cond_signal(&j->cv);
+	}
+	pthread_mutex_unlock(&j->mu);
+	if (cancel) {
+		batchfree(bt);
+		return -1;
+	}
+	if (wake)
+		(void)evpost(loadwake, nil);
+	return 0;
+}
+
+/*
+ * loadthread is the reader: it queues the complete lines of every block
+ * read as one batch, so the first screens are there after the first
+ * Loadfirst bytes. Each block is split into lines by several threads
+ * (bufloadlines), as bufload does for big files.
+ */
+static void *
+loadthread(void *arg)
+{
+	Loadjob *j;
+	Loadbatch *bt;
+	char *buf, *nb;
+	size_t cap, have, want, span, done, clean, cleanoff, bclean, bcleanoff;
+	ssize_t r;
+	int err, dirty, eof;
+
+	j = arg;
+	buf = nil;
+	cap = 0;
+	have = 0;
+	done = 0;
+	clean = 0;
+	cleanoff = 0;
+	dirty = 0;
+	err = 0;
+	want = Loadfirst;
+	for (eof = 0; !eof;) {
+		if (cap - have < want) {
+			nb = realloc(buf, have + want);
+			if (nb == nil) {
+				err = ENOMEM;
+				break;
+			}
+			buf = nb;
+			cap = have + want;
+		}
+		r = read(j->fd, buf + have, want);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		eof = r == 0;
+		have += (size_t)r;
+		done += (size_t)r;
+		want = Loadblock;
+
+		/*
+		 * Complete lines; at EOF the rest is a last line without newline.
+		 * The bytes kept from the last block hold no newline, so only the
+		 * new ones are searched.
+		 */
+		span = have;
+		if (!eof) {
+			for (; span > have - (size_t)r && buf[span - 1] != '\n'; span--)
+				;
+			if (span == have - (size_t)r)
+				span = 0;
+		}
+		if (span == 0)
+			continue;
+		bt = calloc(1, sizeof *bt);
+		if (bt == nil) {
+			err = ENOMEM;
+			break;
+		}
+		if (bufloadlines(buf, span, &bt->line, &bt->n, &bclean, &bcleanoff) < 0) {
+			free(bt);
+			err = ENOMEM;
+			break;
+		}
+		if (!dirty) {
+			clean += bclean;
+			cleanoff += bcleanoff;
+			dirty = bclean < bt->n;
+		}
+		have -= span;
+		memmove(buf, buf + span, have);
+		if (push(j, bt, done) < 0) {
+			err = ECANCELED;
+			break;
+		}
+	}
+	free(buf);
+
+	pthread_mutex_lock(&j->mu);
+	j->finished = 1;
+	j->err = err;
+	j->done = done;
+	j->clean = clean;
+	j->cleanoff = cleanoff;
+	if (err == 0 && bufstamp(j->fd, &j->stamp) < 0)
+		memset(&j->stamp, 0, sizeof j->stamp);
+	pthread_cond_signal(&j->cv);
+	pthread_mutex_unlock(&j->mu);
+	(void)evpost(loadwake, nil);
+	return nil;
+}
+
+/*
+ * loadfinish joins the reader and releases the job.
+ */
+static void
+loadfinish(Loadjob *j)
+{
+	Loadbatch *bt;
+
+	job = nil;
+	pthread_join(j->thr, nil);
+	while ((bt = j->head) != nil) {
+		j->head = bt->next;
+		batchfree(bt);
+	}
+	pthread_cond_destroy(&j->cv);
+	pthread_mutex_destroy(&j->mu);
+	(void)close(j->fd);
+	free(j);
+}
+
+int
+loadstart(Eek *e, const char *path)
+{
+	struct stat st;
+	Loadjob *j;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)LOADPROGRESSIVE) {
+		(void)close(fd);
+		return -1;
+	}
+	j = calloc(1, sizeof *j);
+	if (j == nil) {
+		(void)close(fd);
+		return -1;
+	}
+	j->e = e;
+	j->fd = fd;
+	j->size = (size_t)st.st_size;
+	j->first = 1;
+	pthread_mutex_init(&j->mu, nil);
+	pthread_cond_init(&j->cv, nil);
+	if (pthread_create(&j->thr, nil, loadthread, j) != 0) {
+		pthread_cond_destroy(&j->cv);
+		pthread_mutex_destroy(&j->mu);
+		(void)close(fd);
+		free(j);
+		return -1;
+	}
+	job = j;
+	buffree(&e->b);
+	bufinit(&e->b);
+
+	/* Wait for the first screens; the rest streams in. */
+	pthread_mutex_lock(&j->mu);
+	while (j->head == nil && !j->finished)
+		pthread_cond_wait(&j->cv, &j->mu);
+	pthread_mutex_unlock(&j->mu);
+	loaddrain(e);
+	return 0;
+}
+
+void
+loaddrain(Eek *e)
+{
+	Loadjob *j;
+	Loadbatch *bt, *next;
+	int finished;
+
+	j = job;
+	if (j == nil)
+		return;
+	pthread_mutex_lock(&j->mu);
+	bt = j->head;
+	j->head = j->tail = nil;
+	finished = j->finished;
+	pthread_mutex_unlock(&j->mu);
+
+	for (; bt != nil; bt = next) {
+		next = bt->next;
+		if (bufadopt(&e->b, bt->line, bt->n) < 0)
+			die("Out of memory");
+		/* bufinit's empty line stands in until the first batch. */
+		if (j->first) {
+			(void)bufdelline(&e->b, 0);
+			j->first = 0;
+		}
+		free(bt->line);
+		free(bt);
+	}
+	if (!finished)
+		return;
+
+	if (j->err != 0) {
+		setmsg(e, "Read failed: %s", strerror(j->err));
+	} else if (!e->dirty) {
+		/* Nothing was edited while loading: the buffer is the file. */
+		bufmarkclean(&e->b, nil);
+		e->b.disk = j->stamp;
+		e->b.clean = j->clean;
+		e->b.cleanoff = j->cleanoff;
+	}
+	loadfinish(j);
+}
+
+void
+loadwait(Eek *e)
+{
+	Loadjob *j;
+
+	while ((j = job) != nil) {
+		pthread_mutex_lock(&j->mu);
+		while (j->head == nil && !j->finished)
+			pthread_cond_wait(&j->cv, &j->mu);
+		pthread_mutex_unlock(&j->mu);
+		loaddrain(e);
+	}
+}
+
+void
+loadcancel(void)
+{
+	Loadjob *j;
+
+	j = job;
+	if (j == nil)
+		return;
+	pthread_mutex_lock(&j->mu);
+	j->cancel = 1;
+	pthread_mutex_unlock(&j->mu);
+	loadfinish(j);
+}
+
+int
+loadstatus(char *buf, size_t n)
+{
+	size_t done;
+	int pct;
+
+	if (job == nil)
+		return 0;
+	pthread_mutex_lock(&job->mu);
+	done = job->done;
+	pthread_mutex_unlock(&job->mu);
+	pct = job->size > 0 ? (int)((double)done * 100 / (double)job->size) : 100;
+	if (pct > 100)
+		pct = 100;
+	snprintf(buf, n, " [loading %d%%]", pct);
+	return 1;
+}
@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ev.h"
+#include "mem.h"
+#include "util.h"
+
+static const char *memname[Nmem] = {
+	"line", "linearr", "undo", "reg", "render", "apply", "map", "brack", "other",
+};
+
+static long long live[Nmem + 1]; /* live[Nmem] is the total. */
+static long long peak[Nmem + 1];
+static FILE *logfp;
+static long logtimer;
+
+void
+memcount(int tag, long long delta)
+{
+	if (tag < 0 || tag >= Nmem)
+		tag = Memother;
+	live[tag] += delta;
+	live[Nmem] += delta;
+	if (live[tag] > peak[tag])
+		peak[tag] = live[tag];
+	if (live[Nmem] > peak[Nmem])
+		peak[Nmem] = live[Nmem];
+}
+
+void *
+memalloc(int tag, size_t n)
+{
+	void *p;
+
+	p = malloc(n);
+	if (p != nil)
+		memcount(tag, (long long)n);
+	return p;
+}
+
+void *
+memrealloc(int tag, void *p, size_t old, size_t n)
+{
+	void *q;
+
+	q = realloc(p, n);
+	if (q != nil)
+		memcount(tag, (long long)n - (long long)(p != nil ? old : 0));
+	return q;
+}
+
+void
+memfree(int tag, void *p, size_t n)
+{
+	if (p == nil)
+		return;
+	memcount(tag, -(long long)n);
+	free(p);
+}
+
+char *
+memstrdup(int tag, const char *s)
+{
+	char *p;
+	size_t n;
+
+	n = strlen(s) + 1;
+	p = memalloc(tag, n);
+	if (p != nil)
+		memcpy(p, s, n);
+	return p;
+}
+
+long long
+memlive(int tag)
+{
+	if (tag < 0 || tag > Nmem)
+		return 0;
+	return live[tag];
+}
+
+long long
+mempeak(int tag)
+{
+	if (tag < 0 || tag > Nmem)
+		return 0;
+	return peak[tag];
+}
+
+void
+memfmt(char *buf, size_t n, long long v)
+{
+	static const char unit[] = "BKMGT";
+	double d;
+	int u;
+
+	d = (double)v;
+	for (u = 0; u < 4 && (d >= 1024 || d <= -1024); u++)
+		d /= 1024;
+	if (u == 0)
+		snprintf(buf, n, "%lld", v);
+	else
+		snprintf(buf, n, "%.1f%c", d, unit[u]);
+}
+
+void
+memsummary(char *buf, size_t n)
+{
+	char a[16], b[16];
+	size_t off;
+	int i, w;
+
+	memfmt(a, sizeof a, live[Nmem]);
+	memfmt(b, sizeof b, peak[Nmem]);
+	w = snprintf(buf, n, "mem %s (peak %s):", a, b);
+	if (w < 0)
+		return;
+	for (off = (size_t)w, i = 0; i < Nmem && off < n; i++) {
+		if (peak[i] == 0)
+			continue;
+		memfmt(a, sizeof a, live[i]);
+		memfmt(b, sizeof b, peak[i]);
+		w = snprintf(buf + off, n - off, " %s %s/%s", memname[i], a, b);
+		if (w < 0)
+			break;
+		off += (size_t)w;
+	}
+}
+
+/*
+ * logtick writes one log line: unix time, total and live bytes per tag.
+ */
+static void
+logtick(void *arg)
+{
+	int i;
+
+	(void)arg;
+	if (logfp == nil)
+		return;
+	fprintf(logfp, "%lld total=%lld", (long long)time(nil), live[Nmem]);
+	for (i = 0; i < Nmem; i++)
+		fprintf(logfp, " %s=%lld", memname[i], live[i]);
+	fputc('\n', logfp);
+	fflush(logfp);
+}
+
+int
+memlog(const char *path, long secs)
+{
+	FILE *fp;
+	long id;
+
+	if (path == nil) {
+		evdeltimer(logtimer);
+		logtimer = 0;
+		if (logfp != nil)
+			fclose(logfp);
+		logfp = nil;
+		return 0;
+	}
+	if (secs <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	fp = fopen(path, "a");
+	if (fp == nil)
+		return -1;
+	id = evaddtimer(secs * 1000, secs * 1000, logtick, nil);
+	if (id < 0) {
+		fclose(fp);
+		errno = ENOMEM;
+		return -1;
+	}
+	memlog(nil, 0);
+	logfp = fp;
+	logtimer = id;
+	logtick(nil);
+	return 0;
+}
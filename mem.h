@@ -0,0 +1,96 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/*
+ * Memory accounting
+ *
+ * Long-lived allocations go through these wrappers, tagged by the
+ * subsystem that owns them, so :mem can show where the bytes are. The
+ * caller passes the block size to memfree/memrealloc (it always knows the
+ * capacity), so there are no hidden headers. Counters are only touched
+ * from the main thread; other threads hand sizes over with memcount once
+ * their results are adopted.
+ */
+
+/* Subsystems. */
+enum {
+	Memline,    /* Line bytes of the live buffers. */
+	Memlinearr, /* Line arrays of the live buffers. */
+	Memundo,    /* Undo stacks and their buffer snapshots. */
+	Memreg,     /* Yank register and block-insert text. */
+	Memrender,  /* Terminal output buffer. */
+	Memapply,   /* :apply input and output. */
+	Memmap,     /* Key mappings. */
+	Membrack,   /* Bracket indexes of the live buffers. */
+	Memother,   /* Everything else that is counted (tab list, ...). */
+	Nmem,
+};
+
+/*
+ * memalloc allocates n bytes charged to tag.
+ *
+ * Returns:
+ *  - the block, or nil on failure (nothing is charged).
+ */
+void *memalloc(int tag, size_t n);
+
+/*
+ * memrealloc resizes p (old bytes) to n bytes charged to tag.
+ *
+ * Returns:
+ *  - the new block, or nil on failure (p and the counters are unchanged).
+ */
+void *memrealloc(int tag, void *p, size_t old, size_t n);
+
+/*
+ * memfree releases p, an n byte block charged to tag.
+ */
+void memfree(int tag, void *p, size_t n);
+
+/*
+ * memstrdup copies s into a strlen(s) + 1 byte block charged to tag.
+ *
+ * Returns:
+ *  - the copy, or nil on failure.
+ */
+char *memstrdup(int tag, const char *s);
+
+/*
+ * memcount adjusts the live bytes of tag by delta. It accounts memory
+ * allocated elsewhere (adopted blocks, bulk loads) and moves bytes between
+ * tags (-n on one, +n on the other).
+ */
+void memcount(int tag, long long delta);
+
+/*
+ * memlive returns the live bytes of tag, or of all tags for Nmem.
+ */
+long long memlive(int tag);
+
+/*
+ * mempeak returns the high-water mark of tag, or of the total for Nmem.
+ */
+long long mempeak(int tag);
+
+/*
+ * memfmt formats v bytes as a short human-readable size ("12.3M").
+ */
+void memfmt(char *buf, size_t n, long long v);
+
+/*
+ * memsummary formats live/peak bytes per subsystem into buf (one line).
+ */
+void memsummary(char *buf, size_t n);
+
+/*
+ * memlog appends a line of live bytes per subsystem to path every secs
+ * seconds (driven by an event loop timer). A nil path stops logging.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+int memlog(const char *path, long secs);
+
+#endif /* MEM_H */
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 
 #include "eek_internal.h"
@@ -144,135 +145,294 @@ linelen(Eek *e, long y)
 }
 
 /*
- * prevutf8 returns the previous UTF-8 codepoint boundary at or before at.
+ * Word-at-a-time (SWAR) byte tests: Swarhi has the top bit of every byte
+ * of a uint64_t set, and swarzero(v) is non-zero iff some byte of v is 0.
+ */
+#define Swarone ((uint64_t)0x0101010101010101ULL)
+#define Swarhi ((uint64_t)0x8080808080808080ULL)
+#define swarzero(v) (((v) - Swarone) & ~(v) & Swarhi)
+
+/*
+ * asciirun returns the length of the leading run of s[0..n-1] that is
+ * ASCII and not a tab, eight bytes per step while it lasts.
  */
 long
-prevutf8(Eek *e, long y, long at)
+asciirun(const char *s, long n)
 {
-	Line *l;
-	unsigned char c;
+	uint64_t w;
 	long i;
-	const char *s;
-
-	l = bufgetline(&e->b, y);
-	if (l == nil)
-		return 0;
-	s = linebytes(l);
-	if (at <= 0)
-		return 0;
 
-	i = at - 1;
-	for (; i > 0; i--) {
-		c = (unsigned char)s[i];
-		if ((c & 0xc0) != 0x80)
+	i = 0;
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&w, s + i, sizeof w);
+		if ((w & Swarhi) != 0 || swarzero(w ^ (Swarone * '\t')) != 0)
 			break;
 	}
+	for (; i < n; i++)
+		if ((unsigned char)s[i] >= 0x80 || s[i] == '\t')
+			break;
 	return i;
 }
 
 /*
- * nextutf8 returns the next UTF-8 codepoint boundary after at.
+ * utf8next returns the codepoint boundary after at in s[0..n-1].
  */
 long
-nextutf8(Eek *e, long y, long at)
+utf8next(const char *s, long n, long at)
 {
-	Line *l;
 	unsigned char c;
-	long n;
-	const char *s;
-	long ln;
-
-	(void)e;
-	l = bufgetline(&e->b, y);
-	if (l == nil)
-		return 0;
-	s = linebytes(l);
-	ln = lsz(l->n);
-	if (at >= ln)
-		return ln;
+	long k;
 
+	if (at >= n)
+		return n;
 	c = (unsigned char)s[at];
 	if (c < 0x80)
-		n = 1;
+		k = 1;
 	else if ((c & 0xe0) == 0xc0)
-		n = 2;
+		k = 2;
 	else if ((c & 0xf0) == 0xe0)
-		n = 3;
+		k = 3;
 	else if ((c & 0xf8) == 0xf0)
-		n = 4;
+		k = 4;
 	else
-		n = 1;
-	if (at + n > ln)
-		return ln;
-	return at + n;
+		k = 1;
+	if (at + k > n)
+		return n;
+	return at + k;
 }
 
 /*
- * isws reports whether c is considered whitespace by motions.
+ * utf8prev returns the codepoint boundary before at in s.
  */
-int
-isws(long c)
+long
+utf8prev(const char *s, long at)
 {
-	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	long i;
+
+	if (at <= 0)
+		return 0;
+	for (i = at - 1; i > 0; i--)
+		if (((unsigned char)s[i] & 0xc0) != 0x80)
+			break;
+	return i;
 }
 
 /*
- * isword reports whether c is considered a "word" character for word motions.
+ * prevutf8 returns the previous UTF-8 codepoint boundary at or before at.
  */
-int
-isword(long c)
+long
+prevutf8(Eek *e, long y, long at)
 {
-	if (c < 0)
+	Line *l;
+
+	l = bufgetline(&e->b, y);
+	if (l == nil)
 		return 0;
-	if (c > 0x7f)
-		return 1;
-	if (isws(c))
+	return utf8prev(linebytes(l), at);
+}
+
+/*
+ * nextutf8 returns the next UTF-8 codepoint boundary after at.
+ */
+long
+nextutf8(Eek *e, long y, long at)
+{
+	Line *l;
+
+	l = bufgetline(&e->b, y);
+	if (l == nil)
 		return 0;
-	if (c == '_')
-		return 1;
-	if (c >= '0' && c <= '9')
-		return 1;
-	if (c >= 'A' && c <= 'Z')
-		return 1;
-	if (c >= 'a' && c <= 'z')
-		return 1;
-	return 0;
+	return utf8next(linebytes(l), lsz(l->n), at);
+}
+
+/*
+ * asciicls holds the word class of each ASCII byte: 0 blank, 1 word,
+ * 2 punctuation. Control bytes other than tab, newline and return are
+ * punctuation.
+ */
+static const unsigned char asciicls[128] = {
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 2, 2, 0, 2, 2, /* 0x00 */
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, /* 0x10 */
+	0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, /* ' '..'/' */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, /* '0'..'?' */
+	2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* '@'..'O' */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1, /* 'P'..'_' */
+	2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* '`'..'o' */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, /* 'p'..0x7f */
+};
+
+/*
+ * Clsrange gives the class of the runes lo..hi. Runes past ASCII that no
+ * range covers are word characters (letters, marks and digits of every
+ * script).
+ */
+typedef struct Clsrange Clsrange;
+struct Clsrange {
+	long lo;
+	long hi;
+	int cls;
+};
+
+/* Sorted and disjoint. */
+static const Clsrange clsrange[] = {
+	{ 0x00a0, 0x00a0, Clsblank },  /* No-break space. */
+	{ 0x00a1, 0x00a9, Clspunct },  /* Latin-1 punctuation and signs, */
+	{ 0x00ab, 0x00b4, Clspunct },  /* less the ordinals and micro sign. */
+	{ 0x00b6, 0x00b9, Clspunct },
+	{ 0x00bb, 0x00bf, Clspunct },
+	{ 0x00d7, 0x00d7, Clspunct },  /* Multiplication sign. */
+	{ 0x00f7, 0x00f7, Clspunct },  /* Division sign. */
+	{ 0x037e, 0x037e, Clspunct },  /* Greek question mark. */
+	{ 0x0387, 0x0387, Clspunct },  /* Greek ano teleia. */
+	{ 0x055a, 0x055f, Clspunct },  /* Armenian punctuation. */
+	{ 0x0589, 0x0589, Clspunct },  /* Armenian full stop. */
+	{ 0x05be, 0x05be, Clspunct },  /* Hebrew maqaf. */
+	{ 0x05c0, 0x05c0, Clspunct },  /* Hebrew paseq. */
+	{ 0x05c3, 0x05c3, Clspunct },  /* Hebrew sof pasuq. */
+	{ 0x060c, 0x060c, Clspunct },  /* Arabic comma. */
+	{ 0x061b, 0x061b, Clspunct },  /* Arabic semicolon. */
+	{ 0x061f, 0x061f, Clspunct },  /* Arabic question mark. */
+	{ 0x066a, 0x066d, Clspunct },  /* Arabic punctuation. */
+	{ 0x06d4, 0x06d4, Clspunct },  /* Arabic full stop. */
+	{ 0x0964, 0x0965, Clspunct },  /* Devanagari dandas. */
+	{ 0x1680, 0x1680, Clsblank },  /* Ogham space mark. */
+	{ 0x2000, 0x200b, Clsblank },  /* Spaces. */
+	{ 0x2010, 0x2027, Clspunct },  /* Dashes, quotes, bullets. */
+	{ 0x2028, 0x2029, Clsblank },  /* Line and paragraph separators. */
+	{ 0x202a, 0x202e, Clspunct },  /* Direction controls. */
+	{ 0x202f, 0x202f, Clsblank },  /* Narrow no-break space. */
+	{ 0x2030, 0x205e, Clspunct },  /* General punctuation. */
+	{ 0x205f, 0x205f, Clsblank },  /* Medium mathematical space. */
+	{ 0x2060, 0x206f, Clspunct },  /* Invisible operators. */
+	{ 0x20a0, 0x20cf, Clspunct },  /* Currency signs. */
+	{ 0x2100, 0x2bff, Clspunct },  /* Arrows, operators, box drawing. */
+	{ 0x2e00, 0x2e7f, Clspunct },  /* Supplemental punctuation. */
+	{ 0x3000, 0x3000, Clsblank },  /* Ideographic space. */
+	{ 0x3001, 0x3004, Clspunct },  /* CJK punctuation. */
+	{ 0x3008, 0x3020, Clspunct },  /* CJK brackets and marks. */
+	{ 0x30fb, 0x30fb, Clspunct },  /* Katakana middle dot. */
+	{ 0xfd3e, 0xfd3f, Clspunct },  /* Ornate parentheses. */
+	{ 0xfe10, 0xfe19, Clspunct },  /* Vertical forms. */
+	{ 0xfe30, 0xfe6b, Clspunct },  /* Compatibility and small forms. */
+	{ 0xfeff, 0xfeff, Clsblank },  /* Zero-width no-break space. */
+	{ 0xff01, 0xff0f, Clspunct },  /* Fullwidth ASCII punctuation. */
+	{ 0xff1a, 0xff20, Clspunct },
+	{ 0xff3b, 0xff40, Clspunct },
+	{ 0xff5b, 0xff65, Clspunct },
+	{ 0x1f000, 0x1faff, Clspunct }, /* Game pieces, symbols, emoji. */
+};
+
+/*
+ * runecls returns the word class of rune r; r < 0 is blank.
+ */
+static int
+runecls(long r)
+{
+	long lo, hi, mid;
+
+	if (r < 0)
+		return Clsblank;
+	if (r < 0x80)
+		return asciicls[r];
+	lo = 0;
+	hi = (long)(sizeof clsrange / sizeof clsrange[0]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (clsrange[mid].hi < r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < (long)(sizeof clsrange / sizeof clsrange[0]) && clsrange[lo].lo <= r)
+		return clsrange[lo].cls;
+	return Clsword;
 }
 
 /*
- * ispunctword reports whether c is considered punctuation for "punctuation
- * word" motions.
+ * wordcls returns the word class of the codepoint at s[at].
  */
 int
-ispunctword(long c)
+wordcls(const char *s, long n, long at)
 {
-	if (c < 0)
-		return 0;
-	if (c > 0x7f)
-		return 0;
-	if (isws(c))
-		return 0;
-	return !isword(c);
+	unsigned char c;
+	long r, adv;
+
+	if (at < 0 || at >= n)
+		return Clsblank;
+	c = (unsigned char)s[at];
+	if (c < 0x80)
+		return asciicls[c];
+	r = utf8dec1(s + at, n - at, &adv);
+	/* Stray and truncated bytes stay word characters. */
+	if (adv == 1)
+		return Clsword;
+	return runecls(r);
+}
+
+/*
+ * wordrun returns the end of the run of class cls starting at at.
+ */
+long
+wordrun(const char *s, long n, long at, int cls)
+{
+	unsigned char c;
+
+	while (at < n) {
+		c = (unsigned char)s[at];
+		if (c < 0x80) {
+			if (asciicls[c] != cls)
+				break;
+			at++;
+			continue;
+		}
+		if (wordcls(s, n, at) != cls)
+			break;
+		at = utf8next(s, n, at);
+	}
+	return at;
 }
 
 /*
- * peekbyte returns the byte value at (y, at) or -1 if out of range.
+ * wordrunback returns the start of the run of class cls ending at at.
  */
 long
-peekbyte(Eek *e, long y, long at)
+wordrunback(const char *s, long n, long at, int cls)
+{
+	unsigned char c;
+	long p;
+
+	while (at > 0) {
+		c = (unsigned char)s[at - 1];
+		if (c < 0x80) {
+			if (asciicls[c] != cls)
+				break;
+			at--;
+			continue;
+		}
+		p = utf8prev(s, at);
+		if (wordcls(s, n, p) != cls)
+			break;
+		at = p;
+	}
+	return at;
+}
+
+/*
+ * lineview returns the bytes of line y and sets *n to their count; an
+ * absent line is empty.
+ */
+static const char *
+lineview(Eek *e, long y, long *n)
 {
 	Line *l;
-	const char *s;
-	long ln;
 
 	l = bufgetline(&e->b, y);
-	if (l == nil)
-		return -1;
-	s = linebytes(l);
-	ln = lsz(l->n);
-	if (at < 0 || at >= ln)
-		return -1;
-	return (unsigned char)s[at];
+	if (l == nil) {
+		*n = 0;
+		return "";
+	}
+	*n = lsz(l->n);
+	return linebytes(l);
 }
 
 /*
@@ -319,60 +479,21 @@ moved(Eek *e)
 void
 movew(Eek *e)
 {
-	long c;
+	const char *s;
 	long len;
+	int cls;
 
-	for (;;) {
-		len = linelen(e, e->cy);
-		c = peekbyte(e, e->cy, e->cx);
-		if (c < 0 || e->cx >= len)
-			break;
-		if (isword(c)) {
-			for (;;) {
-				c = peekbyte(e, e->cy, e->cx);
-				if (c < 0 || !isword(c))
-					break;
-				e->cx = nextutf8(e, e->cy, e->cx);
-				if (e->cx >= len)
-					break;
-			}
-			break;
-		}
-		if (ispunctword(c)) {
-			for (;;) {
-				c = peekbyte(e, e->cy, e->cx);
-				if (c < 0 || !ispunctword(c))
-					break;
-				e->cx = nextutf8(e, e->cy, e->cx);
-				if (e->cx >= len)
-					break;
-			}
-			break;
-		}
-		break;
-	}
-
-	for (;;) {
-		len = linelen(e, e->cy);
-		c = peekbyte(e, e->cy, e->cx);
-		if (c < 0 || e->cx >= len)
-			break;
-		if (!isws(c))
-			break;
-		e->cx = nextutf8(e, e->cy, e->cx);
+	s = lineview(e, e->cy, &len);
+	if (e->cx < len) {
+		cls = wordcls(s, len, e->cx);
+		if (cls != Clsblank)
+			e->cx = wordrun(s, len, e->cx, cls);
+		e->cx = wordrun(s, len, e->cx, Clsblank);
 	}
-	for (;;) {
-		len = linelen(e, e->cy);
-		if (e->cx < len)
-			break;
-		if (e->cy + 1 >= lsz(e->b.nline))
-			break;
+	/* Off the end: the next line, even if it starts blank or is empty. */
+	if (e->cx >= len && e->cy + 1 < lsz(e->b.nline)) {
 		e->cy++;
 		e->cx = 0;
-		c = peekbyte(e, e->cy, e->cx);
-		if (c >= 0 && isws(c))
-			continue;
-		break;
 	}
 }
 
@@ -382,62 +503,35 @@ movew(Eek *e)
 void
 moveb(Eek *e)
 {
-	long c;
-	long nx;
+	const char *s;
 	long len;
-	int cls;
 
-	for (;;) {
-		len = linelen(e, e->cy);
-		if (len == 0) {
-			if (e->cy == 0)
-				return;
-			e->cy--;
-			e->cx = linelen(e, e->cy);
-			continue;
-		}
-		if (e->cx > len)
-			e->cx = len;
-		break;
+	s = lineview(e, e->cy, &len);
+	while (len == 0) {
+		if (e->cy == 0)
+			return;
+		e->cy--;
+		s = lineview(e, e->cy, &len);
+		e->cx = len;
 	}
+	if (e->cx > len)
+		e->cx = len;
 
+	/* Back over blanks and line breaks (empty lines included). */
 	for (;;) {
-		nx = prevutf8(e, e->cy, e->cx);
-		if (nx == e->cx) {
+		if (e->cx <= 0) {
 			if (e->cy == 0)
 				return;
 			e->cy--;
-			e->cx = linelen(e, e->cy);
+			s = lineview(e, e->cy, &len);
+			e->cx = len;
 			continue;
 		}
-		e->cx = nx;
-		c = peekbyte(e, e->cy, e->cx);
-		if (c < 0)
-			continue;
-		if (!isws(c))
-			break;
-	}
-
-	c = peekbyte(e, e->cy, e->cx);
-	cls = isword(c) ? 1 : (ispunctword(c) ? 2 : 0);
-	if (cls == 0)
-		return;
-
-	for (;;) {
-		nx = prevutf8(e, e->cy, e->cx);
-		if (nx == e->cx)
-			break;
-		c = peekbyte(e, e->cy, nx);
-		if (c < 0)
-			break;
-		if (cls == 1 && !isword(c))
-			break;
-		if (cls == 2 && !ispunctword(c))
-			break;
-		e->cx = nx;
-		if (e->cx == 0)
+		e->cx = utf8prev(s, e->cx);
+		if (wordcls(s, len, e->cx) != Clsblank)
 			break;
 	}
+	e->cx = wordrunback(s, len, e->cx, wordcls(s, len, e->cx));
 }
 
 /*
@@ -475,8 +569,8 @@ findfwd(Eek *e, long r, long n)
 	if (patn > ln)
 		return -1;
 
-	x = nextutf8(e, e->cy, e->cx);
-	for (; x + patn <= ln; x = nextutf8(e, e->cy, x)) {
+	x = utf8next(s, ln, e->cx);
+	for (; x + patn <= ln; x = utf8next(s, ln, x)) {
 		if (memcmp(s + x, pat, (size_t)patn) == 0) {
 			n--;
 			if (n == 0) {
@@ -527,7 +621,7 @@ findbwd(Eek *e, long r, long n)
 	if (e->cx <= 0)
 		return -1;
 
-	x = prevutf8(e, e->cy, e->cx);
+	x = utf8prev(s, e->cx);
 	for (;;) {
 		if (x + patn <= ln && memcmp(s + x, pat, (size_t)patn) == 0) {
 			n--;
@@ -538,7 +632,7 @@ findbwd(Eek *e, long r, long n)
 		}
 		if (x <= 0)
 			break;
-		x = prevutf8(e, e->cy, x);
+		x = utf8prev(s, x);
 	}
 	return -1;
 }
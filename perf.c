@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "perf.h"
+#include "util.h"
+
+#if PERF
+
+enum {
+	Histsub = 16, /* Linear sub-buckets per power of two (~6% precision). */
+	Histexp = 48, /* Powers of two covered (2^48 ns is about 3 days). */
+	Histn = Histsub * (Histexp - 3), /* Linear range plus Histexp - 4 octaves. */
+};
+
+typedef struct Hist Hist;
+struct Hist {
+	unsigned long long count; /* Samples recorded. */
+	unsigned long long sum;   /* Sum of all samples. */
+	unsigned long long max;   /* Largest sample. */
+	unsigned long long b[Histn]; /* Sample counts per bucket. */
+};
+
+static const char *stagename[Nperf] = {
+	"keyread", "nvkey", "inskey", "cmdkey", "undo", "draw", "flush", "bytes",
+};
+
+static Hist hist[Nperf];
+static unsigned long long t0[Nperf];
+static int depth[Nperf];
+
+/*
+ * nowns returns the monotonic clock in nanoseconds.
+ */
+static unsigned long long
+nowns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+ * bucket maps v to its histogram bucket: values below Histsub get one
+ * bucket each, larger ones Histsub buckets per power of two.
+ */
+static int
+bucket(unsigned long long v)
+{
+	int e;
+
+	if (v < Histsub)
+		return (int)v;
+	/* e is the index of the leading one bit; keep the 4 bits below it. */
+	for (e = 4; e < Histexp && (v >> (e + 1)) != 0; e++)
+		;
+	if (e >= Histexp)
+		return Histn - 1;
+	return Histsub + (e - 4) * Histsub + (int)((v >> (e - 4)) & (Histsub - 1));
+}
+
+/*
+ * bucketlo returns the smallest value that maps to bucket i.
+ */
+static unsigned long long
+bucketlo(int i)
+{
+	int e;
+
+	if (i < Histsub)
+		return (unsigned long long)i;
+	e = (i - Histsub) / Histsub + 4;
+	return (unsigned long long)(Histsub + (i - Histsub) % Histsub) << (e - 4);
+}
+
+void
+perfbegin(int stage)
+{
+	if (depth[stage]++ == 0)
+		t0[stage] = nowns();
+}
+
+void
+perfend(int stage)
+{
+	if (depth[stage] <= 0 || --depth[stage] > 0)
+		return;
+	perfadd(stage, nowns() - t0[stage]);
+}
+
+void
+perfadd(int stage, unsigned long long v)
+{
+	Hist *h;
+
+	h = &hist[stage];
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->b[bucket(v)]++;
+}
+
+/*
+ * percentile returns the value at quantile q (0..1) of h.
+ */
+static unsigned long long
+percentile(const Hist *h, double q)
+{
+	unsigned long long want, seen;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	want = (unsigned long long)(q * (double)h->count);
+	if (want >= h->count)
+		want = h->count - 1;
+	seen = 0;
+	for (i = 0; i < Histn; i++) {
+		seen += h->b[i];
+		if (seen > want)
+			return bucketlo(i) < h->max ? bucketlo(i) : h->max;
+	}
+	return h->max;
+}
+
+void
+perfreset(void)
+{
+	memset(hist, 0, sizeof hist);
+}
+
+void
+perfsummary(char *buf, size_t n)
+{
+	const Hist *h;
+	size_t off;
+	int i, w;
+
+	off = 0;
+	buf[0] = 0;
+	for (i = 0; i < Nperf && off < n; i++) {
+		h = &hist[i];
+		if (h->count == 0)
+			continue;
+		if (i == Perfbytes)
+			w = snprintf(buf + off, n - off, "%s %llu/%llu/%lluB ", stagename[i],
+				percentile(h, 0.5), percentile(h, 0.99), h->max);
+		else
+			w = snprintf(buf + off, n - off, "%s %llu/%llu/%lluus ", stagename[i],
+				percentile(h, 0.5) / 1000, percentile(h, 0.99) / 1000, h->max / 1000);
+		if (w < 0)
+			break;
+		off += (size_t)w;
+	}
+	if (buf[0] == 0)
+		snprintf(buf, n, "perf: no samples");
+}
+
+int
+perfdump(const char *path)
+{
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+	const Hist *h;
+	FILE *fp;
+	size_t j;
+	int i;
+
+	fp = fopen(path, "w");
+	if (fp == nil)
+		return -1;
+	fprintf(fp, "# times in ns; bytes is bytes per frame\n");
+	fprintf(fp, "stage\tcount\tmean\tp50\tp90\tp99\tp999\tmax\n");
+	for (i = 0; i < Nperf; i++) {
+		h = &hist[i];
+		fprintf(fp, "%s\t%llu\t%llu", stagename[i], h->count,
+			h->count > 0 ? h->sum / h->count : 0);
+		for (j = 0; j < sizeof q / sizeof q[0]; j++)
+			fprintf(fp, "\t%llu", percentile(h, q[j]));
+		fprintf(fp, "\t%llu\n", h->max);
+	}
+	if (fclose(fp) == EOF)
+		return -1;
+	return 0;
+}
+
+#else
+
+void
+perfreset(void)
+{
+}
+
+void
+perfsummary(char *buf, size_t n)
+{
+	snprintf(buf, n, "perf: not compiled in (set PERF in config.h)");
+}
+
+int
+perfdump(const char *path)
+{
+	(void)path;
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
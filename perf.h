@@ -0,0 +1,63 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stddef.h>
+
+/*
+ * Latency probes
+ *
+ * Hot paths are bracketed with perfbegin()/perfend(); each stage feeds a
+ * log-linear (HDR-style) histogram. With PERF set to 0 in config.h the
+ * probes expand to nothing. Include this after config.h.
+ */
+
+/* Probe stages. */
+enum {
+	Perfkeyread, /* Decoding one key from the terminal. */
+	Perfnvkey,   /* NORMAL/VISUAL key dispatch. */
+	Perfinskey,  /* INSERT key dispatch. */
+	Perfcmdkey,  /* Command-line key dispatch (including ex commands). */
+	Perfundo,    /* Taking an undo snapshot. */
+	Perfdraw,    /* Rendering a frame (including the flush). */
+	Perfflush,   /* Writing a frame to the terminal. */
+	Perfbytes,   /* Bytes written per frame (a size, not a time). */
+	Nperf,
+};
+
+#if PERF
+/*
+ * perfbegin/perfend bracket one sample of stage. Nested brackets of the
+ * same stage (recursive dispatch) are counted once, by the outermost pair.
+ */
+void perfbegin(int stage);
+void perfend(int stage);
+
+/*
+ * perfadd records value v (nanoseconds, or bytes for Perfbytes).
+ */
+void perfadd(int stage, unsigned long long v);
+#else
+#define perfbegin(stage) ((void)0)
+#define perfend(stage) ((void)0)
+#define perfadd(stage, v) ((void)0)
+#endif
+
+/*
+ * perfreset clears all histograms.
+ */
+void perfreset(void);
+
+/*
+ * perfsummary formats p50/p99/max per stage into buf (one line).
+ */
+void perfsummary(char *buf, size_t n);
+
+/*
+ * perfdump writes the full percentile table to path.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+int perfdump(const char *path);
+
+#endif /* PERF_H */
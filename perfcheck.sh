@@ -0,0 +1,135 @@
+#!/bin/sh
+# perfcheck.sh: replay the editing sessions in perf/*.keys headlessly
+# against a generated file and compare their latencies with a baseline.
+#
+# usage: perfcheck.sh [-u]
+#	-u	write the baseline instead of comparing against it
+#
+# Each script line is one command; its latency (dispatch + redraw of all
+# its keys) is reported as <session>.cmd<N>, next to <session>.total and
+# <session>.max. A metric regresses when it exceeds the baseline by more
+# than PERFTOL percent AND by more than PERFFLOOR microseconds.
+#
+# Environment:
+#	PERFTOL		allowed regression in percent (default 25)
+#	PERFFLOOR	ignore regressions below this many us (default 2000)
+#	PERFRUNS	runs per session, the fastest is kept (default 3)
+#	PERFLINES	lines in the generated file (default 200000)
+#	PERFGEOM	headless screen size (default 120x40)
+#	PERFBASE	baseline file (default perf/baseline.tsv)
+
+set -e
+
+cd "$(dirname "$0")"
+tol=${PERFTOL:-25}
+floor=${PERFFLOOR:-2000}
+runs=${PERFRUNS:-3}
+lines=${PERFLINES:-200000}
+geom=${PERFGEOM:-120x40}
+base=${PERFBASE:-perf/baseline.tsv}
+update=0
+if [ "$1" = "-u" ]; then
+	update=1
+elif [ $# -ne 0 ]; then
+	echo "usage: perfcheck.sh [-u]" >&2
+	exit 2
+fi
+if [ ! -x ./eek ]; then
+	echo "perfcheck: ./eek not built" >&2
+	exit 2
+fi
+if [ "$update" = 0 ] && [ ! -f "$base" ]; then
+	echo "perfcheck: no baseline $base (run 'make perfbaseline' first)" >&2
+	exit 2
+fi
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/eekperf.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+# Numbered lines with words, brackets and a sparse "needle" every 100 lines.
+awk -v n="$lines" 'BEGIN {
+	for (i = 1; i <= n; i++) {
+		printf "%d the quick foo jumps over foo (a[b]{c})", i
+		if (i % 100 == 0)
+			printf " needle"
+		printf "\n"
+	}
+}' > "$tmp/big.txt"
+
+: > "$tmp/raw"
+for k in perf/*.keys; do
+	s=$(basename "$k" .keys)
+	i=0
+	while [ "$i" -lt "$runs" ]; do
+		cp "$tmp/big.txt" "$tmp/file.txt"
+		./eek --headless "$geom" --keys "$k" "$tmp/file.txt" > "$tmp/out"
+		# The stats and cmd lines follow the buffer dump; keep the last set.
+		awk -v s="$s" '
+		/^stats keys=/ {
+			n = 0
+			for (i = 2; i <= NF; i++) {
+				split($i, a, "=")
+				v[a[1]] = a[2]
+			}
+			m[++n] = s ".total\t" v["total_us"] "\t-"
+			m[++n] = s ".max\t" v["max_us"] "\t-"
+			next
+		}
+		n > 0 && /^cmd [0-9]+ keys=[0-9]+ us=[0-9]+ / {
+			us = $4
+			sub(/^us=/, "", us)
+			t = $0
+			sub(/^cmd [0-9]+ keys=[0-9]+ us=[0-9]+ /, "", t)
+			m[++n] = s ".cmd" $2 "\t" us "\t" t
+		}
+		END {
+			for (i = 1; i <= n; i++)
+				print m[i]
+		}' "$tmp/out" >> "$tmp/raw"
+		i=$((i + 1))
+	done
+done
+
+# Keep the fastest run of every metric, in first-seen order.
+awk -F '\t' '{
+	if (!($1 in v)) {
+		o[++n] = $1
+		v[$1] = $2
+		t[$1] = $3
+	} else if ($2 + 0 < v[$1] + 0) {
+		v[$1] = $2
+	}
+}
+END {
+	for (i = 1; i <= n; i++)
+		printf "%s\t%s\t%s\n", o[i], v[o[i]], t[o[i]]
+}' "$tmp/raw" > "$tmp/cur"
+
+if [ "$update" = 1 ]; then
+	cp "$tmp/cur" "$base"
+	echo "perfcheck: wrote $base ($(wc -l < "$base" | tr -d ' ') metrics)"
+	exit 0
+fi
+
+awk -F '\t' -v tol="$tol" -v floor="$floor" '
+NR == FNR {
+	b[$1] = $2
+	next
+}
+{
+	if (!($1 in b)) {
+		printf "%-20s %10s %10d %8s  new     %s\n", $1, "-", $2, "-", $3
+		next
+	}
+	d = b[$1] > 0 ? ($2 - b[$1]) * 100 / b[$1] : 0
+	st = "ok"
+	if ($2 > b[$1] * (1 + tol / 100) && $2 - b[$1] > floor) {
+		st = "REGRESS"
+		bad++
+	}
+	printf "%-20s %10d %10d %+7.1f%%  %-7s %s\n", $1, b[$1], $2, d, st, $3
+}
+END {
+	printf "perfcheck: %d regression(s) (tolerance %s%%, floor %sus)\n", bad, tol, floor
+	exit bad > 0
+}' "$base" "$tmp/cur"
@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eek_internal.h"
+#include "ev.h"
+
+/*
+ * A background save: a snapshot of the buffer written by a thread to a
+ * temp file that is renamed over the target. Only one runs at a time.
+ */
+typedef struct Savejob Savejob;
+struct Savejob {
+	Eek *e;             /* Editor (for the completion message and dirty flag). */
+	Buf snap;           /* Copy-on-write snapshot being written. */
+	char *path;         /* Target file. */
+	mode_t mode;        /* Permissions if the target does not exist yet. */
+	size_t total;       /* Bytes to write. */
+	long wasdirty;      /* e->dirty when the save started. */
+	pthread_t thr;      /* Writer thread. */
+	pthread_mutex_t mu; /* Guards done, pct, finished and err. */
+	size_t done;        /* Bytes written so far. */
+	int pct;            /* Last percentage reported to the loop. */
+	int finished;       /* Non-zero once the thread is done. */
+	int err;            /* errno of the failure, or 0. */
+	BufStamp stamp;     /* The written file. */
+};
+
+static Savejob *job;
+
+/*
+ * fsyncdir makes a rename in path's directory durable (best effort).
+ */
+static void
+fsyncdir(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *slash;
+	int fd;
+
+	slash = strrchr(path, '/');
+	if (slash == nil) {
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		strcpy(dir, "/");
+	} else {
+		if ((size_t)(slash - path) >= sizeof dir)
+			return;
+		memcpy(dir, path, (size_t)(slash - path));
+		dir[slash - path] = 0;
+	}
+	fd = open(dir, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	(void)fsync(fd);
+	(void)close(fd);
+}
+
+/*
+ * atomicwrite writes b to a temp file next to path, syncs it and renames
+ * it over path, so path holds either the old or the new contents. An
+ * existing target keeps its permissions and owner; symlinks are followed.
+ *
+ * Parameters:
+ *  - b: buffer to write.
+ *  - path: target file.
+ *  - mode: permissions for a new file.
+ *  - progress: bufwrite progress callback (may be nil).
+ *  - arg: its argument.
+ *  - stamp: receives the identity of the written file.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure (errno is set).
+ */
+static int
+atomicwrite(Buf *b, const char *path, mode_t mode, BufProgress progress, void *arg, BufStamp *stamp)
+{
+	char real[PATH_MAX];
+	char tmp[PATH_MAX + 16];
+	struct stat st;
+	int fd, err;
+
+	if (realpath(path, real) != nil)
+		path = real;
+	if (snprintf(tmp, sizeof tmp, "%s.eekXXXXXX", path) >= (int)sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	if (stat(path, &st) == 0) {
+		mode = st.st_mode & 07777;
+		(void)fchown(fd, st.st_uid, st.st_gid);
+	}
+	if (fchmod(fd, mode) < 0)
+		goto fail;
+	if (bufwrite(b, fd, progress, arg) < 0)
+		goto fail;
+	if (fsync(fd) < 0 || bufstamp(fd, stamp) < 0)
+		goto fail;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmp, path) < 0)
+		goto fail;
+	fsyncdir(path);
+	return 0;
+
+	fail:
+	err = errno;
+	if (fd >= 0)
+		(void)close(fd);
+	(void)unlink(tmp);
+	errno = err;
+	return -1;
+}
+
+/*
+ * newmode returns the permissions for a newly created file.
+ */
+static mode_t
+newmode(void)
+{
+	mode_t m;
+
+	m = umask(0);
+	(void)umask(m);
+	return 0666 & ~m;
+}
+
+/*
+ * savewake runs on the loop thread after the writer reports progress or
+ * completion. Progress needs nothing but the redraw that follows; a
+ * finished job is reaped here.
+ */
+static void
+savewake(void *arg)
+{
+	Savejob *j;
+	int finished;
+
+	(void)arg;
+	j = job;
+	if (j == nil)
+		return;
+	pthread_mutex_lock(&j->mu);
+	finished = j->finished;
+	pthread_mutex_unlock(&j->mu);
+	if (finished)
+		savewait(j->e);
+}
+
+/*
+ * saveprogress is the bufwrite callback on the writer thread; it wakes
+ * the loop whenever the percentage changes.
+ */
+static void
+saveprogress(size_t done, void *arg)
+{
+	Savejob *j;
+	int pct, post;
+
+	j = arg;
+	pct = j->total > 0 ? (int)((double)done * 100 / (double)j->total) : 100;
+	pthread_mutex_lock(&j->mu);
+	j->done = done;
+	post = pct != j->pct;
+	j->pct = pct;
+	pthread_mutex_unlock(&j->mu);
+	if (post)
+		(void)evpost(savewake, nil);
+}
+
+/*
+ * savethread is the writer thread.
+ */
+static void *
+savethread(void *arg)
+{
+	Savejob *j;
+	int rc, err;
+
+	j = arg;
+	rc = atomicwrite(&j->snap, j->path, j->mode, saveprogress, j, &j->stamp);
+	err = rc < 0 ? errno : 0;
+	pthread_mutex_lock(&j->mu);
+	j->finished = 1;
+	j->err = err;
+	pthread_mutex_unlock(&j->mu);
+	(void)evpost(savewake, nil);
+	return nil;
+}
+
+int
+savesync(Eek *e, const char *path)
+{
+	BufStamp st;
+
+	savewait(e);
+	if (atomicwrite(&e->b, path, newmode(), nil, nil, &st) < 0)
+		return -1;
+	bufmarkclean(&e->b, &st);
+	return 0;
+}
+
+int
+savetail(Eek *e, const char *path)
+{
+	savewait(e);
+	/* Past half the file a safe full rewrite costs about the same. */
+	return bufsavetail(&e->b, path, e->b.cleanoff);
+}
+
+int
+savebg(Eek *e, const char *path)
+{
+	Savejob *j;
+
+	savewait(e);
+	j = calloc(1, sizeof *j);
+	if (j == nil)
+		return -1;
+	j->path = strdup(path);
+	if (j->path == nil || bufsnap(&e->b, &j->snap) < 0) {
+		free(j->path);
+		free(j);
+		return -1;
+	}
+	j->total = e->b.cleanoff;
+	j->e = e;
+	j->mode = newmode();
+	j->wasdirty = e->dirty;
+	pthread_mutex_init(&j->mu, nil);
+	if (pthread_create(&j->thr, nil, savethread, j) != 0) {
+		pthread_mutex_destroy(&j->mu);
+		bufsnapdone(&j->snap);
+		free(j->path);
+		free(j);
+		return -1;
+	}
+	/* Edits made while writing mark the buffer dirty again. */
+	e->dirty = 0;
+	job = j;
+	return 0;
+}
+
+void
+savewait(Eek *e)
+{
+	Savejob *j;
+
+	j = job;
+	if (j == nil)
+		return;
+	job = nil;
+	pthread_join(j->thr, nil);
+	bufsnapdone(&j->snap);
+	if (j->err != 0) {
+		bufmarkclean(&e->b, nil);
+		if (j->wasdirty)
+			e->dirty = 1;
+		setmsg(e, "Write failed: %s: %s", j->path, strerror(j->err));
+	} else {
+		e->b.disk = j->stamp;
+		setmsg(e, "Written %s", j->path);
+	}
+	pthread_mutex_destroy(&j->mu);
+	free(j->path);
+	free(j);
+}
+
+int
+savestatus(char *buf, size_t n)
+{
+	int pct;
+
+	if (job == nil)
+		return 0;
+	pthread_mutex_lock(&job->mu);
+	pct = job->pct;
+	pthread_mutex_unlock(&job->mu);
+	snprintf(buf, n, " [saving %d%%]", pct);
+	return 1;
+}
@@ -1,28 +1,71 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "eek.h"
+#include "mem.h"
+#include "perf.h"
 #include "util.h"
+#include "vt.h"
 
 static struct termios oldtio;
 static int haveoldtio;
 static volatile sig_atomic_t needresize;
+static const char syncbegin[] = "\x1b[?2026h";
+static const char syncend[] = "\x1b[?2026l";
+#if PERF
+static unsigned long long framebytes;
+#endif
+static int winchfd[2] = { -1, -1 };
 
 /*
- * onwinch handles SIGWINCH (terminal resize) by setting a flag.
+ * onwinch handles SIGWINCH (terminal resize) by setting a flag and
+ * poking the self-pipe so a blocked event loop wakes up immediately.
  */
 static void
 onwinch(int sig)
 {
+	int olderrno;
+
 	(void)sig;
 	needresize = 1;
+	if (winchfd[1] >= 0) {
+		olderrno = errno;
+		(void)write(winchfd[1], "", 1);
+		errno = olderrno;
+	}
+}
+
+/*
+ * winchpipe creates the non-blocking, close-on-exec SIGWINCH self-pipe.
+ *
+ * Returns:
+ *  - 0 on success, -1 on failure.
+ */
+static int
+winchpipe(void)
+{
+	int i, fl;
+
+	if (pipe(winchfd) < 0)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fl = fcntl(winchfd[i], F_GETFL);
+		if (fl < 0 || fcntl(winchfd[i], F_SETFL, fl | O_NONBLOCK) < 0)
+			return -1;
+		if (fcntl(winchfd[i], F_SETFD, FD_CLOEXEC) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 /*
@@ -52,6 +95,12 @@ terminit(Term *t)
 	t->out = nil;
 	t->outn = 0;
 	t->outcap = 0;
+	t->inframe = 0;
+	t->attr = -1;
+	t->fg = -1;
+	t->bg = -1;
+	t->fdwinch = -1;
+	t->vt = nil;
 
 	if (tcgetattr(t->fdin, &oldtio) < 0)
 		die("tcgetattr: %s", strerror(errno));
@@ -63,6 +112,10 @@ terminit(Term *t)
 	if (tcsetattr(t->fdin, TCSAFLUSH, &tio) < 0)
 		die("tcsetattr: %s", strerror(errno));
 
+	if (winchpipe() < 0)
+		die("pipe: %s", strerror(errno));
+	t->fdwinch = winchfd[0];
+
 	memset(&sa, 0, sizeof sa);
 	sa.sa_handler = onwinch;
 	(void)sigemptyset(&sa.sa_mask);
@@ -73,6 +126,112 @@ terminit(Term *t)
 	termgetwinsz(t);
 }
 
+/*
+ * writeall writes every byte described by iov[0..n-1] to fd.
+ * Short writes are resumed and EAGAIN waits for POLLOUT, so this works
+ * on both blocking and non-blocking descriptors. iov is consumed.
+ *
+ * Returns:
+ *  - 0 on success, -1 on a hard write error.
+ */
+static int
+writeall(int fd, struct iovec *iov, int n)
+{
+	struct pollfd p;
+	ssize_t w;
+
+	while (n > 0) {
+		w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			p.fd = fd;
+			p.events = POLLOUT;
+			p.revents = 0;
+			if (poll(&p, 1, -1) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+		for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+			w -= (ssize_t)iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= (size_t)w;
+		}
+	}
+	return 0;
+}
+
+/*
+ * termdrain writes the buffered output followed by extra[0..extran-1].
+ * The first write of a frame opens a synchronized update; end closes it.
+ *
+ * Parameters:
+ *  - t: terminal.
+ *  - extra: bytes to write after the buffer (may be nil).
+ *  - extran: length of extra in bytes.
+ *  - end: non-zero if this completes the frame.
+ */
+static void
+termdrain(Term *t, const void *extra, long extran, int end)
+{
+	struct iovec iov[4];
+	int n, i;
+
+	n = 0;
+	if (SYNCOUTPUT && !t->inframe) {
+		iov[n].iov_base = (void *)syncbegin;
+		iov[n++].iov_len = sizeof syncbegin - 1;
+	}
+	if (t->outn > 0) {
+		iov[n].iov_base = t->out;
+		iov[n++].iov_len = (size_t)t->outn;
+	}
+	if (extra != nil && extran > 0) {
+		iov[n].iov_base = (void *)extra;
+		iov[n++].iov_len = (size_t)extran;
+	}
+	if (SYNCOUTPUT && end) {
+		iov[n].iov_base = (void *)syncend;
+		iov[n++].iov_len = sizeof syncend - 1;
+	}
+#if PERF
+	for (i = 0; i < n; i++)
+		framebytes += iov[i].iov_len;
+	if (end) {
+		perfadd(Perfbytes, framebytes);
+		framebytes = 0;
+	}
+#endif
+	if (t->vt != nil) {
+		for (i = 0; i < n; i++)
+			vtwrite(t->vt, iov[i].iov_base, (long)iov[i].iov_len);
+		if (end)
+			vtframe(t->vt);
+	} else {
+		/* On a hard error drop the frame; the next draw repaints anyway. */
+		(void)writeall(t->fdout, iov, n);
+	}
+	t->outn = 0;
+	t->inframe = !end;
+}
+
+void
+termheadless(Term *t, Vt *vt)
+{
+	memset(t, 0, sizeof *t);
+	t->fdin = -1;
+	t->fdout = -1;
+	t->attr = -1;
+	t->fg = -1;
+	t->bg = -1;
+	t->fdwinch = -1;
+	t->vt = vt;
+	termgetwinsz(t);
+}
+
 /*
  * termbufensure ensures that the terminal output buffer has at least need bytes.
  */
@@ -82,32 +241,40 @@ termbufensure(Term *t, long need)
 	char *p;
 	long cap;
 
-	if (t == nil)
-		return;
 	if (need <= t->outcap)
 		return;
 	cap = t->outcap > 0 ? t->outcap : 4096;
-	for (; cap < need; cap *= 2) {
-		if (cap > (1L << 26))
-			break;
-	}
-	p = realloc(t->out, (size_t)cap);
+	while (cap < need)
+		cap *= 2;
+	p = memrealloc(Memrender, t->out, (size_t)t->outcap, (size_t)cap);
 	if (p == nil)
 		return;
 	t->out = p;
 	t->outcap = cap;
 }
 
+/*
+ * termwrite appends data to the frame buffer. Frames that outgrow
+ * OUTCHUNK (or the available memory) are streamed to the terminal in
+ * pieces instead of being dropped.
+ */
 void
 termwrite(Term *t, const void *data, long n)
 {
 	if (t == nil || data == nil || n <= 0)
 		return;
-	if (t->outn + n < t->outn)
-		return;
+	if (t->outn + n > OUTCHUNK) {
+		if (n >= OUTCHUNK) {
+			termdrain(t, data, n, 0);
+			return;
+		}
+		termdrain(t, nil, 0, 0);
+	}
 	termbufensure(t, t->outn + n);
-	if (t->outcap < t->outn + n)
+	if (t->outcap < t->outn + n) {
+		termdrain(t, data, n, 0);
 		return;
+	}
 	memcpy(t->out + t->outn, data, (size_t)n);
 	t->outn += n;
 }
@@ -136,7 +303,8 @@ termrepeat(Term *t, char c, int n)
 }
 
 /*
- * termresized reports whether a SIGWINCH has occurred since the last call.
+ * termresized reports whether a SIGWINCH has occurred since the last call
+ * and drains the self-pipe.
  *
  * Returns:
  *  1 if a resize was observed, 0 otherwise.
@@ -144,8 +312,13 @@ termrepeat(Term *t, char c, int n)
 int
 termresized(void)
 {
+	char buf[64];
 	int r;
 
+	if (winchfd[0] >= 0) {
+		while (read(winchfd[0], buf, sizeof buf) > 0)
+			;
+	}
 	r = needresize;
 	needresize = 0;
 	return r;
@@ -178,12 +351,99 @@ termgetwinsz(Term *t)
 {
 	struct winsize ws;
 
+	if (t->vt != nil) {
+		t->row = t->vt->rows;
+		t->col = t->vt->cols;
+		return;
+	}
 	if (ioctl(t->fdout, TIOCGWINSZ, &ws) < 0)
 		die("ioctl(TIOCGWINSZ): %s", strerror(errno));
 	t->row = ws.ws_row;
 	t->col = ws.ws_col;
 }
 
+/*
+ * sgrparam appends one SGR parameter (with separator) to buf at *n.
+ */
+static void
+sgrparam(char *buf, int *n, int sz, int v)
+{
+	int r;
+
+	r = snprintf(buf + *n, (size_t)(sz - *n), *n > 2 ? ";%d" : "%d", v);
+	if (r > 0 && *n + r < sz)
+		*n += r;
+}
+
+/*
+ * sgrcolor appends the SGR parameters selecting color c (-1 for the
+ * default) to buf. base is 30 for foreground, 40 for background.
+ */
+static void
+sgrcolor(char *buf, int *n, int sz, int base, int c)
+{
+	if (c < 0) {
+		sgrparam(buf, n, sz, base + 9);
+	} else if (c < 8) {
+		sgrparam(buf, n, sz, base + c);
+	} else {
+		sgrparam(buf, n, sz, base + 8);
+		sgrparam(buf, n, sz, 5);
+		sgrparam(buf, n, sz, c & 0xff);
+	}
+}
+
+void
+termattr(Term *t, int attr, int fg, int bg)
+{
+	static const struct {
+		int bit; /* Attr* bit. */
+		int on;  /* SGR parameter turning it on. */
+		int off; /* SGR parameter turning it off. */
+	} sgr[] = {
+		{ Attrbold, 1, 22 },
+		{ Attrunderline, 4, 24 },
+		{ Attrinverse, 7, 27 },
+	};
+	char buf[64];
+	int old, ofg, obg;
+	int n, i;
+
+	if (t == nil)
+		return;
+	if (t->attr == attr && t->fg == fg && t->bg == bg)
+		return;
+
+	buf[0] = '\x1b';
+	buf[1] = '[';
+	n = 2;
+	old = t->attr;
+	ofg = t->fg;
+	obg = t->bg;
+	if (old < 0 || (attr == 0 && fg < 0 && bg < 0)) {
+		/* Reset: a bare "\x1b[m" when nothing else is wanted. */
+		if (attr != 0 || fg >= 0 || bg >= 0)
+			sgrparam(buf, &n, sizeof buf, 0);
+		old = 0;
+		ofg = obg = -1;
+	}
+	for (i = 0; i < (int)(sizeof sgr / sizeof sgr[0]); i++) {
+		if ((old & sgr[i].bit) && !(attr & sgr[i].bit))
+			sgrparam(buf, &n, sizeof buf, sgr[i].off);
+		else if (!(old & sgr[i].bit) && (attr & sgr[i].bit))
+			sgrparam(buf, &n, sizeof buf, sgr[i].on);
+	}
+	if (fg != ofg)
+		sgrcolor(buf, &n, sizeof buf, 30, fg);
+	if (bg != obg)
+		sgrcolor(buf, &n, sizeof buf, 40, bg);
+	buf[n++] = 'm';
+	termwrite(t, buf, n);
+	t->attr = attr;
+	t->fg = fg;
+	t->bg = bg;
+}
+
 /*
  * termclear clears the screen and homes the cursor.
  *
@@ -220,29 +480,19 @@ termmoveto(Term *t, int r, int c)
 }
 
 /*
- * termflush is a placeholder for buffered terminal backends.
+ * termflush writes the buffered frame and closes the synchronized update.
  *
  * Parameters:
- *  t: terminal state (currently unused).
+ *  t: terminal state.
  */
 void
 termflush(Term *t)
 {
-	long off;
-	ssize_t w;
-
 	if (t == nil)
 		return;
-	if (t->out == nil || t->outn <= 0) {
-		t->outn = 0;
+	if (t->outn <= 0 && !t->inframe)
 		return;
-	}
-	for (off = 0; off < t->outn; ) {
-		w = write(t->fdout, t->out + off, (size_t)(t->outn - off));
-		if (w <= 0)
-			break;
-		off += (long)w;
-	}
-	/* Drop the frame even if partial; next draw will repaint anyway. */
-	t->outn = 0;
+	perfbegin(Perfflush);
+	termdrain(t, nil, 0, 1);
+	perfend(Perfflush);
 }
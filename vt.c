@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eek.h"
+#include "util.h"
+#include "vt.h"
+
+/* Parser states. */
+enum {
+	Vtground,
+	Vtesc,
+	Vtcsi,
+};
+
+int
+vtinit(Vt *vt, int rows, int cols)
+{
+	long i;
+
+	memset(vt, 0, sizeof *vt);
+	if (rows < 2 || cols < 1 || rows > 10000 || cols > 10000)
+		return -1;
+	vt->cell = malloc((size_t)rows * (size_t)cols * sizeof vt->cell[0]);
+	if (vt->cell == nil)
+		return -1;
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->showcursor = 1;
+	for (i = 0; i < (long)rows * cols; i++) {
+		vt->cell[i].s[0] = ' ';
+		vt->cell[i].n = 1;
+		vt->cell[i].attr = 0;
+	}
+	return 0;
+}
+
+void
+vtfree(Vt *vt)
+{
+	free(vt->cell);
+	vt->cell = nil;
+}
+
+/*
+ * vterase blanks cells [from, to) in row-major order.
+ */
+static void
+vterase(Vt *vt, long from, long to)
+{
+	long max;
+
+	max = (long)vt->rows * vt->cols;
+	if (from < 0)
+		from = 0;
+	if (to > max)
+		to = max;
+	for (; from < to; from++) {
+		vt->cell[from].s[0] = ' ';
+		vt->cell[from].n = 1;
+		vt->cell[from].attr = (unsigned char)vt->attr;
+	}
+}
+
+/*
+ * vtput stores the glyph s[0..n-1] at the cursor and advances it.
+ * Output past the right margin is dropped; eek never relies on wrapping.
+ */
+static void
+vtput(Vt *vt, const unsigned char *s, int n)
+{
+	Cell *c;
+
+	if (vt->cy < 0 || vt->cy >= vt->rows || vt->cx < 0 || vt->cx >= vt->cols) {
+		vt->cx++;
+		return;
+	}
+	c = &vt->cell[(long)vt->cy * vt->cols + vt->cx];
+	memcpy(c->s, s, (size_t)n);
+	c->n = (unsigned char)n;
+	c->attr = (unsigned char)vt->attr;
+	vt->cx++;
+}
+
+/*
+ * vtparam returns the i-th numeric CSI parameter, or def if missing/0.
+ */
+static int
+vtparam(Vt *vt, int i, int def)
+{
+	const char *p;
+	int v;
+
+	p = vt->par;
+	if (*p == '?' || *p == '>')
+		p++;
+	for (; i > 0; i--) {
+		p = strchr(p, ';');
+		if (p == nil)
+			return def;
+		p++;
+	}
+	v = atoi(p);
+	return v > 0 ? v : def;
+}
+
+/*
+ * vtsgr applies an SGR sequence to the current attributes.
+ * Colors are accepted but not modelled.
+ */
+static void
+vtsgr(Vt *vt)
+{
+	const char *p;
+	int v[16];
+	int n, i;
+
+	n = 0;
+	for (p = vt->par; n < (int)(sizeof v / sizeof v[0]); p++) {
+		v[n++] = atoi(p);
+		p = strchr(p, ';');
+		if (p == nil)
+			break;
+	}
+	for (i = 0; i < n; i++) {
+		switch (v[i]) {
+		case 0: vt->attr = 0; break;
+		case 1: vt->attr |= Attrbold; break;
+		case 4: vt->attr |= Attrunderline; break;
+		case 7: vt->attr |= Attrinverse; break;
+		case 22: vt->attr &= ~Attrbold; break;
+		case 24: vt->attr &= ~Attrunderline; break;
+		case 27: vt->attr &= ~Attrinverse; break;
+		case 38:
+		case 48:
+			/* Skip the extended color arguments (5;n or 2;r;g;b). */
+			if (i + 1 < n && v[i + 1] == 5)
+				i += 2;
+			else if (i + 1 < n && v[i + 1] == 2)
+				i += 4;
+			break;
+		}
+	}
+}
+
+/*
+ * vtcsi executes a complete CSI sequence with final byte f.
+ */
+static void
+vtcsi(Vt *vt, int f)
+{
+	int priv;
+	int n;
+
+	priv = vt->par[0] == '?';
+	switch (f) {
+	case 'H':
+	case 'f':
+		vt->cy = vtparam(vt, 0, 1) - 1;
+		vt->cx = vtparam(vt, 1, 1) - 1;
+		if (vt->cy >= vt->rows)
+			vt->cy = vt->rows - 1;
+		if (vt->cx >= vt->cols)
+			vt->cx = vt->cols - 1;
+		break;
+	case 'A': vt->cy -= vtparam(vt, 0, 1); if (vt->cy < 0) vt->cy = 0; break;
+	case 'B': vt->cy += vtparam(vt, 0, 1); if (vt->cy >= vt->rows) vt->cy = vt->rows - 1; break;
+	case 'C': vt->cx += vtparam(vt, 0, 1); if (vt->cx >= vt->cols) vt->cx = vt->cols - 1; break;
+	case 'D': vt->cx -= vtparam(vt, 0, 1); if (vt->cx < 0) vt->cx = 0; break;
+	case 'J':
+		n = atoi(vt->par);
+		if (n == 2 || n == 3)
+			vterase(vt, 0, (long)vt->rows * vt->cols);
+		else if (n == 1)
+			vterase(vt, 0, (long)vt->cy * vt->cols + vt->cx + 1);
+		else
+			vterase(vt, (long)vt->cy * vt->cols + vt->cx, (long)vt->rows * vt->cols);
+		break;
+	case 'K':
+		n = atoi(vt->par);
+		if (vt->cy < 0 || vt->cy >= vt->rows)
+			break;
+		if (n == 2)
+			vterase(vt, (long)vt->cy * vt->cols, (long)(vt->cy + 1) * vt->cols);
+		else if (n == 1)
+			vterase(vt, (long)vt->cy * vt->cols, (long)vt->cy * vt->cols + vt->cx + 1);
+		else if (vt->cx < vt->cols)
+			vterase(vt, (long)vt->cy * vt->cols + vt->cx, (long)(vt->cy + 1) * vt->cols);
+		break;
+	case 'm':
+		if (!priv)
+			vtsgr(vt);
+		break;
+	case 'h':
+	case 'l':
+		if (priv && vtparam(vt, 0, 0) == 25)
+			vt->showcursor = f == 'h';
+		break;
+	default:
+		/* Cursor shape (SP q), synchronized output, etc.: no screen effect. */
+		break;
+	}
+}
+
+void
+vtwrite(Vt *vt, const char *s, long n)
+{
+	unsigned char c;
+	long i;
+
+	vt->nbytes += n;
+	for (i = 0; i < n; i++) {
+		c = (unsigned char)s[i];
+		switch (vt->state) {
+		case Vtesc:
+			if (c == '[') {
+				vt->state = Vtcsi;
+				vt->npar = 0;
+				vt->par[0] = 0;
+			} else {
+				vt->state = Vtground;
+			}
+			continue;
+		case Vtcsi:
+			if (c >= 0x40 && c <= 0x7e) {
+				vt->par[vt->npar] = 0;
+				vtcsi(vt, c);
+				vt->state = Vtground;
+			} else if (vt->npar + 1 < (int)sizeof vt->par) {
+				vt->par[vt->npar++] = (char)c;
+			}
+			continue;
+		}
+
+		if (vt->un > 0) {
+			if ((c & 0xc0) == 0x80) {
+				vt->u[vt->un++] = c;
+				if (vt->un == vt->uneed) {
+					vtput(vt, vt->u, vt->un);
+					vt->un = 0;
+				}
+				continue;
+			}
+			/* Truncated sequence: drop it and treat c normally. */
+			vt->un = 0;
+		}
+		if (c == 0x1b) {
+			vt->state = Vtesc;
+		} else if (c == '\r') {
+			vt->cx = 0;
+		} else if (c == '\n') {
+			if (vt->cy + 1 < vt->rows)
+				vt->cy++;
+		} else if (c == '\b') {
+			if (vt->cx > 0)
+				vt->cx--;
+		} else if (c < 0x20 || c == 0x7f) {
+			/* Other controls have no visible effect. */
+		} else if (c < 0x80) {
+			vtput(vt, &c, 1);
+		} else {
+			vt->uneed = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 1;
+			vt->u[0] = c;
+			vt->un = 1;
+			if (vt->uneed == 1) {
+				vtput(vt, vt->u, 1);
+				vt->un = 0;
+			}
+		}
+	}
+}
+
+void
+vtframe(Vt *vt)
+{
+	vt->nframes++;
+}
+
+void
+vtdump(Vt *vt, FILE *fp)
+{
+	Cell *row;
+	int y, x, w;
+
+	for (y = 0; y < vt->rows; y++) {
+		row = &vt->cell[(long)y * vt->cols];
+		for (w = vt->cols; w > 0; w--) {
+			if (!(row[w - 1].n == 1 && row[w - 1].s[0] == ' '))
+				break;
+		}
+		for (x = 0; x < w; x++)
+			fwrite(row[x].s, 1, row[x].n, fp);
+		fputc('\n', fp);
+	}
+}
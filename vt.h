@@ -0,0 +1,68 @@
+#ifndef VT_H
+#define VT_H
+
+#include <stdio.h>
+
+/*
+ * In-memory terminal screen.
+ *
+ * Interprets the subset of VT100/xterm sequences eek emits (cursor
+ * addressing, erase, SGR, private modes) so the editor can run without a
+ * tty and the resulting screen can be inspected.
+ */
+
+typedef struct Cell Cell;
+struct Cell {
+	char s[4];     /* UTF-8 bytes of the glyph (s[0] == ' ' when blank). */
+	unsigned char n; /* Number of bytes used in s. */
+	unsigned char attr; /* Attr* bits in effect when the cell was written. */
+};
+
+typedef struct Vt Vt;
+struct Vt {
+	int rows;          /* Screen height. */
+	int cols;          /* Screen width. */
+	Cell *cell;        /* rows*cols cells, row-major. */
+	int cy;            /* Cursor row (0-based). */
+	int cx;            /* Cursor column (0-based). */
+	int attr;          /* Current Attr* bits. */
+	int showcursor;    /* Non-zero unless hidden with ?25l. */
+	int state;         /* Parser state. */
+	char par[64];      /* Collected CSI parameter bytes. */
+	int npar;          /* Bytes used in par. */
+	unsigned char u[4]; /* Pending UTF-8 sequence. */
+	int un;            /* Bytes collected in u. */
+	int uneed;         /* Total bytes expected for the pending sequence. */
+	long long nbytes;  /* Bytes received. */
+	long nframes;      /* Frames completed (see vtframe). */
+};
+
+/*
+ * vtinit allocates a blank rows x cols screen.
+ *
+ * Returns:
+ *  - 0 on success, -1 on invalid size or allocation failure.
+ */
+int vtinit(Vt *vt, int rows, int cols);
+
+/*
+ * vtfree releases the screen.
+ */
+void vtfree(Vt *vt);
+
+/*
+ * vtwrite feeds terminal output bytes to the screen model.
+ */
+void vtwrite(Vt *vt, const char *s, long n);
+
+/*
+ * vtframe records the end of one frame.
+ */
+void vtframe(Vt *vt);
+
+/*
+ * vtdump prints the screen rows (trailing blanks trimmed) to fp.
+ */
+void vtdump(Vt *vt, FILE *fp);
+
+#endif /* VT_H */